@@ -42,6 +42,7 @@
 
 #if GDEF_OS_LINUX || GDEF_OS_MACOS
 #include <unistd.h>
+#include <sys/time.h>
 #endif
 
 #ifdef NeXT
@@ -288,6 +289,34 @@ double I_FloatTime( void ){
 #endif
 }
 
+/*
+   ================
+   I_PreciseTime
+
+   wall clock seconds with sub-millisecond resolution,
+   only the difference between two calls is meaningful
+   ================
+ */
+double I_PreciseTime( void ){
+#if GDEF_OS_WINDOWS
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER count;
+
+	if ( !frequency.QuadPart ) {
+		QueryPerformanceFrequency( &frequency );
+	}
+	QueryPerformanceCounter( &count );
+
+	return (double) count.QuadPart / (double) frequency.QuadPart;
+#else
+	struct timeval tp;
+
+	gettimeofday( &tp, NULL );
+
+	return tp.tv_sec + tp.tv_usec / 1000000.0;
+#endif
+}
+
 void Q_getwd( char *out ){
 	int i = 0;
 
@@ -1043,6 +1072,43 @@ unsigned short CRC_Value( unsigned short crcvalue ){
 }
 //=============================================================================
 
+/*
+   ============
+   HashBytes
+
+   folds a block of memory into a pair of independent 32 bit hashes,
+   a word at a time with any odd bytes at the end
+   ============
+ */
+void HashBytes( unsigned int hash[2], const void *data, int size ){
+	const unsigned int  *words;
+	const byte          *bytes;
+	unsigned int w;
+	int i, numWords;
+
+
+	/* hash the words */
+	words = (const unsigned int*) data;
+	numWords = size >> 2;
+	for ( i = 0; i < numWords; i++ )
+	{
+		w = words[ i ];
+		hash[ 0 ] = ( hash[ 0 ] ^ w ) * 16777619u;
+		hash[ 1 ] = ( hash[ 1 ] ^ w ) * 0x5bd1e995u;
+		hash[ 1 ] ^= hash[ 1 ] >> 15;
+	}
+
+	/* hash the tail */
+	bytes = (const byte*) ( words + numWords );
+	for ( i = 0; i < ( size & 3 ); i++ )
+	{
+		hash[ 0 ] = ( hash[ 0 ] ^ bytes[ i ] ) * 16777619u;
+		hash[ 1 ] = ( hash[ 1 ] ^ bytes[ i ] ) * 0x5bd1e995u;
+		hash[ 1 ] ^= hash[ 1 ] >> 15;
+	}
+}
+//=============================================================================
+
 /*
    ============
    CreatePath
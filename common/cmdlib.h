@@ -92,6 +92,7 @@ void ExpandWildcards( int *argc, char ***argv );
 
 
 double I_FloatTime( void );
+double I_PreciseTime( void );
 
 void    Error( const char *error, ... ) GDEF_ATTRIBUTE_NORETURN;
 int     CheckParm( const char *check );
@@ -138,6 +139,8 @@ void CRC_Init( unsigned short *crcvalue );
 void CRC_ProcessByte( unsigned short *crcvalue, byte data );
 unsigned short CRC_Value( unsigned short crcvalue );
 
+void HashBytes( unsigned int hash[2], const void *data, int size );
+
 void    CreatePath( const char *path );
 void    QCopyFile( const char *from, const char *to );
 
@@ -24,17 +24,9 @@
 #include "inout.h"
 #include "polylib.h"
 #include "qfiles.h"
+#include "qthreads.h"
 
 
-extern int numthreads;
-
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
-int c_active_windings;
-int c_peak_windings;
-int c_winding_allocs;
-int c_winding_points;
-
 #define BOGUS_RANGE WORLD_SIZE
 
 void pw( winding_t *w ){
@@ -57,17 +49,10 @@ winding_t   *AllocWinding( int points ){
 		Error( "AllocWinding failed: MAX_POINTS_ON_WINDING exceeded" );
 	}
 
-	if ( numthreads == 1 ) {
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if ( c_active_windings > c_peak_windings ) {
-			c_peak_windings = c_active_windings;
-		}
-	}
+	/* windings churn through the bsp stage, so recycle them per point count;
+	   the allocation statistics are kept by the cache (-allocstats) */
 	s = sizeof( *w ) + ( points ? sizeof( w->p[0] ) * ( points - 1 ) : 0 );
-	w = safe_malloc( s );
-	memset( w, 0, s );
+	w = ThreadCacheAlloc( CACHE_WINDING, points, s );
 	return w;
 }
 
@@ -84,15 +69,6 @@ winding_accu_t *AllocWindingAccu( int points ){
 		Error( "AllocWindingAccu failed: MAX_POINTS_ON_WINDING exceeded" );
 	}
 
-	if ( numthreads == 1 ) {
-		// At the time of this writing, these statistics were not used in any way.
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if ( c_active_windings > c_peak_windings ) {
-			c_peak_windings = c_active_windings;
-		}
-	}
 	s = sizeof( *w ) + ( points ? sizeof( w->p[0] ) * ( points - 1 ) : 0 );
 	w = safe_malloc( s );
 	memset( w, 0, s );
@@ -105,6 +81,8 @@ winding_accu_t *AllocWindingAccu( int points ){
    =============
  */
 void FreeWinding( winding_t *w ){
+	int points;
+
 	if ( !w ) {
 		Error( "FreeWinding: winding is NULL" );
 	}
@@ -112,12 +90,11 @@ void FreeWinding( winding_t *w ){
 	if ( *(unsigned *)w == 0xdeaddead ) {
 		Error( "FreeWinding: freed a freed winding" );
 	}
+	points = w->numpoints;
 	*(unsigned *)w = 0xdeaddead;
 
-	if ( numthreads == 1 ) {
-		c_active_windings--;
-	}
-	free( w );
+	/* a winding only ever shrinks in place, so it still holds its current point count */
+	ThreadCacheFree( CACHE_WINDING, points, w );
 }
 
 /*
@@ -135,9 +112,6 @@ void FreeWindingAccu( winding_accu_t *w ){
 	}
 	*( (unsigned *) w ) = 0xdeaddead;
 
-	if ( numthreads == 1 ) {
-		c_active_windings--;
-	}
 	free( w );
 }
 
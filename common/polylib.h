@@ -28,6 +28,9 @@ typedef struct
 
 #define MAX_POINTS_ON_WINDING   512
 
+/* ThreadCacheAlloc() cache of AllocWinding, the tools number theirs from 1 */
+#define CACHE_WINDING           0
+
 // you can define on_epsilon in the makefile as tighter
 #ifndef ON_EPSILON
 #define ON_EPSILON  0.1
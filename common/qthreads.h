@@ -21,8 +21,28 @@
 
 
 extern int numthreads;
+extern qboolean legacydispatch;
+
+/* per-thread scratch buffers that survive across phases, see ThreadScratch() */
+#define MAX_THREAD_SCRATCH  16
+
+/* per-thread object caches (one per object type) and size classes, see ThreadCacheAlloc() and ThreadArenaAlloc() */
+#define MAX_THREAD_CACHES           8
+#define MAX_THREAD_CACHE_CLASSES    64
+
+extern qboolean allocstats;
 
 void ThreadSetDefault( void );
+void ThreadPoolInit( void );
+void *ThreadScratch( int slot, size_t size );
+double ThreadBusyTime( int threadnum );
+void ResetThreadBusyTime( void );
+void *ThreadCacheAlloc( int cache, int sizeClass, size_t size );
+void ThreadCacheFree( int cache, int sizeClass, void *p );
+void *ThreadArenaAlloc( int cache, size_t size );
+void ThreadArenaFree( int cache, void *p );
+void ThreadCacheRelease( void );
+void PrintThreadCacheStats( int cache, const char *name );
 int GetThreadWork( void );
 void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, void ( *func )( int ) );
 void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) );
@@ -42,6 +42,297 @@ qboolean pacifier;
 
 qboolean threaded;
 
+/* index of the worker running on this thread, the main thread is 0,
+   like the __atomic builtins below this needs gcc or clang */
+static __thread int threadindex;
+
+typedef struct threadScratch_s
+{
+	void *data;
+	size_t size;
+}
+threadScratch_t;
+
+static threadScratch_t threadscratch[ MAX_THREADS ][ MAX_THREAD_SCRATCH ];
+
+/* seconds each worker spent inside the worker functions, see ThreadBusyTime() */
+static double threadbusy[ MAX_THREADS ];
+
+/* per-thread free lists of released objects, see ThreadCacheAlloc() and ThreadArenaAlloc() */
+typedef struct threadCache_s
+{
+	void *free[ MAX_THREAD_CACHE_CLASSES ];
+	void *chunks;                       /* arena chunks, linked through their first word */
+	size_t chunkUsed;                   /* bytes handed out of the newest chunk */
+	int allocs, reused, frees;
+	size_t bytes;
+}
+threadCache_t;
+
+/* arena objects are carved from chunks of this size, aligned to ARENA_ALIGN */
+#define ARENA_CHUNK_SIZE    ( 256 * 1024 )
+#define ARENA_ALIGN         16
+
+static threadCache_t threadcache[ MAX_THREADS ][ MAX_THREAD_CACHES ];
+
+/* live/peak object counts across all threads, only kept with -allocstats */
+qboolean allocstats = qfalse;
+static int cacheactive[ MAX_THREAD_CACHES ];
+static int cachepeak[ MAX_THREAD_CACHES ];
+
+
+/*
+   ThreadScratch()
+   returns a per-thread buffer of at least size bytes for the given slot.
+   the buffer is kept (and only ever grows) for the life of the process,
+   so callers get it back warm across work items and phases. the
+   contents are undefined.
+ */
+
+void *ThreadScratch( int slot, size_t size ){
+	threadScratch_t *scratch;
+
+	if ( slot < 0 || slot >= MAX_THREAD_SCRATCH ) {
+		Error( "ThreadScratch: bad slot %d", slot );
+	}
+
+	scratch = &threadscratch[ threadindex ][ slot ];
+	if ( size > scratch->size ) {
+		free( scratch->data );
+		scratch->data = safe_malloc( size );
+		scratch->size = size;
+	}
+	return scratch->data;
+}
+
+/*
+   ThreadBusyTime()
+   returns the seconds the given worker spent taking and running work
+   items since the last ResetThreadBusyTime(), the time it sat idle
+   waiting for the other workers to finish a phase is not counted
+ */
+
+double ThreadBusyTime( int threadnum ){
+	if ( threadnum < 0 || threadnum >= MAX_THREADS ) {
+		return 0;
+	}
+	return threadbusy[ threadnum ];
+}
+
+void ResetThreadBusyTime( void ){
+	memset( threadbusy, 0, sizeof( threadbusy ) );
+}
+
+/*
+   ThreadCacheAlloc()
+   returns a zeroed block of size bytes for a short-lived object of the
+   given cache (object type) and size class (point/side count). blocks
+   released with ThreadCacheFree() go on the calling thread's free list
+   for that class and are handed out again without going through malloc.
+   a class has to map to one block size, or at least every block freed
+   into it has to hold that size. cached blocks are still plain malloc
+   blocks, so free() on an object from here stays legal, and objects may
+   be freed on a different thread than they were allocated on.
+   classes outside [0, MAX_THREAD_CACHE_CLASSES) bypass the cache.
+ */
+
+void *ThreadCacheAlloc( int cache, int sizeClass, size_t size ){
+	threadCache_t *tc;
+	void *p;
+	int active, peak;
+
+	tc = &threadcache[ threadindex ][ cache ];
+	tc->allocs++;
+	tc->bytes += size;
+	if ( allocstats ) {
+		active = __atomic_add_fetch( &cacheactive[ cache ], 1, __ATOMIC_RELAXED );
+		peak = __atomic_load_n( &cachepeak[ cache ], __ATOMIC_RELAXED );
+		while ( active > peak && !__atomic_compare_exchange_n( &cachepeak[ cache ], &peak, active, qtrue, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			;
+	}
+
+	if ( sizeClass >= 0 && sizeClass < MAX_THREAD_CACHE_CLASSES && tc->free[ sizeClass ] != NULL ) {
+		p = tc->free[ sizeClass ];
+		tc->free[ sizeClass ] = *(void **) ( (byte *) p + sizeof( void * ) );
+		tc->reused++;
+	}
+	else{
+		p = safe_malloc( size );
+	}
+	memset( p, 0, size );
+	return p;
+}
+
+/*
+   ThreadCacheFree()
+   releases an object from ThreadCacheAlloc() onto the calling thread's
+   free list. the link is stored in the second pointer-sized word so a
+   freed marker the caller left in the first word survives.
+ */
+
+void ThreadCacheFree( int cache, int sizeClass, void *p ){
+	threadCache_t *tc;
+
+	tc = &threadcache[ threadindex ][ cache ];
+	tc->frees++;
+	if ( allocstats ) {
+		__atomic_sub_fetch( &cacheactive[ cache ], 1, __ATOMIC_RELAXED );
+	}
+
+	if ( sizeClass < 0 || sizeClass >= MAX_THREAD_CACHE_CLASSES ) {
+		free( p );
+		return;
+	}
+	*(void **) ( (byte *) p + sizeof( void * ) ) = tc->free[ sizeClass ];
+	tc->free[ sizeClass ] = p;
+}
+
+/*
+   ThreadArenaAlloc()
+   returns a zeroed object of a fixed size for the given cache, carved
+   out of per-thread chunks so objects allocated together sit together
+   (the tree nodes and portals the flood and vis passes walk). released
+   objects go on a free list and are reused first. unlike
+   ThreadCacheAlloc() these are not malloc blocks: they must be released
+   with ThreadArenaFree() only, and all of them have to be dead before
+   ThreadCacheRelease() can hand the chunks back.
+ */
+
+void *ThreadArenaAlloc( int cache, size_t size ){
+	threadCache_t *tc;
+	void *p, *chunk;
+	int active, peak;
+
+	tc = &threadcache[ threadindex ][ cache ];
+	tc->allocs++;
+	tc->bytes += size;
+	if ( allocstats ) {
+		active = __atomic_add_fetch( &cacheactive[ cache ], 1, __ATOMIC_RELAXED );
+		peak = __atomic_load_n( &cachepeak[ cache ], __ATOMIC_RELAXED );
+		while ( active > peak && !__atomic_compare_exchange_n( &cachepeak[ cache ], &peak, active, qtrue, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			;
+	}
+
+	if ( tc->free[ 0 ] != NULL ) {
+		p = tc->free[ 0 ];
+		tc->free[ 0 ] = *(void **) ( (byte *) p + sizeof( void * ) );
+		tc->reused++;
+	}
+	else
+	{
+		size = ( size + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+		if ( size > ARENA_CHUNK_SIZE - ARENA_ALIGN ) {
+			Error( "ThreadArenaAlloc: %d byte objects do not fit a chunk", (int) size );
+		}
+		if ( tc->chunks == NULL || tc->chunkUsed + size > ARENA_CHUNK_SIZE ) {
+			chunk = safe_malloc( ARENA_CHUNK_SIZE );
+			*(void **) chunk = tc->chunks;
+			tc->chunks = chunk;
+			tc->chunkUsed = ARENA_ALIGN;
+		}
+		p = (byte *) tc->chunks + tc->chunkUsed;
+		tc->chunkUsed += size;
+	}
+	memset( p, 0, size );
+	return p;
+}
+
+/*
+   ThreadArenaFree()
+   puts an object from ThreadArenaAlloc() on the calling thread's free list
+ */
+
+void ThreadArenaFree( int cache, void *p ){
+	threadCache_t *tc;
+
+	tc = &threadcache[ threadindex ][ cache ];
+	tc->frees++;
+	if ( allocstats ) {
+		__atomic_sub_fetch( &cacheactive[ cache ], 1, __ATOMIC_RELAXED );
+	}
+
+	*(void **) ( (byte *) p + sizeof( void * ) ) = tc->free[ 0 ];
+	tc->free[ 0 ] = p;
+}
+
+/*
+   ThreadCacheRelease()
+   hands every cached block of every thread back to malloc, and drops the
+   chunks of every arena that has no live objects left (one that still
+   has some is kept as it is). only call it from the main thread between
+   phases, while no workers are running.
+ */
+
+void ThreadCacheRelease( void ){
+	int i, j, k, live;
+	qboolean arena;
+	void *p, *next;
+
+	for ( j = 0; j < MAX_THREAD_CACHES; j++ )
+	{
+		arena = qfalse;
+		live = 0;
+		for ( i = 0; i < MAX_THREADS; i++ )
+		{
+			if ( threadcache[ i ][ j ].chunks != NULL ) {
+				arena = qtrue;
+			}
+			live += threadcache[ i ][ j ].allocs - threadcache[ i ][ j ].frees;
+		}
+
+		for ( i = 0; i < MAX_THREADS; i++ )
+		{
+			if ( arena ) {
+				if ( live != 0 ) {
+					break;
+				}
+				for ( p = threadcache[ i ][ j ].chunks; p != NULL; p = next )
+				{
+					next = *(void **) p;
+					free( p );
+				}
+				threadcache[ i ][ j ].chunks = NULL;
+				threadcache[ i ][ j ].chunkUsed = 0;
+				threadcache[ i ][ j ].free[ 0 ] = NULL;
+				continue;
+			}
+
+			for ( k = 0; k < MAX_THREAD_CACHE_CLASSES; k++ )
+			{
+				for ( p = threadcache[ i ][ j ].free[ k ]; p != NULL; p = next )
+				{
+					next = *(void **) ( (byte *) p + sizeof( void * ) );
+					free( p );
+				}
+				threadcache[ i ][ j ].free[ k ] = NULL;
+			}
+		}
+	}
+}
+
+/*
+   PrintThreadCacheStats()
+   prints the allocation counters of one cache summed over all threads
+ */
+
+void PrintThreadCacheStats( int cache, const char *name ){
+	int i, allocs, reused, frees;
+	double bytes;
+
+	allocs = reused = frees = 0;
+	bytes = 0;
+	for ( i = 0; i < MAX_THREADS; i++ )
+	{
+		allocs += threadcache[ i ][ cache ].allocs;
+		reused += threadcache[ i ][ cache ].reused;
+		frees += threadcache[ i ][ cache ].frees;
+		bytes += threadcache[ i ][ cache ].bytes;
+	}
+
+	Sys_Printf( "%9d %-10s allocated, %5.1f%% from cache, %9d live, %9d peak, %8.1f MB total\n",
+	            allocs, name, allocs ? 100.0 * reused / allocs : 0.0, allocs - frees, cachepeak[ cache ], bytes / ( 1024.0 * 1024.0 ) );
+}
+
 /*
    =============
    GetThreadWork
@@ -90,7 +381,10 @@ void ( *workfunction )( int );
 
 void ThreadWorkerFunction( int threadnum ){
 	int work;
+	double start;
 
+	threadindex = threadnum;
+	start = I_PreciseTime();
 	while ( 1 )
 	{
 		work = GetThreadWork();
@@ -100,14 +394,192 @@ void ThreadWorkerFunction( int threadnum ){
 //Sys_Printf ("thread %i, work %i\n", threadnum, work);
 		workfunction( work );
 	}
+	threadbusy[ threadnum ] += I_PreciseTime() - start;
+}
+
+
+
+/*
+   ===================================================================
+
+   WORK STEALING DISPATCH
+
+   the work range is cut into chunks, and chunk c belongs to thread
+   (c % numthreads), so every thread starts out on the low indexes and
+   the rough dispatch order of the legacy path is kept. each thread pops
+   its own chunks from the front of its deque and, once empty, steals
+   single chunks from the back of the other deques. a deque is just a
+   [next, end) range packed into one 64 bit word, so both ends are
+   updated with a single compare-and-swap and no lock is taken per item.
+
+   ===================================================================
+ */
+
+#define MAX_WORK_CHUNK      64
+#define WORK_CHUNKS_THREAD  32
+
+typedef struct workDeque_s
+{
+	uint64_t range;             /* low 32 bits: next chunk, high 32 bits: end chunk */
+	char pad[ 64 - sizeof( uint64_t ) ];
+}
+workDeque_t;
+
+qboolean legacydispatch = qfalse;
+
+static workDeque_t workdeques[ MAX_THREADS ];
+static int workchunk;
+
+
+/*
+   PopWorkChunk()
+   takes the next chunk from the front of a deque, returns -1 when empty
+ */
+
+static int PopWorkChunk( workDeque_t *deque, qboolean back ){
+	uint64_t range, next;
+	uint32_t first, end;
+
+	range = __atomic_load_n( &deque->range, __ATOMIC_ACQUIRE );
+	while ( 1 )
+	{
+		first = (uint32_t) range;
+		end = (uint32_t) ( range >> 32 );
+		if ( first >= end ) {
+			return -1;
+		}
+
+		if ( back ) {
+			end--;
+			next = ( (uint64_t) end << 32 ) | first;
+		}
+		else{
+			next = ( (uint64_t) end << 32 ) | ( first + 1 );
+		}
+
+		if ( __atomic_compare_exchange_n( &deque->range, &range, next, qfalse, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+			return back ? (int) end : (int) first;
+		}
+	}
+}
+
+
+/*
+   ThreadPacifier()
+   prints the progress dots for the number of items handed out so far,
+   the lock is only taken when the output actually advances
+ */
+
+static void ThreadPacifier( int handedout ){
+	int f;
+
+	f = (int) ( 40LL * handedout / workcount );
+	if ( f <= __atomic_load_n( &oldf, __ATOMIC_RELAXED ) ) {
+		return;
+	}
+
+	ThreadLock();
+	while ( f > oldf )
+	{
+		++oldf;
+		if ( pacifier ) {
+			if ( oldf % 4 == 0 ) {
+				Sys_Printf( "%i", f / 4 );
+			}
+			else{
+				Sys_Printf( "." );
+			}
+			fflush( stdout );
+		}
+	}
+	ThreadUnlock();
+}
+
+
+/*
+   ThreadStealWorkerFunction()
+   drains this thread's own deque, then steals from the others until all are empty
+ */
+
+void ThreadStealWorkerFunction( int threadnum ){
+	int i, chunk, victim, k, first, last;
+	double start;
+
+	threadindex = threadnum;
+	start = I_PreciseTime();
+	while ( 1 )
+	{
+		/* own chunks first (deque k holds chunks k, k + numthreads, ...) */
+		k = PopWorkChunk( &workdeques[ threadnum ], qfalse );
+		if ( k >= 0 ) {
+			chunk = threadnum + k * numthreads;
+		}
+		else
+		{
+			/* steal from the back of the other deques */
+			chunk = -1;
+			for ( i = 1; i < numthreads && chunk < 0; i++ )
+			{
+				victim = ( threadnum + i ) % numthreads;
+				k = PopWorkChunk( &workdeques[ victim ], qtrue );
+				if ( k >= 0 ) {
+					chunk = victim + k * numthreads;
+				}
+			}
+
+			/* no work is ever added, so one empty sweep means we are done */
+			if ( chunk < 0 ) {
+				break;
+			}
+		}
+
+		first = chunk * workchunk;
+		last = first + workchunk;
+		if ( last > workcount ) {
+			last = workcount;
+		}
+
+		ThreadPacifier( __atomic_fetch_add( &dispatch, last - first, __ATOMIC_RELAXED ) );
+
+		for ( i = first; i < last; i++ )
+			workfunction( i );
+	}
+	threadbusy[ threadnum ] += I_PreciseTime() - start;
 }
 
+
 void RunThreadsOnIndividual( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+	int i, chunks, owned;
+
 	if ( numthreads == -1 ) {
 		ThreadSetDefault();
 	}
 	workfunction = func;
-	RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction );
+
+	/* single thread or explicitly asked for the old global-lock dispatcher */
+	if ( legacydispatch || numthreads <= 1 || numthreads > MAX_THREADS ) {
+		RunThreadsOn( workcnt, showpacifier, ThreadWorkerFunction );
+		return;
+	}
+
+	/* small chunks for few expensive items, bigger ones for lots of cheap items */
+	workchunk = workcnt / ( numthreads * WORK_CHUNKS_THREAD );
+	if ( workchunk < 1 ) {
+		workchunk = 1;
+	}
+	else if ( workchunk > MAX_WORK_CHUNK ) {
+		workchunk = MAX_WORK_CHUNK;
+	}
+	chunks = ( workcnt + workchunk - 1 ) / workchunk;
+
+	/* deal the chunks out round-robin */
+	for ( i = 0; i < numthreads; i++ )
+	{
+		owned = ( i < chunks ) ? ( chunks - i + numthreads - 1 ) / numthreads : 0;
+		workdeques[ i ].range = (uint64_t) owned << 32;
+	}
+
+	RunThreadsOn( workcnt, showpacifier, ThreadStealWorkerFunction );
 }
 
 
@@ -128,6 +600,10 @@ int numthreads = -1;
 CRITICAL_SECTION crit;
 static int enter;
 
+/* no persistent pool here, threads are spawned per RunThreadsOn call */
+void ThreadPoolInit( void ){
+}
+
 void ThreadSetDefault( void ){
 	SYSTEM_INFO info;
 
@@ -236,6 +712,10 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 
 int numthreads = 4;
 
+/* no persistent pool here, threads are spawned per RunThreadsOn call */
+void ThreadPoolInit( void ){
+}
+
 void ThreadSetDefault( void ){
 	if ( numthreads == -1 ) { // not set manually
 		numthreads = 4;
@@ -350,6 +830,10 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 int numthreads = -1;
 abilock_t lck;
 
+/* no persistent pool here, threads are spawned per RunThreadsOn call */
+void ThreadPoolInit( void ){
+}
+
 void ThreadSetDefault( void ){
 	if ( numthreads == -1 ) {
 		numthreads = prctl( PR_MAXPPROCS );
@@ -529,25 +1013,84 @@ void recursive_mutex_init( pthread_mutexattr_t attribs ){
 }
 
 /*
-   =============
-   RunThreadsOn
-   =============
+   ===================================================================
+
+   PERSISTENT THREAD POOL
+
+   the workers are created once and then parked on a condition variable
+   between phases. RunThreadsOn publishes the phase function, bumps the
+   generation and waits until every worker has returned from it.
+
+   ===================================================================
  */
-void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+
+static pthread_t pool_threads[ MAX_THREADS ];
+static int pool_size;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static void ( *pool_func )( int );
+static unsigned int pool_generation;
+static int pool_busy;
+
+static void *ThreadPoolWorker( void *arg ){
+	int threadnum = (int) (uintptr_t) arg;
+	unsigned int generation = 0;
+	void ( *func )( int );
+
+	threadindex = threadnum;
+
+	pthread_mutex_lock( &pool_mutex );
+	while ( 1 )
+	{
+		while ( pool_generation == generation )
+			pthread_cond_wait( &pool_wake, &pool_mutex );
+		generation = pool_generation;
+		func = pool_func;
+		pthread_mutex_unlock( &pool_mutex );
+
+		func( threadnum );
+
+		pthread_mutex_lock( &pool_mutex );
+		if ( --pool_busy == 0 ) {
+			pthread_cond_signal( &pool_done );
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+   ThreadPoolInit()
+   starts the worker threads, safe to call more than once
+ */
+
+void ThreadPoolInit( void ){
 	pthread_mutexattr_t mattrib;
 	pthread_attr_t attr;
-	pthread_t work_threads[MAX_THREADS];
 	size_t stacksize;
+	int i;
 
-	int start, end;
-	int i = 0;
-
-	start     = I_FloatTime();
-	pacifier  = showpacifier;
+	if ( numthreads == -1 ) {
+		ThreadSetDefault();
+	}
+	if ( pool_size > 0 || numthreads <= 1 ) {
+		return;
+	}
+	if ( numthreads > MAX_THREADS ) {
+		Sys_Printf( "Clamping %d threads to %d\n", numthreads, MAX_THREADS );
+		numthreads = MAX_THREADS;
+	}
 
-	dispatch  = 0;
-	oldf      = -1;
-	workcount = workcnt;
+	if ( pthread_mutexattr_init( &mattrib ) != 0 ) {
+		Error( "pthread_mutexattr_init failed" );
+	}
+	if ( pthread_mutexattr_settype( &mattrib, PTHREAD_MUTEX_ERRORCHECK ) != 0 ) {
+		Error( "pthread_mutexattr_settype failed" );
+	}
+	recursive_mutex_init( mattrib );
+	pthread_mutexattr_destroy( &mattrib );
 
 	pthread_attr_init( &attr );
 	if ( pthread_attr_setstacksize( &attr, 8388608 ) != 0 ) {
@@ -556,39 +1099,56 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 		Sys_Printf( "Could not set a per-thread stack size of 8 MB, using only %.2f MB\n", stacksize / 1048576.0 );
 	}
 
+	for ( i = 0; i < numthreads; i++ )
+	{
+		/* Default pthread attributes: joinable & non-realtime scheduling */
+		if ( pthread_create( &pool_threads[ i ], &attr, ThreadPoolWorker, (void*)(uintptr_t)i ) != 0 ) {
+			Error( "pthread_create failed" );
+		}
+	}
+	pthread_attr_destroy( &attr );
+
+	pool_size = numthreads;
+}
+
+
+/*
+   =============
+   RunThreadsOn
+   =============
+ */
+void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
+	int start, end;
+
+	start     = I_FloatTime();
+	pacifier  = showpacifier;
+
+	dispatch  = 0;
+	oldf      = -1;
+	workcount = workcnt;
+
 	if ( numthreads == 1 ) {
 		func( 0 );
 	}
 	else
 	{
+		ThreadPoolInit();
+
 		threaded  = qtrue;
 
 		if ( pacifier ) {
 			setbuf( stdout, NULL );
 		}
 
-		if ( pthread_mutexattr_init( &mattrib ) != 0 ) {
-			Error( "pthread_mutexattr_init failed" );
-		}
-		if ( pthread_mutexattr_settype( &mattrib, PTHREAD_MUTEX_ERRORCHECK ) != 0 ) {
-			Error( "pthread_mutexattr_settype failed" );
-		}
-		recursive_mutex_init( mattrib );
+		pthread_mutex_lock( &pool_mutex );
+		pool_func = func;
+		pool_busy = pool_size;
+		pool_generation++;
+		pthread_cond_broadcast( &pool_wake );
+		while ( pool_busy > 0 )
+			pthread_cond_wait( &pool_done, &pool_mutex );
+		pthread_mutex_unlock( &pool_mutex );
 
-		for ( i = 0; i < numthreads; i++ )
-		{
-			/* Default pthread attributes: joinable & non-realtime scheduling */
-			if ( pthread_create(&work_threads[i], &attr, (void *(*)(void *)) func, (void*)(uintptr_t)i ) != 0 ) {
-				Error( "pthread_create failed" );
-			}
-		}
-		for ( i = 0; i < numthreads; i++ )
-		{
-			if ( pthread_join( work_threads[i], NULL ) != 0 ) {
-				Error( "pthread_join failed" );
-			}
-		}
-		pthread_mutexattr_destroy( &mattrib );
 		threaded = qfalse;
 	}
 
@@ -612,6 +1172,9 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, void ( *func )( int ) ){
 
 int numthreads = 1;
 
+void ThreadPoolInit( void ){
+}
+
 void ThreadSetDefault( void ){
 	numthreads = 1;
 }
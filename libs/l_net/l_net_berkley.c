@@ -374,6 +374,10 @@ int WINS_Accept( int socket, struct sockaddr_s *addr ){
 	if ( setsockopt( newsocket, IPPROTO_TCP, TCP_NODELAY, (void *) &_true, sizeof( int ) ) == SOCKET_ERROR ) {
 		WinPrint( "WINS_Accept: %s\n", WINS_ErrorMessage( WSAGetLastError() ) );
 		WinPrint( "setsockopt error\n" );
+	} //end if
+	  // accepted sockets do not inherit non-blocking mode from the listen socket here
+	if ( ioctlsocket( newsocket, FIONBIO, &_true ) == SOCKET_ERROR ) {
+		WinPrint( "WINS_Accept: %s\n", WINS_ErrorMessage( WSAGetLastError() ) );
 	} //end if
 	return newsocket;
 } //end of the function WINS_Accept
@@ -595,7 +599,7 @@ int WINS_Write( int socket, byte *buf, int len, struct sockaddr_s *addr ){
 		written = 0;
 		while ( written < len )
 		{
-			ret = send( socket, buf, len, 0 );
+			ret = send( socket, &buf[written], len - written, 0 );
 			if ( ret == SOCKET_ERROR ) {
 				if ( WSAGetLastError() != EAGAIN ) {
 					return qfalse;
@@ -612,7 +616,7 @@ int WINS_Write( int socket, byte *buf, int len, struct sockaddr_s *addr ){
 	if ( ret == SOCKET_ERROR ) {
 		WinPrint( "WINS_Write: %s\n", WINS_ErrorMessage( WSAGetLastError() ) );
 	} //end if
-	return ( ret == len );
+	return ( written == len );
 } //end of the function WINS_Write
 //===========================================================================
 //
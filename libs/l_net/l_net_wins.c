@@ -609,7 +609,7 @@ int WINS_Write( int socket, byte *buf, int len, struct sockaddr_s *addr ){
 		written = 0;
 		while ( written < len )
 		{
-			ret = send( socket, buf, len, 0 );
+			ret = send( socket, &buf[written], len - written, 0 );
 			if ( ret == SOCKET_ERROR ) {
 				if ( WSAGetLastError() != WSAEWOULDBLOCK ) {
 					return qfalse;
@@ -625,7 +625,7 @@ int WINS_Write( int socket, byte *buf, int len, struct sockaddr_s *addr ){
 	if ( ret == SOCKET_ERROR ) {
 		WinPrint( "WINS_Write: %s\n", WINS_ErrorMessage( WSAGetLastError() ) );
 	} //end if
-	return ( ret == len );
+	return ( written == len );
 } //end of the function WINS_Write
 //===========================================================================
 //
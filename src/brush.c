@@ -96,11 +96,7 @@ brush_t *AllocBrush( int numSides ){
 		Error( "AllocBrush called with numsides = %d", numSides );
 	}
 	c = (size_t)&( ( (brush_t*) 0 )->sides[ numSides ] );
-	bb = safe_malloc( c );
-	memset( bb, 0, c );
-	if ( numthreads == 1 ) {
-		numActiveBrushes++;
-	}
+	bb = ThreadCacheAlloc( CACHE_BRUSH, numSides, c );
 
 	/* return it */
 	return bb;
@@ -114,7 +110,7 @@ brush_t *AllocBrush( int numSides ){
  */
 
 void FreeBrush( brush_t *b ){
-	int i;
+	int i, numSides;
 
 
 	/* error check */
@@ -130,14 +126,13 @@ void FreeBrush( brush_t *b ){
 		}
 
 	/* ydnar: overwrite it */
-	memset( b, 0xFE, (size_t)&( ( (brush_t*) 0 )->sides[ b->numsides ] ) );
+	numSides = b->numsides;
+	memset( b, 0xFE, (size_t)&( ( (brush_t*) 0 )->sides[ numSides ] ) );
 	*( (unsigned int*) b ) = 0xFEFEFEFE;
 
-	/* free it */
-	free( b );
-	if ( numthreads == 1 ) {
-		numActiveBrushes--;
-	}
+	/* free it (a brush never has more sides than it was allocated with,
+	   and emptied brushes are not worth caching) */
+	ThreadCacheFree( CACHE_BRUSH, numSides > 0 ? numSides : -1, b );
 }
 
 
@@ -842,8 +837,7 @@ tree_t *AllocTree( void ){
 node_t *AllocNode( void ){
 	node_t  *node;
 
-	node = safe_malloc( sizeof( *node ) );
-	memset( node, 0, sizeof( *node ) );
+	node = ThreadArenaAlloc( CACHE_NODE, sizeof( *node ) );
 
 	return node;
 }
@@ -375,6 +375,9 @@ void ProcessWorldModel( const char *portalFilePath, const char *lineFilePath ){
 	/* finish */
 	EndModel( e, tree->headnode );
 	FreeTree( tree );
+
+	/* the world churned through most of the windings, brushes and portals, give the cached ones back */
+	ThreadCacheRelease();
 }
 
 
@@ -485,7 +488,9 @@ void ProcessModels( const char *portalFilePath, const char *lineFilePath ){
 	/* find the envmap points */
 	CreateMapCubemaps();
 
-	/* walk entity list */
+	/* walk entity list, one model at a time in entity order: the models
+	   share mapDrawSurfs, the meta triangles, the tjunction edges, the map
+	   planes and the bsp lumps they are emitted into */
 	for ( mapEntityNum = 0; mapEntityNum < numEntities; mapEntityNum++ )
 	{
 		/* get entity */
@@ -515,6 +520,17 @@ void ProcessModels( const char *portalFilePath, const char *lineFilePath ){
 
 	/* vortex: emit meta stats */
 	EmitMetaStats();
+
+	/* release what the submodels left cached */
+	ThreadCacheRelease();
+	if ( allocstats ) {
+		Sys_Printf( "--- Allocations ---\n" );
+		PrintThreadCacheStats( CACHE_WINDING, "windings" );
+		PrintThreadCacheStats( CACHE_BRUSH, "brushes" );
+		PrintThreadCacheStats( CACHE_PORTAL, "portals" );
+		PrintThreadCacheStats( CACHE_BSPFACE, "bsp faces" );
+		PrintThreadCacheStats( CACHE_NODE, "nodes" );
+	}
 }
 
 
@@ -805,6 +821,10 @@ int BSPMain( int argc, char **argv ){
 			Sys_Printf( "Debug surface triangle insetting enabled\n" );
 			debugInset = qtrue;
 		}
+		else if ( !strcmp( argv[ i ], "-binaryprt" ) ) {
+			Sys_Printf( "Writing a binary portal file\n" );
+			binaryPortals = qtrue;
+		}
 		else if ( !strcmp( argv[ i ], "-debugportals" ) ) {
 			Sys_Printf( "Debug portal surfaces enabled\n" );
 			debugPortals = qtrue;
@@ -841,6 +861,16 @@ int BSPMain( int argc, char **argv ){
 			Sys_Printf( "Deep BSP tree generation enabled\n" );
 			deepBSP = qtrue;
 		}
+		else if ( !strcmp( argv[ i ], "-splitsample" ) ) {
+			bspSplitSample = atoi( argv[ i + 1 ] );
+			if ( bspSplitSample < 0 ) {
+				bspSplitSample = 0;
+			}
+			i++;
+			if ( bspSplitSample > 0 ) {
+				Sys_Printf( "Scoring at most %d split planes per BSP node\n", bspSplitSample );
+			}
+		}
 		else if ( !strcmp( argv[ i ], "-maxarea" ) ) {
 			Sys_Printf( "Max Area face surface generation enabled\n" );
 			maxAreaFaceSurface = qtrue;
@@ -40,6 +40,47 @@
 
 int c_faceLeafs;
 
+/* nodes needing at least this many plane/face tests score their split candidates in parallel */
+#define FACEBSP_THREAD_WORK     65536
+
+/* subtrees inside one block with at most this many faces (and at most an
+   eighth of a thread's share of the tree) are built as parallel tasks */
+#define FACEBSP_TASK_FACES      4096
+
+/* split statistics of one distinct plane in a node's face list */
+typedef struct splitPlane_s
+{
+	int planenum;
+	qboolean hint;                      /* a face on this plane has positive priority */
+	qboolean scored;                    /* not skipped by -splitsample */
+	int facing, splits, front, back;
+}
+splitPlane_t;
+
+/* statistics of a (sub)tree build */
+typedef struct faceTreeStats_s
+{
+	int leafs, depth, sampled;
+}
+faceTreeStats_t;
+
+/* a subtree left for the thread pool */
+typedef struct faceTask_s
+{
+	node_t *node;
+	face_t *list;
+	int numFaces, depth;
+	faceTreeStats_t stats;
+}
+faceTask_t;
+
+static faceTask_t *faceTasks;
+static int numFaceTasks;
+static int allocatedFaceTasks;
+static int faceTaskFaces;
+static qboolean faceTasksCollect;       /* top of the tree: defer the subtrees that fit in a block */
+static qboolean faceTasksRunning;       /* inside a task: no nested thread pool */
+
 
 /*
    ================
@@ -49,8 +90,7 @@ int c_faceLeafs;
 face_t  *AllocBspFace( void ) {
 	face_t  *f;
 
-	f = safe_malloc( sizeof( *f ) );
-	memset( f, 0, sizeof( *f ) );
+	f = ThreadArenaAlloc( CACHE_BSPFACE, sizeof( *f ) );
 
 	return f;
 }
@@ -66,29 +106,201 @@ void    FreeBspFace( face_t *f ) {
 	if ( f->w ) {
 		FreeWinding( f->w );
 	}
-	free( f );
+	ThreadArenaFree( CACHE_BSPFACE, f );
 }
 
 
 
 /*
-   SelectSplitPlaneNum()
-   finds the best split plane for this node
+   CountSplitPlane()
+   classifies the node's faces against one candidate plane; every face on that
+   plane shares the result, so this runs once per distinct plane
  */
 
-static void SelectSplitPlaneNum( node_t *node, face_t *list, int *splitPlaneNum, int *compileFlags ){
-	face_t *split;
+static void CountSplitPlane( splitPlane_t *sp, face_t *list ){
 	face_t *check;
-	face_t *bestSplit;
 	int splits, facing, front, back;
 	int side;
 	plane_t *plane;
+
+
+	plane = &mapplanes[ sp->planenum ];
+	splits = 0;
+	facing = 0;
+	front = 0;
+	back = 0;
+	for ( check = list; check; check = check->next ) {
+		if ( check->planenum == sp->planenum ) {
+			facing++;
+			continue;
+		}
+		side = WindingOnPlaneSide( check->w, plane->normal, plane->dist );
+		if ( side == SIDE_CROSS ) {
+			splits++;
+		}
+		else if ( side == SIDE_FRONT ) {
+			front++;
+		}
+		else if ( side == SIDE_BACK ) {
+			back++;
+		}
+	}
+
+	sp->splits = splits;
+	sp->facing = facing;
+	sp->front = front;
+	sp->back = back;
+}
+
+
+
+/*
+   SplitPlaneValue()
+   scores a face as a split candidate from the counts of its plane
+ */
+
+static int SplitPlaneValue( face_t *split, splitPlane_t *sp ){
+	plane_t *plane;
+	int value;
+	float sizeBias;
+
+
+	plane = &mapplanes[ split->planenum ];
+
+	if ( bspAlternateSplitWeights ) {
+		// from 27
+
+		//Bigger is better
+		sizeBias = WindingArea( split->w );
+
+		//Base score = 20000 perfectly balanced
+		value = 20000 - ( abs( sp->front - sp->back ) );
+		value -= plane->counter; // If we've already used this plane sometime in the past try not to use it again
+		value -= sp->facing;        // if we're going to have alot of other surfs use this plane, we want to get it in quickly.
+		value -= sp->splits * 5;        //more splits = bad
+		value +=  sizeBias * 10; //We want a huge score bias based on plane size
+	}
+	else
+	{
+		value =  5 * sp->facing - 5 * sp->splits; // - abs(front-back);
+		if ( plane->type < 3 ) {
+			value += 5;       // axial is better
+		}
+	}
+
+	value += split->priority;       // prioritize hints higher
+
+	return value;
+}
+
+
+
+/*
+   CountSplitPlaneThread()
+   threaded worker: classifies the current node's faces against one candidate plane
+ */
+
+static face_t       *scoreList;
+static splitPlane_t *scorePlanes;
+
+static void CountSplitPlaneThread( int num ){
+	if ( scorePlanes[ num ].scored ) {
+		CountSplitPlane( &scorePlanes[ num ], scoreList );
+	}
+}
+
+
+
+/*
+   SampleSplitPlanes()
+   with -splitsample, only an evenly spaced subset of a node's distinct planes
+   (plus any hint planes) are scored once there are more than the budget
+ */
+
+static qboolean SampleSplitPlanes( splitPlane_t *planes, int numPlanes ){
+	int i, next, picked;
+
+
+	if ( bspSplitSample <= 0 || numPlanes <= bspSplitSample ) {
+		for ( i = 0; i < numPlanes; i++ )
+			planes[ i ].scored = qtrue;
+		return qfalse;
+	}
+
+	picked = 0;
+	next = 0;
+	for ( i = 0; i < numPlanes; i++ )
+	{
+		planes[ i ].scored = planes[ i ].hint;
+		if ( i == next ) {
+			planes[ i ].scored = qtrue;
+			picked++;
+			next = (int) ( (double) picked * numPlanes / bspSplitSample );
+		}
+	}
+	return qtrue;
+}
+
+
+
+/*
+   PlaneHashCell()
+   returns the hash cell of a plane number, holding its candidate slot or -1 if not collected yet
+ */
+
+static int *PlaneHashCell( int *hash, int mask, const splitPlane_t *planes, int planenum ){
+	int h;
+
+
+	h = (int) ( ( (unsigned) planenum * 2654435761u ) & (unsigned) mask );
+	while ( hash[ h ] >= 0 && planes[ hash[ h ] ].planenum != planenum )
+		h = ( h + 1 ) & mask;
+	return &hash[ h ];
+}
+
+
+
+/*
+   CrossedBlockAxis()
+   returns the axis on which the node crosses a block boundary (and the boundary in *dist), -1 if it lies inside one block
+ */
+
+static int CrossedBlockAxis( const node_t *node, float *dist ){
+	int i;
+	float d;
+
+
+	for ( i = 0; i < 3; i++ )
+	{
+		if ( blockSize[ i ] <= 0 ) {
+			continue;
+		}
+		d = blockSize[ i ] * ( floor( node->mins[ i ] / blockSize[ i ] ) + 1 );
+		if ( node->maxs[ i ] > d ) {
+			*dist = d;
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+
+/*
+   SelectSplitPlaneNum()
+   finds the best split plane for this node
+ */
+
+static void SelectSplitPlaneNum( node_t *node, face_t *list, int numFaces, int *splitPlaneNum, int *compileFlags, faceTreeStats_t *stats ){
+	face_t *split;
+	face_t *bestSplit;
+	splitPlane_t *planes, *sp;
+	int numPlanes;
+	int *planeHash, *cell, hashMask;
 	int value, bestValue;
 	int i;
 	vec3_t normal;
 	float dist;
-	int planenum;
-	float sizeBias;
 
 	/* ydnar: set some defaults */
 	*splitPlaneNum = -1; /* leaf */
@@ -98,87 +310,86 @@ static void SelectSplitPlaneNum( node_t *node, face_t *list, int *splitPlaneNum,
 	/* ydnar 2002-09-21: changed blocksize to be a vector, so mappers can specify a 3 element value */
 
 	/* if it is crossing a block boundary, force a split */
-	for ( i = 0; i < 3; i++ )
-	{
-		if ( blockSize[ i ] <= 0 ) {
-			continue;
-		}
-		dist = blockSize[ i ] * ( floor( node->mins[ i ] / blockSize[ i ] ) + 1 );
-		if ( node->maxs[ i ] > dist ) {
-			VectorClear( normal );
-			normal[ i ] = 1;
-			planenum = FindFloatPlane( normal, dist, 0, NULL );
-			*splitPlaneNum = planenum;
-			return;
-		}
+	i = CrossedBlockAxis( node, &dist );
+	if ( i >= 0 ) {
+		VectorClear( normal );
+		normal[ i ] = 1;
+		*splitPlaneNum = FindFloatPlane( normal, dist, 0, NULL );
+		return;
 	}
 
 	/* pick one of the face planes */
 	bestValue = -99999;
 	bestSplit = list;
 
+	if ( list == NULL ) {
+		return;
+	}
 
-	// div0: this check causes detail/structural mixes
-	//for( split = list; split; split = split->next )
-	//	split->checked = qfalse;
+	/* map plane -> candidate slot, a small hash per node so parallel subtrees don't share it */
+	for ( hashMask = 15; hashMask < numFaces * 2; hashMask = hashMask * 2 + 1 )
+		;
+	planeHash = safe_malloc( ( hashMask + 1 ) * sizeof( *planeHash ) );
+	for ( i = 0; i <= hashMask; i++ )
+		planeHash[ i ] = -1;
 
+	/* collect the distinct face planes in list order */
+	planes = safe_malloc( numFaces * sizeof( *planes ) );
+	numPlanes = 0;
 	for ( split = list; split; split = split->next )
 	{
-		//if ( split->checked )
-		//	continue;
-
-		plane = &mapplanes[ split->planenum ];
-		splits = 0;
-		facing = 0;
-		front = 0;
-		back = 0;
-		for ( check = list; check; check = check->next ) {
-			if ( check->planenum == split->planenum ) {
-				facing++;
-				//check->checked = qtrue;	// won't need to test this plane again
-				continue;
-			}
-			side = WindingOnPlaneSide( check->w, plane->normal, plane->dist );
-			if ( side == SIDE_CROSS ) {
-				splits++;
-			}
-			else if ( side == SIDE_FRONT ) {
-				front++;
-			}
-			else if ( side == SIDE_BACK ) {
-				back++;
-			}
+		cell = PlaneHashCell( planeHash, hashMask, planes, split->planenum );
+		if ( *cell < 0 ) {
+			*cell = numPlanes;
+			planes[ numPlanes ].planenum = split->planenum;
+			planes[ numPlanes ].hint = qfalse;
+			numPlanes++;
 		}
-
-		if ( bspAlternateSplitWeights ) {
-			// from 27
-
-			//Bigger is better
-			sizeBias = WindingArea( split->w );
-
-			//Base score = 20000 perfectly balanced
-			value = 20000 - ( abs( front - back ) );
-			value -= plane->counter; // If we've already used this plane sometime in the past try not to use it again
-			value -= facing;        // if we're going to have alot of other surfs use this plane, we want to get it in quickly.
-			value -= splits * 5;        //more splits = bad
-			value +=  sizeBias * 10; //We want a huge score bias based on plane size
+		if ( split->priority > 0 ) {
+			planes[ *cell ].hint = qtrue;
 		}
-		else
+	}
+	if ( SampleSplitPlanes( planes, numPlanes ) ) {
+		stats->sampled++;
+	}
+
+	/* big lists (the top few levels) count the planes on the thread pool */
+	if ( numthreads > 1 && !faceTasksRunning && (double) numPlanes * numFaces >= FACEBSP_THREAD_WORK ) {
+		scoreList = list;
+		scorePlanes = planes;
+		RunThreadsOnIndividual( numPlanes, qfalse, CountSplitPlaneThread );
+	}
+	else
+	{
+		for ( i = 0; i < numPlanes; i++ )
 		{
-			value =  5 * facing - 5 * splits; // - abs(front-back);
-			if ( plane->type < 3 ) {
-				value += 5;       // axial is better
+			if ( planes[ i ].scored ) {
+				CountSplitPlane( &planes[ i ], list );
 			}
 		}
+	}
 
-		value += split->priority;       // prioritize hints higher
+	// div0: this check causes detail/structural mixes
+	//for( split = list; split; split = split->next )
+	//	split->checked = qfalse;
 
+	/* score the faces in list order so ties resolve as before */
+	for ( split = list; split; split = split->next )
+	{
+		sp = &planes[ *PlaneHashCell( planeHash, hashMask, planes, split->planenum ) ];
+		if ( !sp->scored ) {
+			continue;
+		}
+		value = SplitPlaneValue( split, sp );
 		if ( value > bestValue ) {
 			bestValue = value;
 			bestSplit = split;
 		}
 	}
 
+	free( planeHash );
+	free( planes );
+
 	/* nothing, we have a leaf */
 	if ( bestValue == -99999 ) {
 		return;
@@ -188,7 +399,8 @@ static void SelectSplitPlaneNum( node_t *node, face_t *list, int *splitPlaneNum,
 	*splitPlaneNum = bestSplit->planenum;
 	*compileFlags = bestSplit->compileFlags;
 
-	if ( *splitPlaneNum > -1 ) {
+	/* only -altsplit reads the use counts, and it keeps the whole tree on one thread */
+	if ( *splitPlaneNum > -1 && bspAlternateSplitWeights ) {
 		mapplanes[ *splitPlaneNum ].counter++;
 	}
 }
@@ -212,12 +424,32 @@ int CountFaceList( face_t *list ){
 
 
 
+/*
+   AddFaceTask()
+   defers a subtree to the thread pool
+ */
+
+static void AddFaceTask( node_t *node, face_t *list, int numFaces, int depth ){
+	faceTask_t *task;
+
+
+	AUTOEXPAND_BY_REALLOC( faceTasks, numFaceTasks, allocatedFaceTasks, 64 );
+	task = &faceTasks[ numFaceTasks++ ];
+	memset( task, 0, sizeof( *task ) );
+	task->node = node;
+	task->list = list;
+	task->numFaces = numFaces;
+	task->depth = depth;
+}
+
+
+
 /*
    BuildFaceTree_r()
    recursively builds the bsp, splitting on face planes
  */
 
-void BuildFaceTree_r( node_t *node, face_t *list ){
+static void BuildFaceTree_r( node_t *node, face_t *list, int depth, faceTreeStats_t *stats ){
 	face_t      *split;
 	face_t      *next;
 	int side;
@@ -227,19 +459,31 @@ void BuildFaceTree_r( node_t *node, face_t *list ){
 	winding_t   *frontWinding, *backWinding;
 	int i;
 	int splitPlaneNum, compileFlags;
+	float dist;
 
 
 	/* count faces left */
 	i = CountFaceList( list );
 
+	/* a subtree inside one block neither creates planes nor depends on
+	   the order the tree is walked in, so it can be built on its own */
+	if ( faceTasksCollect && i <= faceTaskFaces && CrossedBlockAxis( node, &dist ) < 0 ) {
+		AddFaceTask( node, list, i, depth );
+		return;
+	}
+
+	if ( depth > stats->depth ) {
+		stats->depth = depth;
+	}
+
 	/* select the best split plane */
-	SelectSplitPlaneNum( node, list, &splitPlaneNum, &compileFlags );
+	SelectSplitPlaneNum( node, list, i, &splitPlaneNum, &compileFlags, stats );
 
 	/* if we don't have any more faces, this is a node */
 	if ( splitPlaneNum == -1 ) {
 		node->planenum = PLANENUM_LEAF;
 		node->has_structural_children = qfalse;
-		c_faceLeafs++;
+		stats->leafs++;
 		return;
 	}
 
@@ -323,12 +567,56 @@ void BuildFaceTree_r( node_t *node, face_t *list ){
 	}
 
 	for ( i = 0; i < 2; i++ ) {
-		BuildFaceTree_r( node->children[i], childLists[i] );
+		BuildFaceTree_r( node->children[i], childLists[i], depth + 1, stats );
 		node->has_structural_children |= node->children[i]->has_structural_children;
 	}
 }
 
 
+
+/*
+   BuildFaceTask()
+   threaded worker: builds one deferred subtree
+ */
+
+static void BuildFaceTask( int num ){
+	faceTask_t *task = &faceTasks[ num ];
+
+	BuildFaceTree_r( task->node, task->list, task->depth, &task->stats );
+}
+
+
+
+/*
+   CompareFaceTasks()
+   compare function for qsort(), biggest subtree first
+ */
+
+static int CompareFaceTasks( const void *a, const void *b ){
+	return ( (const faceTask_t *) b )->numFaces - ( (const faceTask_t *) a )->numFaces;
+}
+
+
+
+/*
+   FaceTreeStructural_r()
+   redoes has_structural_children over the top of the tree once the subtrees are built
+ */
+
+static qboolean FaceTreeStructural_r( node_t *node ){
+	int i;
+
+
+	if ( node->planenum == PLANENUM_LEAF ) {
+		return node->has_structural_children;
+	}
+	node->has_structural_children = (qboolean)(!( node->compileFlags & C_DETAIL ) && !node->opaque);
+	for ( i = 0; i < 2; i++ )
+		node->has_structural_children |= FaceTreeStructural_r( node->children[i] );
+	return node->has_structural_children;
+}
+
+
 /*
    ================
    FaceBSP
@@ -341,6 +629,7 @@ tree_t *FaceBSP( face_t *list ) {
 	face_t  *face;
 	int i;
 	int count;
+	faceTreeStats_t stats;
 
 	Sys_FPrintf( SYS_VRB, "--- FaceBSP ---\n" );
 
@@ -365,11 +654,45 @@ tree_t *FaceBSP( face_t *list ) {
 	tree->headnode = AllocNode();
 	VectorCopy( tree->mins, tree->headnode->mins );
 	VectorCopy( tree->maxs, tree->headnode->maxs );
-	c_faceLeafs = 0;
+	memset( &stats, 0, sizeof( stats ) );
+
+	/* build the top of the tree (the block splits) here and leave the
+	   subtrees inside the blocks to the thread pool, -altsplit needs the
+	   plane use counts in walking order so it stays on one thread */
+	numFaceTasks = 0;
+	faceTaskFaces = count / ( numthreads * 8 );
+	if ( faceTaskFaces > FACEBSP_TASK_FACES ) {
+		faceTaskFaces = FACEBSP_TASK_FACES;
+	}
+	faceTasksCollect = ( numthreads > 1 && !bspAlternateSplitWeights );
+	BuildFaceTree_r( tree->headnode, list, 0, &stats );
+	faceTasksCollect = qfalse;
 
-	BuildFaceTree_r( tree->headnode, list );
+	if ( numFaceTasks > 0 ) {
+		qsort( faceTasks, numFaceTasks, sizeof( *faceTasks ), CompareFaceTasks );
+		faceTasksRunning = qtrue;
+		RunThreadsOnIndividual( numFaceTasks, qfalse, BuildFaceTask );
+		faceTasksRunning = qfalse;
 
-	Sys_FPrintf( SYS_VRB, "%9d leafs\n", c_faceLeafs );
+		for ( i = 0; i < numFaceTasks; i++ )
+		{
+			stats.leafs += faceTasks[ i ].stats.leafs;
+			stats.sampled += faceTasks[ i ].stats.sampled;
+			if ( faceTasks[ i ].stats.depth > stats.depth ) {
+				stats.depth = faceTasks[ i ].stats.depth;
+			}
+		}
+		FaceTreeStructural_r( tree->headnode );
+		Sys_FPrintf( SYS_VRB, "%9d subtrees built in parallel\n", numFaceTasks );
+		numFaceTasks = 0;
+	}
+	c_faceLeafs = stats.leafs;
+
+	Sys_FPrintf( SYS_VRB, "%9d leafs\n", stats.leafs );
+	Sys_FPrintf( SYS_VRB, "%9d max depth\n", stats.depth );
+	if ( bspSplitSample > 0 ) {
+		Sys_FPrintf( SYS_VRB, "%9d nodes sampled\n", stats.sampled );
+	}
 
 	return tree;
 }
@@ -88,6 +88,7 @@ void HelpBsp()
 	struct HelpOption bsp[] = {
 		{"-bsp <filename.map>", "Switch that enters this stage"},
 		{"-altsplit", "Alternate BSP tree splitting weights (should give more fps)"},
+		{"-binaryprt", "Write the portal file in the binary format, which vis maps instead of parsing"},
 		{"-bspfile <filename.bsp>", "BSP file to write"},
 		{"-celshader <shadername>", "Sets a global cel shader name"},
 		{"-custinfoparms", "Read scripts/custinfoparms.txt"},
@@ -121,6 +122,7 @@ void HelpBsp()
 		{"-samplesize <N>", "Sets default lightmap resolution in luxels/qu"},
 		{"-skyfix", "Turn sky box into six surfaces to work around ATI problems"},
 		{"-snap <N>", "Snap brush bevel planes to the given number of units"},
+		{"-splitsample <N>", "Score at most N evenly spaced split planes (plus hints) per BSP node; faster on huge structural maps, different tree"},
 		{"-srffile <filename.srf>", "Surface file to write"},
 		{"-tempname <filename.map>", "Read the MAP file from the given file name"},
 		{"-texrange <N>", "Limit per-surface texture range to the given number of units, and subdivide surfaces like with `q3map_tessSize` if this is not met"},
@@ -134,17 +136,31 @@ void HelpVis()
 {
 	struct HelpOption vis[] = {
 		{"-vis <filename.map>", "Switch that enters this stage"},
+		{"-bench", "Time the vis phases and write them with the flow and PVS stats to <map>.visbench.json instead of writing the BSP"},
+		{"-checkpoint <F>", "Write the vis cache every F seconds while flowing (implies `-incremental`, default 300)"},
+		{"-coordinator <N>", "Hand out portals to `-worker` processes connecting on port N and flow the rest locally"},
 		{"-fast", "Very fast and crude vis calculation"},
 		{"-hint", "Merge all but hint portals"},
+		{"-incremental", "Keep finished portals in a .vcache file, resume from it and only flow changed portals on the next run"},
 		{"-mergeportals", "The less crude half of `-merge`, makes vis sometimes much faster but doesn't hurt fps usually"},
 		{"-merge", "Faster but still okay vis calculation"},
 		{"-nopassage", "Just use PortalFlow vis (usually less fps)"},
 		{"-nosort", "Do not sort the portals before calculating vis (usually slower)"},
+		{"-passagememory <F>", "Keep at most F MB of passage bits, later passages only keep which blocks of portals they reach (slower flow, and a looser vis with `-passageOnly`)"},
 		{"-passageOnly", "Just use PassageFlow vis (usually less fps)"},
 		{"-prtfile <filename.prt>", "Portal file to read"},
+		{"-sampled", "Approximate vis from rays between portals, faster than the full vis but it may cull visible geometry (check with `-samplecheck`)"},
+		{"-samplebudget <F>", "Stop sampling after F seconds, the remaining portals fall back to `-fast` (implies `-sampled`)"},
+		{"-samplecheck", "Also run the full vis and print how many leaf pairs it sees that `-sampled` culled, the sampled result is written (implies `-sampled`)"},
+		{"-sampleepsilon <F>", "Let sampled rays through within F units of a portal edge, larger is more conservative (implies `-sampled`, default 12)"},
+		{"-samplehidden <N>", "Only cull a pair of leaves after N sampled rays between them were blocked, larger is more conservative (implies `-sampled`, default 8)"},
+		{"-samplemargin <F>", "Only count a sampled ray as blocked if it stops more than F units away from any portal, larger is more conservative (implies `-sampled`, default 16)"},
+		{"-samples <N>", "Up to N rays per portal pair (implies `-sampled`, default 8)"},
 		{"-saveprt", "Keep the Portal file after running vis (so you can run vis again)"},
 		{"-tmpin", "Use /tmp folder for input"},
 		{"-tmpout", "Use /tmp folder for output"},
+		{"-worker <host:port>", "Flow portals for the `-coordinator` at host:port instead of writing the BSP (needs the same BSP, portal file and options)"},
+		{"-workertimeout <F>", "Drop a `-worker` that has not finished its range after F seconds and requeue its portals, 0 waits forever (default 600)"},
 	};
 	HelpOptions("VIS Stage", 0, 80, vis, sizeof(vis)/sizeof(struct HelpOption));
 }
@@ -156,11 +172,13 @@ void HelpLight()
 		{"-approx <N>", "Vertex light approximation tolerance (never use in conjunction with deluxemapping)"},
 		{"-areascale <F, `-area` F>", "Scaling factor for area lights (surfacelight)"},
 		{"-border", "Add a red border to lightmaps for debugging"},
+		{"-bouncecheckpoint <N>", "Write the BSP every <N> bounces instead of only once lighting is done"},
 		{"-bouncegrid", "Also compute radiosity on the light grid"},
 		{"-bounceonly", "Only compute radiosity"},
 		{"-bouncescale <F>", "Scaling factor for radiosity"},
 		{"-bounce <N>", "Number of bounces for radiosity"},
 		{"-bspfile <filename.bsp>", "BSP file to write"},
+		{"-bvh", "Trace shadows against a flat bounding volume hierarchy, same results as the default tree"},
 		{"-cheapgrid", "Use `-cheap` style lighting for radiosity"},
 		{"-cheap", "Abort vertex light calculations when white is reached"},
 		{"-compensate <F>", "Lightmap compensate (darkening factor applied after everything else)"},
@@ -199,6 +217,7 @@ void HelpLight()
 		{"-gamma <F>", "Lightmap gamma"},
 		{"-gridambientscale <F>", "Scaling factor for the light grid ambient components only"},
 		{"-gridscale <F>", "Scaling factor for the light grid only"},
+		{"-incremental", "Keep a .lcache file next to the BSP and only relight lightmaps whose lights or luxels changed since the last run"},
 		{"-keeplights", "Keep light entities in the BSP file after compile"},
 		{"-lightmapdir <directory>", "Directory to store external lightmaps (default: same as map name without extension)"},
 		{"-lightmapsearchblocksize <N>", "Restrict lightmap search to block size <N>"},
@@ -211,6 +230,7 @@ void HelpLight()
 		{"-nocollapse", "Do not collapse identical lightmaps"},
 		{"-nodeluxe, -nodeluxemap", "Disable deluxemapping"},
 		{"-nogrid", "Disable grid light calculation (makes all entities fullbright)"},
+		{"-nolightmapsort", "Illuminate raw lightmaps in index order instead of most expensive first"},
 		{"-nolightmapsearch", "Do not optimize lightmap packing for GPU memory usage (as doing so costs fps)"},
 		{"-normalmap", "Color the lightmaps according to the direction of the surface normal (TODO is this identical to `-debugnormals`?)"},
 		{"-nostyle, -nostyles", "Disable support for light styles"},
@@ -219,6 +239,7 @@ void HelpLight()
 		{"-novertex", "Disable vertex lighting"},
 		{"-patchshadows", "Cast shadows from patches"},
 		{"-pointscale <F, `-point` F>", "Scaling factor for point lights (light entities)"},
+		{"-preview <F>", "Write a quick preview BSP (no supersampling, filtering or dirt) first, then refine and bounce for up to <F> seconds"},
 		{"-samplescale <F>", "Scales all lightmap resolutions"},
 		{"-samplesize <N>", "Sets default lightmap resolution in luxels/qu"},
 		{"-samples <N>", "Adaptive supersampling quality"},
@@ -331,6 +352,8 @@ void HelpCommon()
 		{"-fs_pakpath <path>", "Specify a package directory (can be used more than once to look in multiple paths)"},
 		{"-subdivisions <F>", "multiplier for patch subdivisions quality"},
 		{"-threads <N>", "number of threads to use"},
+		{"-legacydispatch", "Hand out work items one at a time under a global lock instead of work stealing (for comparison)"},
+		{"-allocstats", "Count live and peak windings, brushes, portals, bsp faces and nodes across all threads and print them after the bsp stage"},
 		{"-v", "Verbose mode"}
 	};
 
@@ -1107,6 +1107,7 @@ int LightContributionToSample( trace_t *trace ){
 
 	/* clear color */
 	trace->forceSubsampling = 0.0f; /* to make sure */
+	trace->occlusionPending = qfalse;
 	VectorClear( trace->color );
 	VectorClear( trace->colorNoShadow );
 	VectorClear( trace->directionContribution );
@@ -1465,15 +1466,15 @@ int LightContributionToSample( trace_t *trace ){
 
 		/* trace to point */
 		if ( trace->testOcclusion && !trace->forceSunlight ) {
+			trace->occlusionScale = add;
+			if ( trace->deferOcclusion ) {
+				trace->occlusionPending = qtrue;
+				return 1;
+			}
+
 			/* trace */
 			TraceLine( trace );
-			trace->forceSubsampling *= add;
-			if ( !( trace->compileFlags & C_SKY ) || trace->opaque ) {
-				VectorClear( trace->color );
-				VectorClear( trace->directionContribution );
-
-				return -1;
-			}
+			return FinishLightContribution( trace );
 		}
 
 		/* return to sender */
@@ -1521,10 +1522,39 @@ int LightContributionToSample( trace_t *trace ){
 	trace->testAll = qfalse;
 	VectorScale( light->color, add, trace->color );
 
-	/* raytrace */
+	/* raytrace, unless the caller traces packets */
+	trace->occlusionScale = add;
+	if ( trace->deferOcclusion ) {
+		trace->occlusionPending = qtrue;
+		return 1;
+	}
 	TraceLine( trace );
-	trace->forceSubsampling *= add;
-	if ( trace->passSolid || trace->opaque ) {
+	return FinishLightContribution( trace );
+}
+
+
+
+/*
+   FinishLightContribution()
+   applies the occlusion found by TraceLine() to a light contribution
+ */
+
+int FinishLightContribution( trace_t *trace ){
+	qboolean occluded;
+
+
+	trace->occlusionPending = qfalse;
+	trace->forceSubsampling *= trace->occlusionScale;
+
+	/* sunlight has to reach the sky */
+	if ( trace->testAll ) {
+		occluded = !( trace->compileFlags & C_SKY ) || trace->opaque;
+	}
+	else{
+		occluded = trace->passSolid || trace->opaque;
+	}
+
+	if ( occluded ) {
 		VectorClear( trace->color );
 		VectorClear( trace->directionContribution );
 
@@ -2205,6 +2235,137 @@ void SetupGrid( void ){
 
 
 
+/*
+   PreviewTimeSpent()
+   true once a -preview run has used up its time budget
+ */
+
+static double lightStartTime;
+static qboolean previewCutShort;
+
+static qboolean PreviewTimeSpent( void ){
+	return ( previewTime > 0.0f && I_FloatTime() - lightStartTime >= previewTime );
+}
+
+
+
+/*
+   PreviewLightWorld()
+   lights the raw lightmaps once without supersampling, filtering or dirt
+   and writes the bsp, then puts the raw lightmaps back the way
+   IlluminateRawLightmap() expects them so the full passes come out the
+   same as without -preview
+ */
+
+static void PreviewLightWorld( const char *BSPFilePath, qboolean fastAllocate ){
+	int i, lightmapNum, size, savedSamples, savedLuxels;
+	qboolean savedRandomSamples, savedFilter, savedDirty, savedCache;
+	rawLightmap_t       *lm;
+	int                 **clusters;
+	float               **luxels, **deluxels;
+	byte                *styles, *styled;
+
+
+	/* note it */
+	Sys_Printf( "--- PreviewRawLightmap ---\n" );
+
+	/* keep what the preview pass changes */
+	clusters = safe_malloc( numRawLightmaps * sizeof( *clusters ) );
+	luxels = safe_malloc( numRawLightmaps * sizeof( *luxels ) );
+	deluxels = safe_malloc( numRawLightmaps * sizeof( *deluxels ) );
+	styles = safe_malloc( numRawLightmaps * MAX_LIGHTMAPS );
+	styled = safe_malloc( numRawLightmaps * MAX_LIGHTMAPS );
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		lm = &rawLightmaps[ i ];
+		size = lm->sw * lm->sh;
+		clusters[ i ] = safe_malloc( size * sizeof( int ) );
+		memcpy( clusters[ i ], lm->superClusters, size * sizeof( int ) );
+		luxels[ i ] = safe_malloc( size * SUPER_LUXEL_SIZE * sizeof( float ) );
+		memcpy( luxels[ i ], lm->superLuxels[ 0 ], size * SUPER_LUXEL_SIZE * sizeof( float ) );
+		deluxels[ i ] = NULL;
+		if ( lm->superDeluxels != NULL ) {
+			deluxels[ i ] = safe_malloc( size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+			memcpy( deluxels[ i ], lm->superDeluxels, size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+		}
+		memcpy( &styles[ i * MAX_LIGHTMAPS ], lm->styles, MAX_LIGHTMAPS );
+		for ( lightmapNum = 0; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+			styled[ i * MAX_LIGHTMAPS + lightmapNum ] = ( lm->superLuxels[ lightmapNum ] != NULL );
+	}
+
+	/* cheap settings */
+	savedSamples = lightSamples;
+	savedRandomSamples = lightRandomSamples;
+	savedFilter = filter;
+	savedDirty = dirty;
+	savedCache = lightCache;
+	savedLuxels = numLuxelsIlluminated;
+	lightSamples = 1;
+	lightRandomSamples = qfalse;
+	filter = qfalse;
+	dirty = qfalse;
+	lightCache = qfalse;
+
+	/* light it */
+	SortRawLightmapsByCost();
+	RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmapSorted );
+	StitchSurfaceLightmaps();
+
+	/* write it out */
+	StoreSurfaceLightmaps( fastAllocate );
+	UnparseEntities();
+	Sys_Printf( "Writing preview %s (%.0f seconds)\n", BSPFilePath, I_FloatTime() - lightStartTime );
+	WriteBSPFile( BSPFilePath );
+
+	/* restore settings */
+	lightSamples = savedSamples;
+	lightRandomSamples = savedRandomSamples;
+	filter = savedFilter;
+	dirty = savedDirty;
+	lightCache = savedCache;
+	numLuxelsIlluminated = savedLuxels;
+
+	/* restore the raw lightmaps */
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		lm = &rawLightmaps[ i ];
+		size = lm->sw * lm->sh;
+		memcpy( lm->superClusters, clusters[ i ], size * sizeof( int ) );
+		memcpy( lm->superLuxels[ 0 ], luxels[ i ], size * SUPER_LUXEL_SIZE * sizeof( float ) );
+		if ( deluxels[ i ] != NULL ) {
+			memcpy( lm->superDeluxels, deluxels[ i ], size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+		}
+		memcpy( lm->styles, &styles[ i * MAX_LIGHTMAPS ], MAX_LIGHTMAPS );
+		for ( lightmapNum = 1; lightmapNum < MAX_LIGHTMAPS; lightmapNum++ )
+		{
+			if ( lm->superLuxels[ lightmapNum ] != NULL && !styled[ i * MAX_LIGHTMAPS + lightmapNum ] ) {
+				free( lm->superLuxels[ lightmapNum ] );
+				lm->superLuxels[ lightmapNum ] = NULL;
+			}
+			if ( lm->bspLuxels[ lightmapNum ] != NULL ) {
+				free( lm->bspLuxels[ lightmapNum ] );
+				lm->bspLuxels[ lightmapNum ] = NULL;
+			}
+		}
+
+		/* StoreSurfaceLightmaps() adds up into the bsp luxels */
+		memset( lm->bspLuxels[ 0 ], 0, lm->w * lm->h * BSP_LUXEL_SIZE * sizeof( float ) );
+		if ( lm->bspDeluxels != NULL ) {
+			memset( lm->bspDeluxels, 0, lm->w * lm->h * BSP_DELUXEL_SIZE * sizeof( float ) );
+		}
+		free( clusters[ i ] );
+		free( luxels[ i ] );
+		free( deluxels[ i ] );
+	}
+	free( clusters );
+	free( luxels );
+	free( deluxels );
+	free( styles );
+	free( styled );
+}
+
+
+
 /*
    LightWorld()
    does what it says...
@@ -2218,6 +2379,9 @@ void LightWorld( const char *BSPFilePath, qboolean fastAllocate ){
 	const char  *value;
 
 
+	/* -preview counts from here */
+	lightStartTime = I_FloatTime();
+
 	/* ydnar: smooth normals */
 	if ( shade ) {
 		Sys_Printf( "--- SmoothNormals ---\n" );
@@ -2341,15 +2505,32 @@ void LightWorld( const char *BSPFilePath, qboolean fastAllocate ){
 	/* ydnar: set up light envelopes */
 	SetupEnvelopes( qfalse, fast );
 
-	/* light up my world */
+	/* write a quick preview first, then refine while the time budget lasts */
+	if ( previewTime > 0.0f ) {
+		PreviewLightWorld( BSPFilePath, fastAllocate );
+		if ( PreviewTimeSpent() ) {
+			Sys_Printf( "Preview time budget spent, keeping the preview lightmaps\n" );
+			previewCutShort = qtrue;
+			return;
+		}
+	}
+
+	/* light up my world, most expensive lightmaps first */
+	SortRawLightmapsByCost();
 	lightsPlaneCulled = 0;
 	lightsEnvelopeCulled = 0;
 	lightsBoundsCulled = 0;
 	lightsClusterCulled = 0;
 
 	Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-	RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
+	if ( lightCache ) {
+		BeginLightCachePass( 0 );
+	}
+	RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmapSorted );
 	Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
+	if ( lightCache ) {
+		EndLightCachePass();
+	}
 
 	StitchSurfaceLightmaps();
 
@@ -2370,11 +2551,22 @@ void LightWorld( const char *BSPFilePath, qboolean fastAllocate ){
 	bt = bounce;
 	while ( bounce > 0 )
 	{
-		/* store off the bsp between bounces */
+		/* -preview: stop refining when the time is up */
+		if ( PreviewTimeSpent() ) {
+			Sys_Printf( "Preview time budget spent, skipping the remaining %d bounce(s)\n", bounce );
+			previewCutShort = qtrue;
+			break;
+		}
+
+		/* RadCreateDiffuseLights() samples the float radLuxels and surface styles this leaves in memory */
 		StoreSurfaceLightmaps( fastAllocate );
-		UnparseEntities();
-		Sys_Printf( "Writing %s\n", BSPFilePath );
-		WriteBSPFile( BSPFilePath );
+
+		/* only write the bsp out between bounces for checkpoints and -preview */
+		if ( previewTime > 0.0f || ( bounceCheckpoint > 0 && ( b - 1 ) % bounceCheckpoint == 0 ) ) {
+			UnparseEntities();
+			Sys_Printf( "Writing %s\n", BSPFilePath );
+			WriteBSPFile( BSPFilePath );
+		}
 
 		/* note it */
 		Sys_Printf( "\n--- Radiosity (bounce %d of %d) ---\n", b, bt );
@@ -2408,16 +2600,23 @@ void LightWorld( const char *BSPFilePath, qboolean fastAllocate ){
 			Sys_FPrintf( SYS_VRB, "%9d grid points bounds culled\n", gridBoundsCulled );
 		}
 
-		/* light up my world */
+		/* light up my world, most expensive lightmaps first */
+		SortRawLightmapsByCost();
 		lightsPlaneCulled = 0;
 		lightsEnvelopeCulled = 0;
 		lightsBoundsCulled = 0;
 		lightsClusterCulled = 0;
 
 		Sys_Printf( "--- IlluminateRawLightmap ---\n" );
-		RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmap );
+		if ( lightCache ) {
+			BeginLightCachePass( b );
+		}
+		RunThreadsOnIndividual( numRawLightmaps, qtrue, IlluminateRawLightmapSorted );
 		Sys_Printf( "%9d luxels illuminated\n", numLuxelsIlluminated );
 		Sys_Printf( "%9d vertexes illuminated\n", numVertsIlluminated );
+		if ( lightCache ) {
+			EndLightCachePass();
+		}
 
 		StitchSurfaceLightmaps();
 
@@ -2912,6 +3111,17 @@ int LightMain( int argc, char **argv ){
 			Sys_Printf( "Only computing sunlight\n" );
 		}
 
+		else if ( !strcmp( argv[ i ], "-bouncecheckpoint" ) ) {
+			bounceCheckpoint = atoi( argv[ i + 1 ] );
+			if ( bounceCheckpoint < 0 ) {
+				bounceCheckpoint = 0;
+			}
+			else if ( bounceCheckpoint > 0 ) {
+				Sys_Printf( "Writing the BSP every %d bounce(s)\n", bounceCheckpoint );
+			}
+			i++;
+		}
+
 		else if ( !strcmp( argv[ i ], "-bounceonly" ) ) {
 			bounceOnly = qtrue;
 			Sys_Printf( "Storing bounced light (radiosity) only\n" );
@@ -2922,6 +3132,25 @@ int LightMain( int argc, char **argv ){
 			Sys_Printf( "Identical lightmap collapsing disabled\n" );
 		}
 
+		else if ( !strcmp( argv[ i ], "-preview" ) ) {
+			previewTime = atof( argv[ i + 1 ] );
+			if ( previewTime < 0.0f ) {
+				previewTime = 0.0f;
+			}
+			i++;
+			Sys_Printf( "Writing a preview first, refining for up to %g seconds\n", previewTime );
+		}
+
+		else if ( !strcmp( argv[ i ], "-incremental" ) ) {
+			lightCache = qtrue;
+			Sys_Printf( "Incremental relighting enabled\n" );
+		}
+
+		else if ( !strcmp( argv[ i ], "-nolightmapsort" ) ) {
+			noLightmapSort = qtrue;
+			Sys_Printf( "Illuminating raw lightmaps in index order\n" );
+		}
+
 		else if ( !strcmp( argv[ i ], "-nolightmapsearch" ) ) {
 			lightmapSearchBlockSize = 1;
 			Sys_Printf( "No lightmap searching - all lightmaps will be sequential\n" );
@@ -3111,6 +3340,10 @@ int LightMain( int argc, char **argv ){
 			loMem = qtrue;
 			Sys_Printf( "Enabling low-memory (potentially slower) lighting mode\n" );
 		}
+		else if ( !strcmp( argv[ i ], "-bvh" ) ) {
+			traceBVH = qtrue;
+			Sys_Printf( "Tracing shadows against a flat bvh\n" );
+		}
 		else if ( !strcmp( argv[ i ], "-lightsubdiv" ) ) {
 			defaultLightSubdivide = atoi( argv[ i + 1 ] );
 			if ( defaultLightSubdivide < 1 ) {
@@ -3333,9 +3566,19 @@ int LightMain( int argc, char **argv ){
 	/* initialize the surface facet tracing */
 	SetupTraceNodes();
 
+	/* set up incremental relighting */
+	if ( lightCache ) {
+		SetupLightCache( BSPFilePath, argc, argv );
+	}
+
 	/* light the world */
 	LightWorld( BSPFilePath, fastAllocate );
 
+	/* replace the old cache, unless -preview stopped before every pass was lit */
+	if ( lightCache ) {
+		FinishLightCache( !previewCutShort );
+	}
+
 	/* write out the bsp */
 	UnparseEntities();
 	Sys_Printf( "Writing %s\n", BSPFilePath );
@@ -0,0 +1,605 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define LIGHT_CACHE_C
+
+
+
+/* dependencies */
+#include "vmap.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+   incremental relighting
+
+   -incremental keeps a <map>.lcache file next to the bsp with the luxels every
+   raw lightmap came out of IlluminateRawLightmap() with, one section per pass
+   (direct light, then each bounce). every entry is keyed on a hash of all the
+   raw lightmap's inputs: its luxel origins, normals, dirt and clusters, the
+   lights CreateTraceLightsForBounds() left it with, and the ambient/bounce
+   state of the pass. on the next run a raw lightmap whose key matches is
+   restored instead of lit, so moving one light only relights the lightmaps
+   it reaches (and on bounces, the ones its changed bounce light reaches).
+
+   anything that reaches the lightmaps through the trace geometry, the bsp
+   tree, the worldspawn or the command line is folded into a single scene
+   hash, a mismatch there throws the whole cache away.
+
+   ------------------------------------------------------------------------------- */
+
+#define LIGHT_CACHE_MAGIC       ( ( '1' << 24 ) + ( 'C' << 16 ) + ( 'L' << 8 ) + 'V' )
+#define LIGHT_CACHE_VERSION     1
+
+typedef struct lightCacheHeader_s
+{
+	int magic, version;
+	int luxelSize, deluxelSize;
+	unsigned int sceneHash[ 2 ];
+	int numRawLightmaps;
+}
+lightCacheHeader_t;
+
+typedef struct lightCachePass_s
+{
+	int pass, numEntries;
+}
+lightCachePass_t;
+
+/* followed by the luxels of every style in luxelMask, the deluxels and the clusters */
+typedef struct lightCacheEntry_s
+{
+	int rawLightmapNum;
+	int size;                           /* bytes, this header included */
+	unsigned int key[ 2 ];
+	int sw, sh;
+	int luxelMask;
+	qboolean hasDeluxels;
+	byte styles[ MAX_LIGHTMAPS ];
+}
+lightCacheEntry_t;
+
+static char cachePath[ 1024 ], cacheTempPath[ 1024 ];
+static FILE                 *oldCacheFile, *newCacheFile;
+static unsigned int sceneHash[ 2 ];
+static int cachePass, numCachedLightmaps;
+
+static lightCacheEntry_t    **oldEntries, **newEntries;
+static unsigned int         *passKeys;
+static byte                 *passReused;
+
+
+
+/*
+   HashString()
+   hashes a string including its terminator, so "ab" + "c" != "a" + "bc"
+ */
+
+static void HashString( unsigned int hash[ 2 ], const char *s ){
+	if ( s == NULL ) {
+		s = "";
+	}
+	HashBytes( hash, s, strlen( s ) + 1 );
+}
+
+
+
+/*
+   HashLight()
+   hashes everything about a light that LightContributionToSample() looks at
+ */
+
+static void HashLight( unsigned int hash[ 2 ], const light_t *light ){
+	HashBytes( hash, &light->type, sizeof( light->type ) );
+	HashBytes( hash, &light->flags, sizeof( light->flags ) );
+	HashString( hash, light->si != NULL ? light->si->shader : NULL );
+
+	/* origin through cluster are plain ints and floats */
+	HashBytes( hash, light->origin, (const byte*) ( &light->cluster + 1 ) - (const byte*) light->origin );
+	if ( light->w != NULL ) {
+		HashBytes( hash, &light->w->numpoints, sizeof( light->w->numpoints ) );
+		HashBytes( hash, light->w->p, light->w->numpoints * sizeof( *light->w->p ) );
+	}
+	HashBytes( hash, light->emitColor, sizeof( light->emitColor ) );
+	HashBytes( hash, &light->falloffTolerance, sizeof( light->falloffTolerance ) );
+	HashBytes( hash, &light->filterRadius, sizeof( light->filterRadius ) );
+}
+
+
+
+/*
+   EntrySize()
+   bytes taken by a cache entry of a raw lightmap with this many super luxels
+ */
+
+static int EntrySize( int size, int luxelMask, qboolean hasDeluxels ){
+	int i, entrySize;
+
+
+	entrySize = sizeof( lightCacheEntry_t ) + size * sizeof( int );
+	for ( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		if ( luxelMask & ( 1 << i ) ) {
+			entrySize += size * SUPER_LUXEL_SIZE * sizeof( float );
+		}
+	}
+	if ( hasDeluxels ) {
+		entrySize += size * SUPER_DELUXEL_SIZE * sizeof( float );
+	}
+	return entrySize;
+}
+
+
+
+/*
+   FreePassEntries()
+   frees a pass worth of cache entries
+ */
+
+static void FreePassEntries( lightCacheEntry_t **entries ){
+	int i;
+
+
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		if ( entries[ i ] != NULL ) {
+			free( entries[ i ] );
+			entries[ i ] = NULL;
+		}
+	}
+}
+
+
+
+/*
+   ReadCachePass()
+   reads the next section of the old cache, which has to be the given pass.
+   the old cache is dropped on anything unexpected.
+ */
+
+static void ReadCachePass( int pass ){
+	int i;
+	lightCachePass_t header;
+	lightCacheEntry_t entry, *e;
+
+
+	if ( oldCacheFile == NULL ) {
+		return;
+	}
+
+	/* the last run may have stopped bouncing earlier */
+	if ( fread( &header, sizeof( header ), 1, oldCacheFile ) != 1 || header.pass != pass ||
+	     header.numEntries < 0 || header.numEntries > numRawLightmaps ) {
+		fclose( oldCacheFile );
+		oldCacheFile = NULL;
+		return;
+	}
+
+	for ( i = 0; i < header.numEntries; i++ )
+	{
+		if ( fread( &entry, sizeof( entry ), 1, oldCacheFile ) != 1 ||
+		     entry.rawLightmapNum < 0 || entry.rawLightmapNum >= numRawLightmaps ||
+		     entry.size < (int) sizeof( entry ) || oldEntries[ entry.rawLightmapNum ] != NULL ) {
+			break;
+		}
+		e = safe_malloc( entry.size );
+		memcpy( e, &entry, sizeof( entry ) );
+		if ( entry.size > (int) sizeof( entry ) && fread( e + 1, entry.size - sizeof( entry ), 1, oldCacheFile ) != 1 ) {
+			free( e );
+			break;
+		}
+		oldEntries[ entry.rawLightmapNum ] = e;
+	}
+
+	/* truncated or garbage */
+	if ( i < header.numEntries ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Light cache %s is damaged, ignoring the rest of it\n", cachePath );
+		FreePassEntries( oldEntries );
+		fclose( oldCacheFile );
+		oldCacheFile = NULL;
+	}
+}
+
+
+
+/*
+   SetupLightCache()
+   hashes the scene, opens the last run's cache if it was made from the same
+   scene and starts the new one. call after SetupTraceNodes().
+ */
+
+void SetupLightCache( const char *BSPFilePath, int argc, char **argv ){
+	int i;
+	epair_t             *ep;
+	lightCacheHeader_t header;
+
+
+	/* note it */
+	Sys_FPrintf( SYS_VRB, "--- SetupLightCache ---\n" );
+
+	strcpy( cachePath, BSPFilePath );
+	StripExtension( cachePath );
+	DefaultExtension( cachePath, ".lcache" );
+	sprintf( cacheTempPath, "%s.tmp", cachePath );
+
+	/* command line, minus the map name */
+	sceneHash[ 0 ] = 2166136261u;
+	sceneHash[ 1 ] = LIGHT_CACHE_VERSION;
+	for ( i = 0; i < argc - 1; i++ )
+		HashString( sceneHash, argv[ i ] );
+
+	/* worldspawn carries the ambient, minlight, floodlight, dirt and sun keys */
+	for ( ep = entities[ 0 ].epairs; ep != NULL; ep = ep->next )
+	{
+		HashString( sceneHash, ep->key );
+		HashString( sceneHash, ep->value );
+	}
+
+	/* the bsp tree, for luxel clusters and pvs */
+	HashBytes( sceneHash, bspPlanes, numBSPPlanes * sizeof( *bspPlanes ) );
+	HashBytes( sceneHash, bspNodes, numBSPNodes * sizeof( *bspNodes ) );
+	HashBytes( sceneHash, bspLeafs, numBSPLeafs * sizeof( *bspLeafs ) );
+	HashBytes( sceneHash, bspVisBytes, numBSPVisBytes );
+
+	/* everything that casts a shadow */
+	HashTraceGeometry( sceneHash );
+
+	/* set up the per pass tables */
+	oldEntries = safe_malloc( numRawLightmaps * sizeof( *oldEntries ) );
+	newEntries = safe_malloc( numRawLightmaps * sizeof( *newEntries ) );
+	memset( oldEntries, 0, numRawLightmaps * sizeof( *oldEntries ) );
+	memset( newEntries, 0, numRawLightmaps * sizeof( *newEntries ) );
+	passKeys = safe_malloc( numRawLightmaps * 2 * sizeof( *passKeys ) );
+	passReused = safe_malloc( numRawLightmaps * sizeof( *passReused ) );
+	numCachedLightmaps = 0;
+
+	/* open the old cache */
+	oldCacheFile = fopen( cachePath, "rb" );
+	if ( oldCacheFile != NULL ) {
+		if ( fread( &header, sizeof( header ), 1, oldCacheFile ) != 1 ||
+		     header.magic != LIGHT_CACHE_MAGIC || header.version != LIGHT_CACHE_VERSION ||
+		     header.luxelSize != SUPER_LUXEL_SIZE || header.deluxelSize != SUPER_DELUXEL_SIZE ||
+		     header.sceneHash[ 0 ] != sceneHash[ 0 ] || header.sceneHash[ 1 ] != sceneHash[ 1 ] ||
+		     header.numRawLightmaps != numRawLightmaps ) {
+			Sys_Printf( "Light cache %s does not match this map, relighting everything\n", cachePath );
+			fclose( oldCacheFile );
+			oldCacheFile = NULL;
+		}
+		else{
+			Sys_Printf( "Reusing unchanged lightmaps from %s\n", cachePath );
+		}
+	}
+
+	/* start the new one, it replaces the old one once lighting is done */
+	newCacheFile = SafeOpenWrite( cacheTempPath );
+	memset( &header, 0, sizeof( header ) );
+	header.magic = LIGHT_CACHE_MAGIC;
+	header.version = LIGHT_CACHE_VERSION;
+	header.luxelSize = SUPER_LUXEL_SIZE;
+	header.deluxelSize = SUPER_DELUXEL_SIZE;
+	header.sceneHash[ 0 ] = sceneHash[ 0 ];
+	header.sceneHash[ 1 ] = sceneHash[ 1 ];
+	header.numRawLightmaps = numRawLightmaps;
+	SafeWrite( newCacheFile, &header, sizeof( header ) );
+}
+
+
+
+/*
+   BeginLightCachePass()
+   loads the last run's results for this pass, 0 is direct light, 1+ the bounces
+ */
+
+void BeginLightCachePass( int pass ){
+	if ( newCacheFile == NULL ) {
+		return;
+	}
+
+	cachePass = pass;
+	memset( passReused, 0, numRawLightmaps * sizeof( *passReused ) );
+	ReadCachePass( pass );
+}
+
+
+
+/*
+   LightCacheRestore()
+   keys a raw lightmap on everything IlluminateRawLightmap() is about to read
+   and copies the last run's result over it if the key matches. must be
+   called with the light list from CreateTraceLightsForBounds() before the
+   raw lightmap is touched.
+ */
+
+qboolean LightCacheRestore( int rawLightmapNum, const trace_t *trace ){
+	int i, x, y, size, luxelMask;
+	rawLightmap_t       *lm;
+	unsigned int        *key;
+	lightCacheEntry_t   *e;
+	float               *data;
+
+
+	if ( newCacheFile == NULL ) {
+		return qfalse;
+	}
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+
+	luxelMask = 0;
+	for ( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		if ( lm->superLuxels[ i ] != NULL ) {
+			luxelMask |= ( 1 << i );
+		}
+	}
+
+	/* pass state */
+	key = &passKeys[ rawLightmapNum * 2 ];
+	key[ 0 ] = sceneHash[ 0 ];
+	key[ 1 ] = sceneHash[ 1 ];
+	HashBytes( key, &cachePass, sizeof( cachePass ) );
+	HashBytes( key, &rawLightmapNum, sizeof( rawLightmapNum ) );
+	HashBytes( key, &bouncing, sizeof( bouncing ) );
+	HashBytes( key, &floodlighty, sizeof( floodlighty ) );
+	HashBytes( key, ambientColor, sizeof( ambientColor ) );
+
+	/* raw lightmap setup */
+	HashBytes( key, &lm->sw, sizeof( lm->sw ) );
+	HashBytes( key, &lm->sh, sizeof( lm->sh ) );
+	HashBytes( key, &lm->sampleSize, sizeof( lm->sampleSize ) );
+	HashBytes( key, &lm->actualSampleSize, sizeof( lm->actualSampleSize ) );
+	HashBytes( key, &lm->filterRadius, sizeof( lm->filterRadius ) );
+	HashBytes( key, &lm->splotchFix, sizeof( lm->splotchFix ) );
+	HashBytes( key, &lm->recvShadows, sizeof( lm->recvShadows ) );
+	HashBytes( key, &trace->twoSided, sizeof( trace->twoSided ) );
+	HashBytes( key, lm->mins, sizeof( lm->mins ) );
+	HashBytes( key, lm->maxs, sizeof( lm->maxs ) );
+	if ( lm->plane != NULL ) {
+		HashBytes( key, lm->plane, 4 * sizeof( *lm->plane ) );
+	}
+	HashBytes( key, &lm->numLightSurfaces, sizeof( lm->numLightSurfaces ) );
+	HashBytes( key, &lightSurfaces[ lm->firstLightSurface ], lm->numLightSurfaces * sizeof( *lightSurfaces ) );
+	HashBytes( key, &lm->numLightClusters, sizeof( lm->numLightClusters ) );
+	HashBytes( key, lm->lightClusters, lm->numLightClusters * sizeof( *lm->lightClusters ) );
+	HashBytes( key, lm->styles, sizeof( lm->styles ) );
+	HashBytes( key, &luxelMask, sizeof( luxelMask ) );
+
+	/* luxels */
+	size = lm->sw * lm->sh;
+	HashBytes( key, lm->superOrigins, size * SUPER_ORIGIN_SIZE * sizeof( float ) );
+	HashBytes( key, lm->superNormals, size * SUPER_NORMAL_SIZE * sizeof( float ) );
+	HashBytes( key, lm->superClusters, size * sizeof( int ) );
+	if ( floodlighty && lm->superFloodLight != NULL ) {
+		HashBytes( key, lm->superFloodLight, size * SUPER_FLOODLIGHT_SIZE * sizeof( float ) );
+	}
+
+	/* unmapped luxels keep their alpha and deluxel through the fill pass */
+	for ( y = 0; y < lm->sh; y++ )
+	{
+		for ( x = 0; x < lm->sw; x++ )
+		{
+			if ( *SUPER_CLUSTER( x, y ) >= 0 ) {
+				continue;
+			}
+			HashBytes( key, &SUPER_LUXEL( 0, x, y )[ 3 ], sizeof( float ) );
+			if ( lm->superDeluxels != NULL ) {
+				HashBytes( key, SUPER_DELUXEL( x, y ), SUPER_DELUXEL_SIZE * sizeof( float ) );
+			}
+		}
+	}
+
+	/* lights, in the order they get added up */
+	HashBytes( key, &trace->numLights, sizeof( trace->numLights ) );
+	for ( i = 0; i < trace->numLights; i++ )
+		HashLight( key, trace->lights[ i ] );
+
+	/* look it up */
+	e = oldEntries[ rawLightmapNum ];
+	if ( e == NULL || e->key[ 0 ] != key[ 0 ] || e->key[ 1 ] != key[ 1 ] ||
+	     e->sw != lm->sw || e->sh != lm->sh || ( e->luxelMask & luxelMask ) != luxelMask ||
+	     e->hasDeluxels != ( lm->superDeluxels != NULL ) || e->size != EntrySize( size, e->luxelMask, e->hasDeluxels ) ) {
+		return qfalse;
+	}
+
+	/* restore it */
+	data = (float*) ( e + 1 );
+	for ( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		if ( !( e->luxelMask & ( 1 << i ) ) ) {
+			continue;
+		}
+		if ( lm->superLuxels[ i ] == NULL ) {
+			lm->superLuxels[ i ] = safe_malloc( size * SUPER_LUXEL_SIZE * sizeof( float ) );
+		}
+		memcpy( lm->superLuxels[ i ], data, size * SUPER_LUXEL_SIZE * sizeof( float ) );
+		data += size * SUPER_LUXEL_SIZE;
+	}
+	if ( e->hasDeluxels ) {
+		memcpy( lm->superDeluxels, data, size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+		data += size * SUPER_DELUXEL_SIZE;
+	}
+	memcpy( lm->superClusters, data, size * sizeof( int ) );
+	memcpy( lm->styles, e->styles, sizeof( lm->styles ) );
+
+	/* carry it over to the new cache */
+	oldEntries[ rawLightmapNum ] = NULL;
+	newEntries[ rawLightmapNum ] = e;
+	passReused[ rawLightmapNum ] = 1;
+	return qtrue;
+}
+
+
+
+/*
+   LightCacheStore()
+   records what IlluminateRawLightmap() made of a raw lightmap
+   under the key LightCacheRestore() computed for it
+ */
+
+void LightCacheStore( int rawLightmapNum ){
+	int i, size, luxelMask, entrySize;
+	rawLightmap_t       *lm;
+	lightCacheEntry_t   *e;
+	float               *data;
+
+
+	if ( newCacheFile == NULL ) {
+		return;
+	}
+
+	/* get lightmap */
+	lm = &rawLightmaps[ rawLightmapNum ];
+	size = lm->sw * lm->sh;
+
+	/* size it */
+	luxelMask = 0;
+	for ( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		if ( lm->superLuxels[ i ] != NULL ) {
+			luxelMask |= ( 1 << i );
+		}
+	}
+	entrySize = EntrySize( size, luxelMask, lm->superDeluxels != NULL );
+
+	/* fill it out */
+	e = safe_malloc( entrySize );
+	memset( e, 0, sizeof( *e ) );
+	e->rawLightmapNum = rawLightmapNum;
+	e->size = entrySize;
+	e->key[ 0 ] = passKeys[ rawLightmapNum * 2 ];
+	e->key[ 1 ] = passKeys[ rawLightmapNum * 2 + 1 ];
+	e->sw = lm->sw;
+	e->sh = lm->sh;
+	e->luxelMask = luxelMask;
+	e->hasDeluxels = ( lm->superDeluxels != NULL );
+	memcpy( e->styles, lm->styles, sizeof( e->styles ) );
+
+	data = (float*) ( e + 1 );
+	for ( i = 0; i < MAX_LIGHTMAPS; i++ )
+	{
+		if ( luxelMask & ( 1 << i ) ) {
+			memcpy( data, lm->superLuxels[ i ], size * SUPER_LUXEL_SIZE * sizeof( float ) );
+			data += size * SUPER_LUXEL_SIZE;
+		}
+	}
+	if ( e->hasDeluxels ) {
+		memcpy( data, lm->superDeluxels, size * SUPER_DELUXEL_SIZE * sizeof( float ) );
+		data += size * SUPER_DELUXEL_SIZE;
+	}
+	memcpy( data, lm->superClusters, size * sizeof( int ) );
+
+	/* each raw lightmap is lit by exactly one thread */
+	newEntries[ rawLightmapNum ] = e;
+}
+
+
+
+/*
+   EndLightCachePass()
+   writes the pass out to the new cache and reports how much was reused
+ */
+
+void EndLightCachePass( void ){
+	int i, numReused;
+	lightCachePass_t header;
+
+
+	if ( newCacheFile == NULL ) {
+		return;
+	}
+
+	header.pass = cachePass;
+	header.numEntries = 0;
+	numReused = 0;
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		if ( newEntries[ i ] != NULL ) {
+			header.numEntries++;
+		}
+		numReused += passReused[ i ];
+	}
+
+	SafeWrite( newCacheFile, &header, sizeof( header ) );
+	for ( i = 0; i < numRawLightmaps; i++ )
+	{
+		if ( newEntries[ i ] != NULL ) {
+			SafeWrite( newCacheFile, newEntries[ i ], newEntries[ i ]->size );
+		}
+	}
+
+	FreePassEntries( oldEntries );
+	FreePassEntries( newEntries );
+	numCachedLightmaps += numReused;
+
+	Sys_Printf( "%9d raw lightmaps reused from cache\n", numReused );
+}
+
+
+
+/*
+   FinishLightCache()
+   replaces the old cache with the one written by this run, or throws
+   the new one away when the run did not light every pass
+ */
+
+void FinishLightCache( qboolean complete ){
+	if ( newCacheFile == NULL ) {
+		return;
+	}
+
+	if ( oldCacheFile != NULL ) {
+		fclose( oldCacheFile );
+		oldCacheFile = NULL;
+	}
+	fclose( newCacheFile );
+	newCacheFile = NULL;
+
+	/* a run cut short has no entries for the passes it skipped, so keep the old cache */
+	if ( !complete ) {
+		remove( cacheTempPath );
+		Sys_Printf( "Run cut short, keeping the old light cache %s\n", cachePath );
+	}
+	else{
+		remove( cachePath );
+		if ( rename( cacheTempPath, cachePath ) != 0 ) {
+			Sys_FPrintf( SYS_WRN, "WARNING: Unable to write light cache %s\n", cachePath );
+		}
+		else{
+			Sys_FPrintf( SYS_VRB, "Wrote light cache %s (%d raw lightmaps reused)\n", cachePath, numCachedLightmaps );
+		}
+	}
+
+	free( oldEntries );
+	free( newEntries );
+	free( passKeys );
+	free( passReused );
+}
@@ -40,6 +40,14 @@
 /* dependencies */
 #include "vmap.h"
 
+/* sse packet tracing, gcc and msvc both predefine these when sse is available */
+#if defined( __SSE__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+	#define TRACE_SSE               1
+	#include <xmmintrin.h>
+#else
+	#define TRACE_SSE               0
+#endif
+
 
 
 #define Vector2Copy( a, b )     ( ( b )[ 0 ] = ( a )[ 0 ], ( b )[ 1 ] = ( a )[ 1 ] )
@@ -56,11 +64,24 @@
 #define GROW_TRACE_NODES        16384       //%	16384
 #define GROW_NODE_ITEMS         16          //%	256
 
+#define BVH_MAX_LEAF_TRIANGLES  4
+#define BVH_MAX_DEPTH           64
+#define BVH_NUM_BINS            16
+#define BVH_BOUNDS_EPSILON      0.1f
+#define TRACE_PACKET_SIZE       4
+#define TRACE_BLOCK_SIZE        4
+
 // vortex: increased from 12 to 24 for ability co compile some insane maps with large curve count
 #define MAX_TW_VERTS            24
 
 #define TRACE_ON_EPSILON        0.1f
 
+#define BARY_EPSILON            0.01f
+#define ASLF_EPSILON            0.0001f /* so to not get double shadows */
+#define COPLANAR_EPSILON        0.25f   //%	0.000001f
+#define NEAR_SHADOW_EPSILON     1.5f    //%	1.25f
+#define SELF_SHADOW_EPSILON     0.5f
+
 #define TRACE_LEAF              -1
 #define TRACE_LEAF_SOLID        -2
 
@@ -102,9 +123,42 @@ typedef struct traceNode_s
 	int children[ 2 ];
 	int numItems, maxItems;
 	int                         *items;
+	int firstBlock, numBlocks;
 }
 traceNode_t;
 
+/* the triangles of a trace leaf transposed for the simd triangle test, with the shadow checks as lane masks */
+typedef struct traceBlock_s
+{
+	float v0[ 3 ][ TRACE_BLOCK_SIZE ], edge1[ 3 ][ TRACE_BLOCK_SIZE ], edge2[ 3 ][ TRACE_BLOCK_SIZE ];
+	int triangles[ TRACE_BLOCK_SIZE ];
+	int surfaceNums[ TRACE_BLOCK_SIZE ];
+	int numTriangles;
+	int worldMask;                              /* lanes casting worldspawn group shadows */
+	int skipGridMask;                           /* lanes skipped by the light grid */
+	int filterMask;                             /* sky, alphashadow and lightfilter lanes, left to TraceTriangle */
+}
+traceBlock_t;
+
+/* flat bvh node, 32 bytes. the first child of an interior node directly follows it */
+typedef struct traceBVHNode_s
+{
+	float mins[ 3 ], maxs[ 3 ];
+	int offset;                                 /* first triangle (leaf) or second child (interior) */
+	int numTriangles;                           /* 0 for interior nodes */
+}
+traceBVHNode_t;
+
+/* bsp part of the trace tree, kept for the solid leaf test, 32 bytes */
+typedef struct traceSolidNode_s
+{
+	vec4_t plane;
+	int type;
+	int children[ 2 ];
+	int pad;
+}
+traceSolidNode_t;
+
 
 int noDrawContentFlags, noDrawSurfaceFlags, noDrawCompileFlags;
 
@@ -121,6 +175,19 @@ int headNodeNum = 0, skyboxNodeNum = 0, maxTraceDepth = 0, numTraceLeafNodes = 0
 int numTraceNodes = 0, maxTraceNodes = 0;
 traceNode_t                     *traceNodes = NULL;
 
+int numTraceBlocks = 0;
+traceBlock_t                    *traceBlocks = NULL;
+
+int numTraceSolidNodes = 0;
+traceSolidNode_t                *traceSolidNodes = NULL;
+
+int numTraceBVHNodes = 0, maxTraceBVHNodes = 0, maxTraceBVHDepth = 0, numTraceBVHTriangles = 0;
+traceBVHNode_t                  *traceBVHNodes = NULL;
+
+/* bvh triangles are stored as separate arrays (v0, edge1, edge2 per axis) in leaf order */
+float                           *traceBVHVerts[ 9 ];
+int                             *traceBVHInfos = NULL;
+
 
 
 /* -------------------------------------------------------------------------------
@@ -1301,6 +1368,427 @@ static void PopulateTraceNodes( void ){
 
 
 
+/* -------------------------------------------------------------------------------
+
+   flat bvh setup (-bvh)
+
+   ------------------------------------------------------------------------------- */
+
+typedef struct bvhPrim_s
+{
+	int num;
+	vec3_t mins, maxs, center;
+}
+bvhPrim_t;
+
+static bvhPrim_t                *bvhPrims;
+
+
+
+/*
+   SetupTraceSolidNodes()
+   copies the bsp derived part of the trace tree before it gets subdivided
+ */
+
+static void SetupTraceSolidNodes( void ){
+	int i;
+
+
+	numTraceSolidNodes = numTraceNodes;
+	traceSolidNodes = safe_malloc( numTraceSolidNodes * sizeof( *traceSolidNodes ) );
+	memset( traceSolidNodes, 0, numTraceSolidNodes * sizeof( *traceSolidNodes ) );
+	for ( i = 0; i < numTraceSolidNodes; i++ )
+	{
+		traceSolidNodes[ i ].type = traceNodes[ i ].type;
+		Vector4Copy( traceNodes[ i ].plane, traceSolidNodes[ i ].plane );
+		traceSolidNodes[ i ].children[ 0 ] = traceNodes[ i ].children[ 0 ];
+		traceSolidNodes[ i ].children[ 1 ] = traceNodes[ i ].children[ 1 ];
+	}
+}
+
+
+
+/*
+   UpdateTraceSolidNodes()
+   solid leafs with windings in them get subdivided into regular nodes, which makes them non-solid
+ */
+
+static void UpdateTraceSolidNodes( void ){
+	int i;
+
+
+	for ( i = 0; i < numTraceSolidNodes; i++ )
+	{
+		if ( traceSolidNodes[ i ].type == TRACE_LEAF_SOLID && traceNodes[ i ].type != TRACE_LEAF_SOLID ) {
+			traceSolidNodes[ i ].type = TRACE_LEAF;
+		}
+	}
+}
+
+
+
+/*
+   AddTraceBVHPrims_r()
+   gathers the triangles TraceLine can test (non-solid leafs below the head node)
+ */
+
+static void AddTraceBVHPrims_r( int nodeNum ){
+	int i, j;
+	float eps;
+	traceNode_t     *node;
+	traceTriangle_t *tt;
+	bvhPrim_t       *prim;
+	vec3_t corner;
+
+
+	/* dummy check */
+	if ( nodeNum < 0 || nodeNum >= numTraceNodes ) {
+		return;
+	}
+	node = &traceNodes[ nodeNum ];
+
+	/* decision node */
+	if ( node->type >= 0 ) {
+		AddTraceBVHPrims_r( node->children[ 0 ] );
+		AddTraceBVHPrims_r( node->children[ 1 ] );
+		return;
+	}
+
+	/* items in solid leafs are never tested */
+	if ( node->type == TRACE_LEAF_SOLID ) {
+		return;
+	}
+
+	for ( i = 0; i < node->numItems; i++ )
+	{
+		tt = &traceTriangles[ node->items[ i ] ];
+		prim = &bvhPrims[ numTraceBVHTriangles++ ];
+		prim->num = node->items[ i ];
+
+		/* bound the triangle as TraceTriangle sees it, grown by the barycentric epsilon */
+		eps = BARY_EPSILON;
+		ClearBounds( prim->mins, prim->maxs );
+		for ( j = 0; j < 3; j++ )
+		{
+			VectorCopy( tt->v[ 0 ].xyz, corner );
+			VectorMA( corner, ( j == 1 ? 1.0f + 2.0f * eps : -eps ), tt->edge1, corner );
+			VectorMA( corner, ( j == 2 ? 1.0f + 2.0f * eps : -eps ), tt->edge2, corner );
+			AddPointToBounds( corner, prim->mins, prim->maxs );
+		}
+
+		/* and a bit more to cover rounding in the slab test */
+		for ( j = 0; j < 3; j++ )
+		{
+			prim->mins[ j ] -= BVH_BOUNDS_EPSILON;
+			prim->maxs[ j ] += BVH_BOUNDS_EPSILON;
+			prim->center[ j ] = 0.5f * ( prim->mins[ j ] + prim->maxs[ j ] );
+		}
+	}
+}
+
+
+
+/*
+   AllocTraceBVHNode()
+   allocates a new bvh node
+ */
+
+static int AllocTraceBVHNode( void ){
+	traceBVHNode_t  *temp;
+
+
+	if ( numTraceBVHNodes >= maxTraceBVHNodes ) {
+		maxTraceBVHNodes += GROW_TRACE_NODES;
+		temp = safe_malloc( maxTraceBVHNodes * sizeof( *traceBVHNodes ) );
+		if ( traceBVHNodes != NULL ) {
+			memcpy( temp, traceBVHNodes, numTraceBVHNodes * sizeof( *traceBVHNodes ) );
+			free( traceBVHNodes );
+		}
+		traceBVHNodes = temp;
+	}
+
+	memset( &traceBVHNodes[ numTraceBVHNodes ], 0, sizeof( *traceBVHNodes ) );
+	numTraceBVHNodes++;
+	return numTraceBVHNodes - 1;
+}
+
+
+
+/*
+   BoundsArea()
+   half the surface area of a box, enough for comparing sah costs
+ */
+
+static float BoundsArea( const vec3_t mins, const vec3_t maxs ){
+	vec3_t size;
+
+
+	VectorSubtract( maxs, mins, size );
+	if ( size[ 0 ] < 0.0f || size[ 1 ] < 0.0f || size[ 2 ] < 0.0f ) {
+		return 0.0f;
+	}
+	return size[ 0 ] * size[ 1 ] + size[ 1 ] * size[ 2 ] + size[ 2 ] * size[ 0 ];
+}
+
+
+
+/*
+   BuildTraceBVH_r()
+   builds a bvh node over a range of prims with a binned surface area heuristic
+ */
+
+static int BuildTraceBVH_r( int first, int count, int depth ){
+	int i, j, nodeNum, axis, bin, bestAxis, bestSplit, numLeft, secondNum;
+	float cost, bestCost, scale;
+	vec3_t mins, maxs, cmins, cmaxs, lmins, lmaxs;
+	int binCounts[ BVH_NUM_BINS ];
+	vec3_t binMins[ BVH_NUM_BINS ], binMaxs[ BVH_NUM_BINS ];
+	float rightArea[ BVH_NUM_BINS ];
+	int rightCount[ BVH_NUM_BINS ];
+	bvhPrim_t       *prim, temp;
+
+
+	/* allocate the node */
+	nodeNum = AllocTraceBVHNode();
+	if ( depth > maxTraceBVHDepth ) {
+		maxTraceBVHDepth = depth;
+	}
+
+	/* bound the prims and their centers */
+	ClearBounds( mins, maxs );
+	ClearBounds( cmins, cmaxs );
+	for ( i = first; i < first + count; i++ )
+	{
+		AddPointToBounds( bvhPrims[ i ].mins, mins, maxs );
+		AddPointToBounds( bvhPrims[ i ].maxs, mins, maxs );
+		AddPointToBounds( bvhPrims[ i ].center, cmins, cmaxs );
+	}
+	VectorCopy( mins, traceBVHNodes[ nodeNum ].mins );
+	VectorCopy( maxs, traceBVHNodes[ nodeNum ].maxs );
+
+	/* find the cheapest split, a leaf costs one test per triangle */
+	bestCost = count * BoundsArea( mins, maxs );
+	bestAxis = -1;
+	bestSplit = 0;
+	if ( count > BVH_MAX_LEAF_TRIANGLES && depth < BVH_MAX_DEPTH ) {
+		for ( axis = 0; axis < 3; axis++ )
+		{
+			if ( cmaxs[ axis ] - cmins[ axis ] <= 0.0f ) {
+				continue;
+			}
+			scale = BVH_NUM_BINS / ( cmaxs[ axis ] - cmins[ axis ] );
+
+			/* bin the prims */
+			for ( bin = 0; bin < BVH_NUM_BINS; bin++ )
+			{
+				binCounts[ bin ] = 0;
+				ClearBounds( binMins[ bin ], binMaxs[ bin ] );
+			}
+			for ( i = first; i < first + count; i++ )
+			{
+				bin = ( bvhPrims[ i ].center[ axis ] - cmins[ axis ] ) * scale;
+				bin = bin < 0 ? 0 : ( bin >= BVH_NUM_BINS ? BVH_NUM_BINS - 1 : bin );
+				binCounts[ bin ]++;
+				AddPointToBounds( bvhPrims[ i ].mins, binMins[ bin ], binMaxs[ bin ] );
+				AddPointToBounds( bvhPrims[ i ].maxs, binMins[ bin ], binMaxs[ bin ] );
+			}
+
+			/* sweep from the right */
+			ClearBounds( lmins, lmaxs );
+			j = 0;
+			for ( bin = BVH_NUM_BINS - 1; bin > 0; bin-- )
+			{
+				j += binCounts[ bin ];
+				if ( binCounts[ bin ] ) {
+					AddPointToBounds( binMins[ bin ], lmins, lmaxs );
+					AddPointToBounds( binMaxs[ bin ], lmins, lmaxs );
+				}
+				rightCount[ bin ] = j;
+				rightArea[ bin ] = BoundsArea( lmins, lmaxs );
+			}
+
+			/* sweep from the left, splitting in front of each bin */
+			ClearBounds( lmins, lmaxs );
+			j = 0;
+			for ( bin = 0; bin < BVH_NUM_BINS - 1; bin++ )
+			{
+				j += binCounts[ bin ];
+				if ( binCounts[ bin ] ) {
+					AddPointToBounds( binMins[ bin ], lmins, lmaxs );
+					AddPointToBounds( binMaxs[ bin ], lmins, lmaxs );
+				}
+				if ( j == 0 || rightCount[ bin + 1 ] == 0 ) {
+					continue;
+				}
+				cost = BoundsArea( mins, maxs ) + j * BoundsArea( lmins, lmaxs ) + rightCount[ bin + 1 ] * rightArea[ bin + 1 ];
+				if ( cost < bestCost ) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = bin + 1;
+				}
+			}
+		}
+	}
+
+	/* partition the prims */
+	numLeft = 0;
+	if ( bestAxis >= 0 ) {
+		scale = BVH_NUM_BINS / ( cmaxs[ bestAxis ] - cmins[ bestAxis ] );
+		for ( i = first; i < first + count; i++ )
+		{
+			prim = &bvhPrims[ i ];
+			bin = ( prim->center[ bestAxis ] - cmins[ bestAxis ] ) * scale;
+			bin = bin < 0 ? 0 : ( bin >= BVH_NUM_BINS ? BVH_NUM_BINS - 1 : bin );
+			if ( bin < bestSplit ) {
+				temp = bvhPrims[ first + numLeft ];
+				bvhPrims[ first + numLeft ] = *prim;
+				*prim = temp;
+				numLeft++;
+			}
+		}
+	}
+
+	/* make a leaf */
+	if ( numLeft <= 0 || numLeft >= count ) {
+		traceBVHNodes[ nodeNum ].offset = first;
+		traceBVHNodes[ nodeNum ].numTriangles = count;
+		return nodeNum;
+	}
+
+	/* first child follows this node, the second one is linked */
+	BuildTraceBVH_r( first, numLeft, depth + 1 );
+	secondNum = BuildTraceBVH_r( first + numLeft, count - numLeft, depth + 1 );
+	traceBVHNodes[ nodeNum ].offset = secondNum;
+	traceBVHNodes[ nodeNum ].numTriangles = 0;
+
+	return nodeNum;
+}
+
+
+
+/*
+   SetupTraceBVH()
+   flattens the traceable triangles into a sah bvh for TraceLine
+ */
+
+static void SetupTraceBVH( void ){
+	int i, j, n;
+	traceTriangle_t *tt;
+
+
+	/* gather the prims */
+	numTraceBVHTriangles = 0;
+	bvhPrims = safe_malloc( ( numTraceTriangles + 1 ) * sizeof( *bvhPrims ) );
+	AddTraceBVHPrims_r( headNodeNum );
+
+	/* build the tree */
+	maxTraceBVHDepth = 0;
+	numTraceBVHNodes = 0;
+	BuildTraceBVH_r( 0, numTraceBVHTriangles, 0 );
+
+	/* store the triangles in leaf order, padded so a leaf can be loaded four wide */
+	n = numTraceBVHTriangles + TRACE_BLOCK_SIZE;
+	traceBVHVerts[ 0 ] = safe_malloc( 9 * n * sizeof( float ) );
+	memset( traceBVHVerts[ 0 ], 0, 9 * n * sizeof( float ) );
+	for ( j = 1; j < 9; j++ )
+		traceBVHVerts[ j ] = traceBVHVerts[ 0 ] + j * n;
+	traceBVHInfos = safe_malloc( n * sizeof( *traceBVHInfos ) );
+	for ( i = 0; i < numTraceBVHTriangles; i++ )
+	{
+		tt = &traceTriangles[ bvhPrims[ i ].num ];
+		for ( j = 0; j < 3; j++ )
+		{
+			traceBVHVerts[ j ][ i ] = tt->v[ 0 ].xyz[ j ];
+			traceBVHVerts[ 3 + j ][ i ] = tt->edge1[ j ];
+			traceBVHVerts[ 6 + j ][ i ] = tt->edge2[ j ];
+		}
+		traceBVHInfos[ i ] = tt->infoNum;
+	}
+	free( bvhPrims );
+	bvhPrims = NULL;
+
+	/* emit some stats */
+	Sys_FPrintf( SYS_VRB, "%9d bvh triangles (%.2fMB)\n", numTraceBVHTriangles, (float) ( n * ( 9 * sizeof( float ) + sizeof( int ) ) ) / ( 1024.0f * 1024.0f ) );
+	Sys_FPrintf( SYS_VRB, "%9d bvh nodes (%.2fMB)\n", numTraceBVHNodes, (float) ( numTraceBVHNodes * sizeof( *traceBVHNodes ) ) / ( 1024.0f * 1024.0f ) );
+	Sys_FPrintf( SYS_VRB, "%9d max bvh depth\n", maxTraceBVHDepth );
+}
+
+
+
+/*
+   SetupTraceBlocks()
+   transposes the triangles of the trace leafs into blocks for the simd triangle test
+ */
+
+static void SetupTraceBlocks( void ){
+	int i, j, k, lane;
+	traceNode_t     *node;
+	traceBlock_t    *block;
+	traceTriangle_t *tt;
+	traceInfo_t     *ti;
+
+
+	/* count the blocks */
+	numTraceBlocks = 0;
+	for ( i = 0; i < numTraceNodes; i++ )
+	{
+		node = &traceNodes[ i ];
+		if ( node->type < 0 && node->numItems > 0 ) {
+			numTraceBlocks += ( node->numItems + TRACE_BLOCK_SIZE - 1 ) / TRACE_BLOCK_SIZE;
+		}
+	}
+	traceBlocks = safe_malloc( ( numTraceBlocks + 1 ) * sizeof( *traceBlocks ) );
+	memset( traceBlocks, 0, ( numTraceBlocks + 1 ) * sizeof( *traceBlocks ) );
+
+	/* fill them, unused lanes stay zero and fail the determinant test */
+	numTraceBlocks = 0;
+	block = NULL;
+	for ( i = 0; i < numTraceNodes; i++ )
+	{
+		node = &traceNodes[ i ];
+		if ( node->type >= 0 || node->numItems <= 0 ) {
+			continue;
+		}
+		node->firstBlock = numTraceBlocks;
+		for ( j = 0; j < node->numItems; j++ )
+		{
+			lane = j % TRACE_BLOCK_SIZE;
+			if ( lane == 0 ) {
+				block = &traceBlocks[ numTraceBlocks++ ];
+			}
+			tt = &traceTriangles[ node->items[ j ] ];
+			ti = &traceInfos[ tt->infoNum ];
+			for ( k = 0; k < 3; k++ )
+			{
+				block->v0[ k ][ lane ] = tt->v[ 0 ].xyz[ k ];
+				block->edge1[ k ][ lane ] = tt->edge1[ k ];
+				block->edge2[ k ][ lane ] = tt->edge2[ k ];
+			}
+			block->triangles[ lane ] = node->items[ j ];
+			block->surfaceNums[ lane ] = ti->surfaceNum;
+			block->numTriangles++;
+
+			/* shadow checks that don't depend on the trace */
+			if ( ti->castShadows == 1 ) {
+				block->worldMask |= ( 1 << lane );
+			}
+			if ( ti->skipGrid ) {
+				block->skipGridMask |= ( 1 << lane );
+			}
+			if ( ti->si->compileFlags & ( C_SKY | C_ALPHASHADOW | C_LIGHTFILTER ) ) {
+				block->filterMask |= ( 1 << lane );
+			}
+		}
+		node->numBlocks = numTraceBlocks - node->firstBlock;
+	}
+
+	/* emit some stats */
+	Sys_FPrintf( SYS_VRB, "%9d trace triangle blocks (%.2fMB)\n", numTraceBlocks, (float) ( numTraceBlocks * sizeof( *traceBlocks ) ) / ( 1024.0f * 1024.0f ) );
+}
+
+
+
+
 /* -------------------------------------------------------------------------------
 
    trace initialization
@@ -1323,6 +1811,11 @@ void SetupTraceNodes( void ){
 	/* create the baseline raytracing tree from the bsp tree */
 	headNodeNum = SetupTraceNodes_r( 0 );
 
+	/* keep the bsp part around for the bvh solid test */
+	if ( traceBVH ) {
+		SetupTraceSolidNodes();
+	}
+
 	/* create outside node for skybox surfaces */
 	skyboxNodeNum = AllocTraceNode();
 
@@ -1349,6 +1842,17 @@ void SetupTraceNodes( void ){
 	Sys_FPrintf( SYS_VRB, "%9d average windings per leaf node\n", numTraceWindings / ( numTraceLeafNodes + 1 ) );
 	Sys_FPrintf( SYS_VRB, "%9d max trace depth\n", maxTraceDepth );
 
+	/* transpose the leaf triangles for the simd triangle test */
+	if ( TRACE_SSE && loMem == qfalse ) {
+		SetupTraceBlocks();
+	}
+
+	/* flatten the triangles into the bvh */
+	if ( traceBVH ) {
+		UpdateTraceSolidNodes();
+		SetupTraceBVH();
+	}
+
 	/* free trace windings */
 	free( traceWindings );
 	numTraceWindings = 0;
@@ -1391,51 +1895,65 @@ void SetupTraceNodes( void ){
 
 
 
-/* -------------------------------------------------------------------------------
-
-   raytracer
-
-   ------------------------------------------------------------------------------- */
-
 /*
-   TraceTriangle()
-   based on code written by william 'spog' joseph
-   based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+   HashTraceGeometry()
+   folds everything the raytracer can hit into a light cache hash:
+   the triangles, what casts shadows and the alphashadow/lightfilter images
  */
 
-#define BARY_EPSILON            0.01f
-#define ASLF_EPSILON            0.0001f /* so to not get double shadows */
-#define COPLANAR_EPSILON        0.25f   //%	0.000001f
-#define NEAR_SHADOW_EPSILON     1.5f    //%	1.25f
-#define SELF_SHADOW_EPSILON     0.5f
-
-qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace ){
+void HashTraceGeometry( unsigned int hash[ 2 ] ){
 	int i;
-	float tvec[ 3 ], pvec[ 3 ], qvec[ 3 ];
-	float det, invDet, depth;
-	float u, v, w, s, t;
-	int is, it;
-	byte            *pixel;
-	float shadow;
-	shaderInfo_t    *si;
+	traceInfo_t     *ti;
+	image_t         *image;
 
 
-	/* don't double-trace against sky */
-	si = ti->si;
-	if ( trace->compileFlags & si->compileFlags & C_SKY ) {
-		return qfalse;
-	}
+	HashBytes( hash, &numTraceTriangles, sizeof( numTraceTriangles ) );
+	HashBytes( hash, traceTriangles, numTraceTriangles * sizeof( *traceTriangles ) );
 
-	/* receive shadows from worldspawn group only */
-	if ( trace->recvShadows == 1 ) {
-		if ( ti->castShadows != 1 ) {
-			return qfalse;
+	HashBytes( hash, &numTraceInfos, sizeof( numTraceInfos ) );
+	for ( i = 0; i < numTraceInfos; i++ )
+	{
+		ti = &traceInfos[ i ];
+		HashBytes( hash, &ti->surfaceNum, sizeof( ti->surfaceNum ) );
+		HashBytes( hash, &ti->castShadows, sizeof( ti->castShadows ) );
+		HashBytes( hash, &ti->skipGrid, sizeof( ti->skipGrid ) );
+		HashBytes( hash, ti->si->shader, strlen( ti->si->shader ) + 1 );
+		HashBytes( hash, &ti->si->compileFlags, sizeof( ti->si->compileFlags ) );
+
+		/* textured shadows */
+		image = ti->si->lightImage;
+		if ( ( ti->si->compileFlags & ( C_ALPHASHADOW | C_LIGHTFILTER ) ) && image != NULL && image->pixels != NULL ) {
+			HashBytes( hash, &image->width, sizeof( image->width ) );
+			HashBytes( hash, &image->height, sizeof( image->height ) );
+			HashBytes( hash, image->pixels, image->width * image->height * 4 );
 		}
 	}
+}
 
-	/* receive shadows from same group and worldspawn group */
-	else if ( trace->recvShadows > 1 ) {
-		if ( ti->castShadows != 1 && abs( ti->castShadows ) != abs( trace->recvShadows ) ) {
+
+
+/* -------------------------------------------------------------------------------
+
+   raytracer
+
+   ------------------------------------------------------------------------------- */
+
+/*
+   TraceInfoCastsShadow()
+   checks the shadow groups of a triangle against the receiving trace
+ */
+
+static qboolean TraceInfoCastsShadow( traceInfo_t *ti, trace_t *trace ){
+	/* receive shadows from worldspawn group only */
+	if ( trace->recvShadows == 1 ) {
+		if ( ti->castShadows != 1 ) {
+			return qfalse;
+		}
+	}
+
+	/* receive shadows from same group and worldspawn group */
+	else if ( trace->recvShadows > 1 ) {
+		if ( ti->castShadows != 1 && abs( ti->castShadows ) != abs( trace->recvShadows ) ) {
 			return qfalse;
 		}
 		//%	Sys_Printf( "%d:%d ", tt->castShadows, trace->recvShadows );
@@ -1456,6 +1974,39 @@ qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace ){
 		}
 	}
 
+	return qtrue;
+}
+
+
+
+/*
+   TraceTriangle()
+   based on code written by william 'spog' joseph
+   based on code originally written by tomas moller and ben trumbore, journal of graphics tools, 2(1):21-28, 1997
+ */
+
+qboolean TraceTriangle( traceInfo_t *ti, traceTriangle_t *tt, trace_t *trace ){
+	int i;
+	float tvec[ 3 ], pvec[ 3 ], qvec[ 3 ];
+	float det, invDet, depth;
+	float u, v, w, s, t;
+	int is, it;
+	byte            *pixel;
+	float shadow;
+	shaderInfo_t    *si;
+
+
+	/* don't double-trace against sky */
+	si = ti->si;
+	if ( trace->compileFlags & si->compileFlags & C_SKY ) {
+		return qfalse;
+	}
+
+	/* shadow groups */
+	if ( !TraceInfoCastsShadow( ti, trace ) ) {
+		return qfalse;
+	}
+
 	/* begin calculating determinant - also used to calculate u parameter */
 	CrossProduct( trace->direction, tt->edge2, pvec );
 
@@ -1729,17 +2280,628 @@ static qboolean TraceLine_r( int nodeNum, vec3_t origin, vec3_t end, trace_t *tr
 
 
 /*
-   TraceLine() - ydnar
-   rewrote this function a bit :)
+   TraceSolid_r()
+   walks the bsp part of the trace tree exactly like TraceLine_r, but only looks for solid leafs
  */
 
-void TraceLine( trace_t *trace ){
-	int i, j;
-	traceNode_t     *node;
-	traceTriangle_t *tt;
+static qboolean TraceSolid_r( int nodeNum, vec3_t origin, vec3_t end, trace_t *trace ){
+	traceSolidNode_t    *node;
+	int side;
+	float front, back, frac;
+	vec3_t mid;
+
+
+	/* get node */
+	node = &traceSolidNodes[ nodeNum ];
+
+	/* solid? */
+	if ( node->type == TRACE_LEAF_SOLID ) {
+		VectorCopy( origin, trace->hit );
+		trace->passSolid = qtrue;
+		return qtrue;
+	}
+
+	/* leafnode? */
+	if ( node->type < 0 ) {
+		return qfalse;
+	}
+
+	/* classify beginning and end points */
+	switch ( node->type )
+	{
+	case PLANE_X:
+		front = origin[ 0 ] - node->plane[ 3 ];
+		back = end[ 0 ] - node->plane[ 3 ];
+		break;
+
+	case PLANE_Y:
+		front = origin[ 1 ] - node->plane[ 3 ];
+		back = end[ 1 ] - node->plane[ 3 ];
+		break;
+
+	case PLANE_Z:
+		front = origin[ 2 ] - node->plane[ 3 ];
+		back = end[ 2 ] - node->plane[ 3 ];
+		break;
+
+	default:
+		front = DotProduct( origin, node->plane ) - node->plane[ 3 ];
+		back = DotProduct( end, node->plane ) - node->plane[ 3 ];
+		break;
+	}
+
+	/* entirely in front side? */
+	if ( front >= -TRACE_ON_EPSILON && back >= -TRACE_ON_EPSILON ) {
+		return TraceSolid_r( node->children[ 0 ], origin, end, trace );
+	}
+
+	/* entirely on back side? */
+	if ( front < TRACE_ON_EPSILON && back < TRACE_ON_EPSILON ) {
+		return TraceSolid_r( node->children[ 1 ], origin, end, trace );
+	}
+
+	/* select side */
+	side = front < 0;
+
+	/* calculate intercept point */
+	frac = front / ( front - back );
+	mid[ 0 ] = origin[ 0 ] + ( end[ 0 ] - origin[ 0 ] ) * frac;
+	mid[ 1 ] = origin[ 1 ] + ( end[ 1 ] - origin[ 1 ] ) * frac;
+	mid[ 2 ] = origin[ 2 ] + ( end[ 2 ] - origin[ 2 ] ) * frac;
+
+	/* trace both sides */
+	if ( TraceSolid_r( node->children[ side ], origin, mid, trace ) ) {
+		return qtrue;
+	}
+	return TraceSolid_r( node->children[ !side ], mid, end, trace );
+}
+
+
+
+/*
+   TraceBVHTriangleCasts()
+   the non-geometric checks TraceTriangle does on a triangle hit at depth
+ */
+
+static qboolean TraceBVHTriangleCasts( int num, float depth, trace_t *trace ){
+	int i;
 	traceInfo_t     *ti;
 
 
+	/* shadow groups */
+	ti = &traceInfos[ traceBVHInfos[ num ] ];
+	if ( !TraceInfoCastsShadow( ti, trace ) ) {
+		return qfalse;
+	}
+
+	/* don't self-shadow */
+	if ( depth <= SELF_SHADOW_EPSILON ) {
+		for ( i = 0; i < trace->numSurfaces; i++ )
+		{
+			if ( ti->surfaceNum == trace->surfaces[ i ] ) {
+				return qfalse;
+			}
+		}
+	}
+
+	return qtrue;
+}
+
+
+
+#if TRACE_SSE
+
+/*
+   TraceTriangle4()
+   the geometric part of TraceTriangle() on four lanes of triangles and traces, lane for lane
+   the same operations so the results are identical. the rejects are written like the scalar
+   ones to treat nans alike. returns the lanes that hit and their depths
+ */
+
+static int TraceTriangle4( __m128 v0[ 3 ], __m128 edge1[ 3 ], __m128 edge2[ 3 ], __m128 o[ 3 ], __m128 d[ 3 ], __m128 inhibitRadius, __m128 distance, __m128 *depth ){
+	__m128 tvec[ 3 ], pvec[ 3 ], qvec[ 3 ];
+	__m128 det, invDet, u, v, reject;
+	const float baryMax = ( 1.0f + BARY_EPSILON );
+	int i;
+
+
+	/* CrossProduct( direction, edge2, pvec ), det = DotProduct( edge1, pvec ) */
+	pvec[ 0 ] = _mm_sub_ps( _mm_mul_ps( d[ 1 ], edge2[ 2 ] ), _mm_mul_ps( d[ 2 ], edge2[ 1 ] ) );
+	pvec[ 1 ] = _mm_sub_ps( _mm_mul_ps( d[ 2 ], edge2[ 0 ] ), _mm_mul_ps( d[ 0 ], edge2[ 2 ] ) );
+	pvec[ 2 ] = _mm_sub_ps( _mm_mul_ps( d[ 0 ], edge2[ 1 ] ), _mm_mul_ps( d[ 1 ], edge2[ 0 ] ) );
+	det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( edge1[ 0 ], pvec[ 0 ] ), _mm_mul_ps( edge1[ 1 ], pvec[ 1 ] ) ), _mm_mul_ps( edge1[ 2 ], pvec[ 2 ] ) );
+	reject = _mm_cmplt_ps( _mm_andnot_ps( _mm_set1_ps( -0.0f ), det ), _mm_set1_ps( COPLANAR_EPSILON ) );
+	if ( _mm_movemask_ps( reject ) == 0xF ) {
+		return 0;
+	}
+	invDet = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+	/* u */
+	for ( i = 0; i < 3; i++ )
+		tvec[ i ] = _mm_sub_ps( o[ i ], v0[ i ] );
+	u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( tvec[ 0 ], pvec[ 0 ] ), _mm_mul_ps( tvec[ 1 ], pvec[ 1 ] ) ), _mm_mul_ps( tvec[ 2 ], pvec[ 2 ] ) ), invDet );
+	reject = _mm_or_ps( reject, _mm_cmplt_ps( u, _mm_set1_ps( -BARY_EPSILON ) ) );
+	reject = _mm_or_ps( reject, _mm_cmpgt_ps( u, _mm_set1_ps( baryMax ) ) );
+	if ( _mm_movemask_ps( reject ) == 0xF ) {
+		return 0;
+	}
+
+	/* CrossProduct( tvec, edge1, qvec ), v */
+	qvec[ 0 ] = _mm_sub_ps( _mm_mul_ps( tvec[ 1 ], edge1[ 2 ] ), _mm_mul_ps( tvec[ 2 ], edge1[ 1 ] ) );
+	qvec[ 1 ] = _mm_sub_ps( _mm_mul_ps( tvec[ 2 ], edge1[ 0 ] ), _mm_mul_ps( tvec[ 0 ], edge1[ 2 ] ) );
+	qvec[ 2 ] = _mm_sub_ps( _mm_mul_ps( tvec[ 0 ], edge1[ 1 ] ), _mm_mul_ps( tvec[ 1 ], edge1[ 0 ] ) );
+	v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( d[ 0 ], qvec[ 0 ] ), _mm_mul_ps( d[ 1 ], qvec[ 1 ] ) ), _mm_mul_ps( d[ 2 ], qvec[ 2 ] ) ), invDet );
+	reject = _mm_or_ps( reject, _mm_cmplt_ps( v, _mm_set1_ps( -BARY_EPSILON ) ) );
+	reject = _mm_or_ps( reject, _mm_cmpgt_ps( _mm_add_ps( u, v ), _mm_set1_ps( baryMax ) ) );
+	if ( _mm_movemask_ps( reject ) == 0xF ) {
+		return 0;
+	}
+
+	/* depth */
+	*depth = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( edge2[ 0 ], qvec[ 0 ] ), _mm_mul_ps( edge2[ 1 ], qvec[ 1 ] ) ), _mm_mul_ps( edge2[ 2 ], qvec[ 2 ] ) ), invDet );
+	reject = _mm_or_ps( reject, _mm_cmple_ps( *depth, inhibitRadius ) );
+	reject = _mm_or_ps( reject, _mm_cmpge_ps( *depth, distance ) );
+	return ~_mm_movemask_ps( reject ) & 0xF;
+}
+
+
+
+/*
+   TraceBVHLeaf4()
+   TraceBVHTriangle() on the triangles of a bvh leaf, four at a time
+ */
+
+static qboolean TraceBVHLeaf4( const traceBVHNode_t *node, trace_t *trace, __m128 o[ 3 ], __m128 d[ 3 ], __m128 inhibitRadius, __m128 distance ){
+	int i, j, num, hit;
+	float depths[ 4 ];
+	__m128 v0[ 3 ], edge1[ 3 ], edge2[ 3 ], depth;
+
+
+	for ( num = node->offset; num < node->offset + node->numTriangles; num += 4 )
+	{
+		/* the triangle arrays are padded for the last leaf */
+		for ( i = 0; i < 3; i++ )
+		{
+			v0[ i ] = _mm_loadu_ps( traceBVHVerts[ i ] + num );
+			edge1[ i ] = _mm_loadu_ps( traceBVHVerts[ 3 + i ] + num );
+			edge2[ i ] = _mm_loadu_ps( traceBVHVerts[ 6 + i ] + num );
+		}
+		hit = TraceTriangle4( v0, edge1, edge2, o, d, inhibitRadius, distance, &depth );
+		if ( node->offset + node->numTriangles - num < 4 ) {
+			hit &= ( 1 << ( node->offset + node->numTriangles - num ) ) - 1;
+		}
+		if ( !hit ) {
+			continue;
+		}
+
+		/* shadow groups and self shadowing */
+		_mm_storeu_ps( depths, depth );
+		for ( j = 0; j < 4; j++ )
+		{
+			if ( ( hit & ( 1 << j ) ) && TraceBVHTriangleCasts( num + j, depths[ j ], trace ) ) {
+				return qtrue;
+			}
+		}
+	}
+
+	return qfalse;
+}
+
+#else
+
+/*
+   TraceBVHTriangle()
+   the geometric and shadow group part of TraceTriangle on a bvh triangle,
+   returns qtrue if TraceTriangle could do anything with it
+ */
+
+static qboolean TraceBVHTriangle( int num, trace_t *trace ){
+	int i;
+	vec3_t v0, edge1, edge2, tvec, pvec, qvec;
+	float det, invDet, u, v, depth;
+
+
+	/* gather the triangle */
+	for ( i = 0; i < 3; i++ )
+	{
+		v0[ i ] = traceBVHVerts[ i ][ num ];
+		edge1[ i ] = traceBVHVerts[ 3 + i ][ num ];
+		edge2[ i ] = traceBVHVerts[ 6 + i ][ num ];
+	}
+
+	/* same math as TraceTriangle, so the result is bit for bit identical */
+	CrossProduct( trace->direction, edge2, pvec );
+	det = DotProduct( edge1, pvec );
+	if ( fabs( det ) < COPLANAR_EPSILON ) {
+		return qfalse;
+	}
+	invDet = 1.0f / det;
+	VectorSubtract( trace->origin, v0, tvec );
+	u = DotProduct( tvec, pvec ) * invDet;
+	if ( u < -BARY_EPSILON || u > ( 1.0f + BARY_EPSILON ) ) {
+		return qfalse;
+	}
+	CrossProduct( tvec, edge1, qvec );
+	v = DotProduct( trace->direction, qvec ) * invDet;
+	if ( v < -BARY_EPSILON || ( u + v ) > ( 1.0f + BARY_EPSILON ) ) {
+		return qfalse;
+	}
+	depth = DotProduct( edge2, qvec ) * invDet;
+	if ( depth <= trace->inhibitRadius || depth >= trace->distance ) {
+		return qfalse;
+	}
+
+	/* shadow groups and self shadowing */
+	return TraceBVHTriangleCasts( num, depth, trace );
+}
+
+#endif
+
+
+
+/*
+   TraceBVHBounds()
+   slab test of the trace segment against a bvh node, returns the entry distance or -1 on a miss
+ */
+
+static float TraceBVHBounds( const traceBVHNode_t *node, const vec3_t origin, const vec3_t invDir, float distance ){
+	int i;
+	float t1, t2, tmin, tmax;
+
+
+	tmin = 0.0f;
+	tmax = distance;
+	for ( i = 0; i < 3; i++ )
+	{
+		t1 = ( node->mins[ i ] - origin[ i ] ) * invDir[ i ];
+		t2 = ( node->maxs[ i ] - origin[ i ] ) * invDir[ i ];
+		if ( t1 > t2 ) {
+			tmin = t2 > tmin ? t2 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+		}
+		else
+		{
+			tmin = t1 > tmin ? t1 : tmin;
+			tmax = t2 < tmax ? t2 : tmax;
+		}
+	}
+	return tmin <= tmax ? tmin : -1.0f;
+}
+
+
+
+/*
+   TraceLineSolid()
+   tests the trace against the solid leafs of the bsp, returns qtrue if that settles it
+ */
+
+static qboolean TraceLineSolid( trace_t *trace ){
+	/* solid leafs are opaque */
+	TraceSolid_r( headNodeNum, trace->origin, trace->end, trace );
+	if ( trace->passSolid ) {
+		trace->opaque = qtrue;
+		return qtrue;
+	}
+
+	/* skip surfaces? */
+	if ( noSurfaces || numTraceBVHTriangles <= 0 ) {
+		return qtrue;
+	}
+	return qfalse;
+}
+
+
+
+/*
+   TraceBVH()
+   returns qtrue if any triangle in the bvh could affect the trace. if not, the trace
+   is done, otherwise it has to be replayed through the trace tree, as the order of
+   hits matters for filters, compile flags and the hit point
+ */
+
+static qboolean TraceBVH( trace_t *trace ){
+	int i, nodeNum, firstNum, secondNum, stackSize, stack[ BVH_MAX_DEPTH + 2 ];
+	float firstDist, secondDist;
+	vec3_t invDir;
+	traceBVHNode_t  *node;
+	#if TRACE_SSE
+	__m128 o[ 3 ], d[ 3 ], inhibitRadius, distance;
+	#endif
+
+
+	/* a huge inverse keeps axis parallel traces from producing nans in the slab test */
+	for ( i = 0; i < 3; i++ )
+		invDir[ i ] = 1.0f / ( fabs( trace->direction[ i ] ) > 1e-20f ? trace->direction[ i ] : 1e-20f );
+
+	/* the leafs are tested four triangles at a time */
+	#if TRACE_SSE
+	for ( i = 0; i < 3; i++ )
+	{
+		o[ i ] = _mm_set1_ps( trace->origin[ i ] );
+		d[ i ] = _mm_set1_ps( trace->direction[ i ] );
+	}
+	inhibitRadius = _mm_set1_ps( trace->inhibitRadius );
+	distance = _mm_set1_ps( trace->distance );
+	#endif
+
+	/* walk the bvh nearest child first */
+	if ( TraceBVHBounds( &traceBVHNodes[ 0 ], trace->origin, invDir, trace->distance ) < 0.0f ) {
+		return qfalse;
+	}
+	stackSize = 0;
+	nodeNum = 0;
+	while ( 1 )
+	{
+		node = &traceBVHNodes[ nodeNum ];
+
+		/* leaf */
+		if ( node->numTriangles > 0 ) {
+			#if TRACE_SSE
+			if ( TraceBVHLeaf4( node, trace, o, d, inhibitRadius, distance ) ) {
+				return qtrue;
+			}
+			#else
+			for ( i = node->offset; i < node->offset + node->numTriangles; i++ )
+			{
+				if ( TraceBVHTriangle( i, trace ) ) {
+					return qtrue;
+				}
+			}
+			#endif
+		}
+
+		/* interior node, the first child follows it */
+		else
+		{
+			firstNum = nodeNum + 1;
+			secondNum = node->offset;
+			firstDist = TraceBVHBounds( &traceBVHNodes[ firstNum ], trace->origin, invDir, trace->distance );
+			secondDist = TraceBVHBounds( &traceBVHNodes[ secondNum ], trace->origin, invDir, trace->distance );
+			if ( firstDist >= 0.0f && secondDist >= 0.0f ) {
+				if ( secondDist < firstDist ) {
+					i = firstNum;
+					firstNum = secondNum;
+					secondNum = i;
+				}
+				stack[ stackSize++ ] = secondNum;
+				nodeNum = firstNum;
+				continue;
+			}
+			if ( firstDist >= 0.0f ) {
+				nodeNum = firstNum;
+				continue;
+			}
+			if ( secondDist >= 0.0f ) {
+				nodeNum = secondNum;
+				continue;
+			}
+		}
+
+		/* pop */
+		if ( stackSize <= 0 ) {
+			break;
+		}
+		nodeNum = stack[ --stackSize ];
+	}
+
+	/* nothing in the way */
+	return qfalse;
+}
+
+
+
+#if TRACE_SSE
+
+/*
+   TraceBVHBounds4()
+   slab test of four traces against one node, returns the lanes that hit and their entry distances
+ */
+
+static int TraceBVHBounds4( const traceBVHNode_t *node, __m128 o[ 3 ], __m128 invDir[ 3 ], __m128 distance, __m128 *entry ){
+	int i;
+	__m128 t1, t2, tmin, tmax;
+
+
+	tmin = _mm_setzero_ps();
+	tmax = distance;
+	for ( i = 0; i < 3; i++ )
+	{
+		t1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node->mins[ i ] ), o[ i ] ), invDir[ i ] );
+		t2 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( node->maxs[ i ] ), o[ i ] ), invDir[ i ] );
+		tmin = _mm_max_ps( tmin, _mm_min_ps( t1, t2 ) );
+		tmax = _mm_min_ps( tmax, _mm_max_ps( t1, t2 ) );
+	}
+	*entry = tmin;
+	return _mm_movemask_ps( _mm_cmple_ps( tmin, tmax ) );
+}
+
+
+
+/*
+   TraceBVHTriangle4()
+   one bvh triangle against four traces
+ */
+
+static int TraceBVHTriangle4( int num, __m128 o[ 3 ], __m128 d[ 3 ], __m128 inhibitRadius, __m128 distance, __m128 *depth ){
+	__m128 v0[ 3 ], edge1[ 3 ], edge2[ 3 ];
+	int i;
+
+
+	for ( i = 0; i < 3; i++ )
+	{
+		v0[ i ] = _mm_set1_ps( traceBVHVerts[ i ][ num ] );
+		edge1[ i ] = _mm_set1_ps( traceBVHVerts[ 3 + i ][ num ] );
+		edge2[ i ] = _mm_set1_ps( traceBVHVerts[ 6 + i ][ num ] );
+	}
+	return TraceTriangle4( v0, edge1, edge2, o, d, inhibitRadius, distance, depth );
+}
+
+
+
+/*
+   TraceBVHPacket()
+   TraceBVH() for up to TRACE_PACKET_SIZE traces at once, returns a bit for each trace
+   that has to be replayed through the trace tree
+ */
+
+static int TraceBVHPacket( trace_t **rays, int numRays ){
+	int i, j, nodeNum, stackSize, firstNum, secondNum, firstMask, secondMask, mask, alive, hit, hits;
+	int stack[ BVH_MAX_DEPTH + 2 ], stackMask[ BVH_MAX_DEPTH + 2 ];
+	float firstEntry[ 4 ], secondEntry[ 4 ], depths[ 4 ], firstMin, secondMin;
+	__m128 o[ 3 ], d[ 3 ], invDir[ 3 ], inhibitRadius, distance, entry, depth;
+	traceBVHNode_t  *node;
+	trace_t         *trace;
+
+
+	/* transpose the traces, unused lanes repeat the first one */
+	for ( j = 0; j < 3; j++ )
+	{
+		for ( i = 0; i < 4; i++ )
+		{
+			trace = rays[ i < numRays ? i : 0 ];
+			firstEntry[ i ] = trace->origin[ j ];
+			secondEntry[ i ] = trace->direction[ j ];
+			depths[ i ] = 1.0f / ( fabs( trace->direction[ j ] ) > 1e-20f ? trace->direction[ j ] : 1e-20f );
+		}
+		o[ j ] = _mm_loadu_ps( firstEntry );
+		d[ j ] = _mm_loadu_ps( secondEntry );
+		invDir[ j ] = _mm_loadu_ps( depths );
+	}
+	for ( i = 0; i < 4; i++ )
+	{
+		trace = rays[ i < numRays ? i : 0 ];
+		firstEntry[ i ] = trace->inhibitRadius;
+		secondEntry[ i ] = trace->distance;
+	}
+	inhibitRadius = _mm_loadu_ps( firstEntry );
+	distance = _mm_loadu_ps( secondEntry );
+
+	/* walk the bvh, nearest child first */
+	alive = ( 1 << numRays ) - 1;
+	hits = 0;
+	mask = TraceBVHBounds4( &traceBVHNodes[ 0 ], o, invDir, distance, &entry ) & alive;
+	nodeNum = 0;
+	stackSize = 0;
+	while ( 1 )
+	{
+		mask &= alive;
+		node = &traceBVHNodes[ nodeNum ];
+
+		/* leaf */
+		if ( mask && node->numTriangles > 0 ) {
+			for ( i = node->offset; i < node->offset + node->numTriangles && mask; i++ )
+			{
+				hit = TraceBVHTriangle4( i, o, d, inhibitRadius, distance, &depth ) & mask;
+				if ( !hit ) {
+					continue;
+				}
+
+				/* shadow groups and self shadowing per trace */
+				_mm_storeu_ps( depths, depth );
+				for ( j = 0; j < 4; j++ )
+				{
+					if ( ( hit & ( 1 << j ) ) && TraceBVHTriangleCasts( i, depths[ j ], rays[ j ] ) ) {
+						hits |= ( 1 << j );
+						alive &= ~( 1 << j );
+						mask &= ~( 1 << j );
+					}
+				}
+			}
+			if ( !alive ) {
+				break;
+			}
+		}
+
+		/* interior node, the first child follows it */
+		else if ( mask ) {
+			firstNum = nodeNum + 1;
+			secondNum = node->offset;
+			firstMask = TraceBVHBounds4( &traceBVHNodes[ firstNum ], o, invDir, distance, &entry ) & mask;
+			_mm_storeu_ps( firstEntry, entry );
+			secondMask = TraceBVHBounds4( &traceBVHNodes[ secondNum ], o, invDir, distance, &entry ) & mask;
+			_mm_storeu_ps( secondEntry, entry );
+			if ( firstMask && secondMask ) {
+				firstMin = secondMin = 1e30f;
+				for ( i = 0; i < 4; i++ )
+				{
+					if ( firstMask & ( 1 << i ) && firstEntry[ i ] < firstMin ) {
+						firstMin = firstEntry[ i ];
+					}
+					if ( secondMask & ( 1 << i ) && secondEntry[ i ] < secondMin ) {
+						secondMin = secondEntry[ i ];
+					}
+				}
+				if ( secondMin < firstMin ) {
+					stack[ stackSize ] = firstNum;
+					stackMask[ stackSize++ ] = firstMask;
+					nodeNum = secondNum;
+					mask = secondMask;
+				}
+				else
+				{
+					stack[ stackSize ] = secondNum;
+					stackMask[ stackSize++ ] = secondMask;
+					nodeNum = firstNum;
+					mask = firstMask;
+				}
+				continue;
+			}
+			if ( firstMask ) {
+				nodeNum = firstNum;
+				mask = firstMask;
+				continue;
+			}
+			if ( secondMask ) {
+				nodeNum = secondNum;
+				mask = secondMask;
+				continue;
+			}
+		}
+
+		/* pop */
+		if ( stackSize <= 0 ) {
+			break;
+		}
+		stackSize--;
+		nodeNum = stack[ stackSize ];
+		mask = stackMask[ stackSize ];
+	}
+
+	return hits;
+}
+
+#else
+
+/*
+   TraceBVHPacket()
+   TraceBVH() for up to TRACE_PACKET_SIZE traces at once, returns a bit for each trace
+   that has to be replayed through the trace tree
+ */
+
+static int TraceBVHPacket( trace_t **rays, int numRays ){
+	int i, hits;
+
+
+	hits = 0;
+	for ( i = 0; i < numRays; i++ )
+	{
+		if ( TraceBVH( rays[ i ] ) ) {
+			hits |= ( 1 << i );
+		}
+	}
+	return hits;
+}
+
+#endif
+
+
+
+/*
+   TraceLineStart()
+   resets the trace output, returns qfalse if there is nothing to trace
+ */
+
+static qboolean TraceLineStart( trace_t *trace ){
 	/* setup output (note: this code assumes the input data is completely filled out) */
 	trace->passSolid = qfalse;
 	trace->opaque = qfalse;
@@ -1748,8 +2910,124 @@ void TraceLine( trace_t *trace ){
 
 	/* early outs */
 	if ( !trace->recvShadows || !trace->testOcclusion || trace->distance <= 0.00001f ) {
-		return;
+		return qfalse;
 	}
+	return qtrue;
+}
+
+
+
+#if TRACE_SSE
+
+/*
+   TraceBlockCastMask()
+   the lanes of a triangle block that cast shadows onto the trace
+ */
+
+static int TraceBlockCastMask( const traceBlock_t *block, trace_t *trace ){
+	int i, mask;
+
+
+	/* most traces only receive worldspawn shadows */
+	if ( trace->recvShadows == 1 ) {
+		mask = block->worldMask;
+		if ( inGrid ) {
+			mask &= ~block->skipGridMask;
+		}
+		return mask;
+	}
+
+	/* shadow groups */
+	mask = 0;
+	for ( i = 0; i < block->numTriangles; i++ )
+	{
+		if ( TraceInfoCastsShadow( &traceInfos[ traceTriangles[ block->triangles[ i ] ].infoNum ], trace ) ) {
+			mask |= ( 1 << i );
+		}
+	}
+	return mask;
+}
+
+
+
+/*
+   TraceNodeBlocks()
+   tests the triangles of a leaf a block at a time. lanes that are hit, and the ones that
+   need a texture lookup, go to TraceTriangle() in order, so the result stays the same
+ */
+
+static qboolean TraceNodeBlocks( traceNode_t *node, trace_t *trace, __m128 o[ 3 ], __m128 d[ 3 ], __m128 inhibitRadius, __m128 distance ){
+	int i, j, k, hit;
+	float depths[ 4 ];
+	__m128 v0[ 3 ], edge1[ 3 ], edge2[ 3 ], depth;
+	traceBlock_t    *block;
+	traceTriangle_t *tt;
+
+
+	for ( i = 0; i < node->numBlocks; i++ )
+	{
+		block = &traceBlocks[ node->firstBlock + i ];
+		for ( j = 0; j < 3; j++ )
+		{
+			v0[ j ] = _mm_loadu_ps( block->v0[ j ] );
+			edge1[ j ] = _mm_loadu_ps( block->edge1[ j ] );
+			edge2[ j ] = _mm_loadu_ps( block->edge2[ j ] );
+		}
+		hit = TraceTriangle4( v0, edge1, edge2, o, d, inhibitRadius, distance, &depth );
+
+		/* shadow groups and self shadowing */
+		if ( hit ) {
+			hit &= TraceBlockCastMask( block, trace );
+			_mm_storeu_ps( depths, depth );
+			for ( j = 0; j < block->numTriangles; j++ )
+			{
+				if ( !( hit & ( 1 << j ) ) || depths[ j ] > SELF_SHADOW_EPSILON ) {
+					continue;
+				}
+				for ( k = 0; k < trace->numSurfaces; k++ )
+				{
+					if ( block->surfaceNums[ j ] == trace->surfaces[ k ] ) {
+						hit &= ~( 1 << j );
+						break;
+					}
+				}
+			}
+		}
+
+		/* walk the lanes in item order */
+		hit |= block->filterMask;
+		for ( j = 0; hit && j < block->numTriangles; j++ )
+		{
+			if ( hit & ( 1 << j ) ) {
+				tt = &traceTriangles[ block->triangles[ j ] ];
+				if ( TraceTriangle( &traceInfos[ tt->infoNum ], tt, trace ) ) {
+					return qtrue;
+				}
+			}
+		}
+	}
+
+	return qfalse;
+}
+
+#endif
+
+
+
+/*
+   TraceLineNodes()
+   traces through the trace tree and tests the triangles in the leafs passed
+ */
+
+static void TraceLineNodes( trace_t *trace ){
+	int i, j;
+	traceNode_t     *node;
+	traceTriangle_t *tt;
+	traceInfo_t     *ti;
+	#if TRACE_SSE
+	__m128 o[ 3 ], d[ 3 ], inhibitRadius, distance;
+	#endif
+
 
 	/* trace through nodes */
 	TraceLine_r( headNodeNum, trace->origin, trace->end, trace );
@@ -1771,11 +3049,30 @@ void TraceLine( trace_t *trace ){
 		TraceLine_r( skyboxNodeNum, trace->origin, trace->end, trace );
 	}
 
+	/* the leaf triangles are tested a block at a time */
+	#if TRACE_SSE
+	for ( i = 0; i < 3; i++ )
+	{
+		o[ i ] = _mm_set1_ps( trace->origin[ i ] );
+		d[ i ] = _mm_set1_ps( trace->direction[ i ] );
+	}
+	inhibitRadius = _mm_set1_ps( trace->inhibitRadius );
+	distance = _mm_set1_ps( trace->distance );
+	#endif
+
 	/* walk node list */
 	for ( i = 0; i < trace->numTestNodes; i++ )
 	{
 		/* get node */
 		node = &traceNodes[ trace->testNodes[ i ] ];
+		#if TRACE_SSE
+		if ( node->numBlocks > 0 ) {
+			if ( TraceNodeBlocks( node, trace, o, d, inhibitRadius, distance ) ) {
+				return;
+			}
+			continue;
+		}
+		#endif
 
 		/* walk node item list */
 		for ( j = 0; j < node->numItems; j++ )
@@ -1793,6 +3090,105 @@ void TraceLine( trace_t *trace ){
 
 
 
+/*
+   TraceLine() - ydnar
+   rewrote this function a bit :)
+ */
+
+void TraceLine( trace_t *trace ){
+	/* setup output */
+	if ( !TraceLineStart( trace ) ) {
+		return;
+	}
+
+	/* try the bvh first, testall traces need the full list of leafs */
+	if ( traceBVH && !trace->testAll ) {
+		if ( TraceLineSolid( trace ) || !TraceBVH( trace ) ) {
+			return;
+		}
+	}
+
+	/* trace through the tree */
+	TraceLineNodes( trace );
+}
+
+
+
+/*
+   TracePacketNodes()
+   runs a packet through the bvh, then replays the traces that hit something through the tree
+ */
+
+static void TracePacketNodes( trace_t **rays, int numRays ){
+	int i, hits;
+
+
+	if ( numRays <= 0 ) {
+		return;
+	}
+	hits = TraceBVHPacket( rays, numRays );
+	for ( i = 0; i < numRays; i++ )
+	{
+		if ( hits & ( 1 << i ) ) {
+			TraceLineNodes( rays[ i ] );
+		}
+	}
+}
+
+
+
+/*
+   TraceLinePacket()
+   traces a batch of coherent traces, sharing the bvh walk between packets of them.
+   results are the same as calling TraceLine() on each
+ */
+
+void TraceLinePacket( trace_t **traces, int numTraces ){
+	int i, numRays;
+	trace_t         *trace, *rays[ TRACE_PACKET_SIZE ];
+
+
+	/* nothing to share without the bvh */
+	if ( !traceBVH ) {
+		for ( i = 0; i < numTraces; i++ )
+			TraceLine( traces[ i ] );
+		return;
+	}
+
+	numRays = 0;
+	for ( i = 0; i < numTraces; i++ )
+	{
+		/* setup output */
+		trace = traces[ i ];
+		if ( !TraceLineStart( trace ) ) {
+			continue;
+		}
+
+		/* testall traces need the full list of leafs */
+		if ( trace->testAll ) {
+			TraceLineNodes( trace );
+			continue;
+		}
+
+		/* solid leafs are cheap per trace */
+		if ( TraceLineSolid( trace ) ) {
+			continue;
+		}
+
+		/* gather a packet */
+		rays[ numRays++ ] = trace;
+		if ( numRays == TRACE_PACKET_SIZE ) {
+			TracePacketNodes( rays, numRays );
+			numRays = 0;
+		}
+	}
+
+	/* the last traces may have been settled early */
+	TracePacketNodes( rays, numRays );
+}
+
+
+
 /*
    SetupTrace() - ydnar
    sets up certain trace values
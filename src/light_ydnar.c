@@ -2071,12 +2071,60 @@ static void RandomSubsampleRawLuxel( rawLightmap_t *lm, trace_t *trace, vec3_t s
 
 
 
+/*
+   RawLightmapTwoSided()
+   twosided lighting (may or may not be a good idea for lightmapped stuff)
+ */
+
+static qboolean RawLightmapTwoSided( rawLightmap_t *lm ){
+	int i;
+
+	for ( i = 0; i < lm->numLightSurfaces; i++ )
+	{
+		if ( surfaceInfos[ lightSurfaces[ lm->firstLightSurface + i ] ].si->twoSided ) {
+			return qtrue;
+		}
+	}
+	return qfalse;
+}
+
+
+
+/*
+   StoreLightContribution()
+   stores the light a trace found for a luxel, returns 1 if the luxel is lit
+ */
+
+static int StoreLightContribution( trace_t *trace, float *lightLuxel, float *lightDeluxel, unsigned char *flag, qboolean subsample ){
+	/* set contribution count */
+	lightLuxel[ 3 ] = 1.0f;
+	VectorCopy( trace->color, lightLuxel );
+
+	/* add the contribution to the deluxemap */
+	if ( deluxemap ) {
+		VectorCopy( trace->directionContribution, lightDeluxel );
+	}
+
+	/* check for evilness */
+	if ( trace->forceSubsampling > 1.0f && subsample ) {
+		*flag |= FLAG_FORCE_SUBSAMPLING; /* force */
+		return 1;
+	}
+
+	/* add to count */
+	if ( trace->color[ 0 ] || trace->color[ 1 ] || trace->color[ 2 ] ) {
+		return 1;
+	}
+	return 0;
+}
+
+
+
 /*
    IlluminateRawLightmap()
    illuminates the luxels
  */
 
-#define STACK_LL_SIZE           ( SUPER_LUXEL_SIZE * 64 * 64 )
 #define LIGHT_LUXEL( x, y )     ( lightLuxels + ( ( ( ( y ) * lm->sw ) + ( x ) ) * SUPER_LUXEL_SIZE ) )
 #define LIGHT_DELUXEL( x, y )       ( lightDeluxels + ( ( ( ( y ) * lm->sw ) + ( x ) ) * SUPER_DELUXEL_SIZE ) )
 
@@ -2085,7 +2133,6 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 	int                 *cluster, *cluster2, mapped, lighted, totalLighted;
 	size_t llSize, ldSize;
 	rawLightmap_t       *lm;
-	surfaceInfo_t       *info;
 	qboolean filterColor, filterDir;
 	float brightness;
 	float               *origin, *normal, *dirt, *luxel, *luxel2, *deluxel, *deluxel2;
@@ -2094,7 +2141,9 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 	vec3_t color, direction, averageColor, averageDir, total, temp, temp2;
 	float tests[ 4 ][ 2 ] = { { 0.0f, 0 }, { 1, 0 }, { 0, 1 }, { 1, 1 } };
 	trace_t trace;
-	float stackLightLuxels[ STACK_LL_SIZE ];
+	trace_t             *rowTraces, **rowPacket;
+	int numRowTraces, *rowLuxels;
+	qboolean subsample;
 
 
 	/* bail if this number exceeds the number of raw lightmaps */
@@ -2114,22 +2163,18 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 	trace.inhibitRadius = DEFAULT_INHIBIT_RADIUS;
 
 	/* twosided lighting (may or may not be a good idea for lightmapped stuff) */
-	trace.twoSided = qfalse;
-	for ( i = 0; i < trace.numSurfaces; i++ )
-	{
-		/* get surface */
-		info = &surfaceInfos[ trace.surfaces[ i ] ];
-
-		/* check twosidedness */
-		if ( info->si->twoSided ) {
-			trace.twoSided = qtrue;
-			break;
-		}
-	}
+	trace.twoSided = RawLightmapTwoSided( lm );
 
 	/* create a culled light list for this raw lightmap */
 	CreateTraceLightsForBounds( lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
 
+	/* reuse the last run's luxels if nothing that went into them changed */
+	if ( lightCache && LightCacheRestore( rawLightmapNum, &trace ) ) {
+		numLuxelsIlluminated += ( lm->sw * lm->sh );
+		FreeTraceLights( &trace );
+		return;
+	}
+
 	/* -----------------------------------------------------------------
 	   fill pass
 	   ----------------------------------------------------------------- */
@@ -2206,14 +2251,12 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 		/* allocate temporary per-light luxel storage */
 		llSize = lm->sw * lm->sh * SUPER_LUXEL_SIZE * sizeof( float );
 		ldSize = lm->sw * lm->sh * SUPER_DELUXEL_SIZE * sizeof( float );
-		if ( llSize <= ( STACK_LL_SIZE * sizeof( float ) ) ) {
-			lightLuxels = stackLightLuxels;
-		}
-		else{
-			lightLuxels = safe_malloc( llSize );
-		}
+		lightLuxels = ThreadScratch( SCRATCH_LIGHT_LUXELS, llSize );
+		rowTraces = ThreadScratch( SCRATCH_LIGHT_TRACES, lm->sw * sizeof( *rowTraces ) );
+		rowPacket = ThreadScratch( SCRATCH_LIGHT_PACKET, lm->sw * ( sizeof( *rowPacket ) + sizeof( *rowLuxels ) ) );
+		rowLuxels = (int*) ( rowPacket + lm->sw );
 		if ( deluxemap ) {
-			lightDeluxels = safe_malloc( ldSize );
+			lightDeluxels = ThreadScratch( SCRATCH_LIGHT_DELUXELS, ldSize );
 		}
 		else{
 			lightDeluxels = NULL;
@@ -2321,9 +2364,12 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 				memset( (void *) lm->superFlags, 0, size );
 			}
 
-			/* initial pass, one sample per luxel */
+			/* initial pass, one sample per luxel, with the bvh the shadow traces of a row go out as packets */
+			subsample = ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0;
+			trace.deferOcclusion = traceBVH;
 			for ( y = 0; y < lm->sh; y++ )
 			{
+				numRowTraces = 0;
 				for ( x = 0; x < lm->sw; x++ )
 				{
 					/* get cluster */
@@ -2333,14 +2379,8 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 					}
 
 					/* get particulars */
-					lightLuxel = LIGHT_LUXEL( x, y );
-					lightDeluxel = LIGHT_DELUXEL( x, y );
 					origin = SUPER_ORIGIN( x, y );
 					normal = SUPER_NORMAL( x, y );
-					flag = SUPER_FLAG( x, y );
-
-					/* set contribution count */
-					lightLuxel[ 3 ] = 1.0f;
 
 					/* setup trace */
 					trace.cluster = *cluster;
@@ -2349,24 +2389,29 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 
 					/* get light for this sample */
 					LightContributionToSample( &trace );
-					VectorCopy( trace.color, lightLuxel );
 
-					/* add the contribution to the deluxemap */
-					if ( deluxemap ) {
-						VectorCopy( trace.directionContribution, lightDeluxel );
+					/* queue the shadow trace, the test node list is scratch and not copied */
+					if ( trace.occlusionPending ) {
+						memcpy( &rowTraces[ numRowTraces ], &trace, myoffsetof( trace_t, numTestNodes ) );
+						rowPacket[ numRowTraces ] = &rowTraces[ numRowTraces ];
+						rowLuxels[ numRowTraces++ ] = x;
+						continue;
 					}
+					totalLighted += StoreLightContribution( &trace, LIGHT_LUXEL( x, y ), LIGHT_DELUXEL( x, y ), SUPER_FLAG( x, y ), subsample );
+				}
 
-					/* check for evilness */
-					if ( trace.forceSubsampling > 1.0f && ( lightSamples > 1 || lightRandomSamples ) && luxelFilterRadius == 0 ) {
-						totalLighted++;
-						*flag |= FLAG_FORCE_SUBSAMPLING; /* force */
-					}
-					/* add to count */
-					else if ( trace.color[ 0 ] || trace.color[ 1 ] || trace.color[ 2 ] ) {
-						totalLighted++;
+				/* trace the row */
+				if ( numRowTraces > 0 ) {
+					TraceLinePacket( rowPacket, numRowTraces );
+					for ( t = 0; t < numRowTraces; t++ )
+					{
+						x = rowLuxels[ t ];
+						FinishLightContribution( &rowTraces[ t ] );
+						totalLighted += StoreLightContribution( &rowTraces[ t ], LIGHT_LUXEL( x, y ), LIGHT_DELUXEL( x, y ), SUPER_FLAG( x, y ), subsample );
 					}
 				}
 			}
+			trace.deferOcclusion = qfalse;
 
 			/* don't even bother with everything else if nothing was lit */
 			if ( totalLighted == 0 ) {
@@ -2623,15 +2668,6 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 				}
 			}
 		}
-
-		/* free temporary luxels */
-		if ( lightLuxels != stackLightLuxels ) {
-			free( lightLuxels );
-		}
-
-		if ( deluxemap ) {
-			free( lightDeluxels );
-		}
 	}
 
 	/* free light list */
@@ -2814,8 +2850,119 @@ void IlluminateRawLightmap( int rawLightmapNum ){
 			}
 		}
 	}
+
+	/* keep it for the next run */
+	if ( lightCache ) {
+		LightCacheStore( rawLightmapNum );
+	}
 }
 
+
+
+/*
+   EstimateRawLightmapCost()
+   rough cost of illuminating a raw lightmap: every mapped super luxel
+   (supersampling included) is traced against every light that survives
+   culling, plus one for the fill and filter passes
+ */
+
+static double *rawLightmapCosts;
+
+static void EstimateRawLightmapCost( int rawLightmapNum ){
+	rawLightmap_t       *lm;
+	trace_t trace;
+
+	lm = &rawLightmaps[ rawLightmapNum ];
+
+	trace.twoSided = RawLightmapTwoSided( lm );
+	CreateTraceLightsForBounds( lm->mins, lm->maxs, lm->plane, lm->numLightClusters, lm->lightClusters, LIGHT_SURFACES, &trace );
+	rawLightmapCosts[ rawLightmapNum ] = (double) lm->sw * lm->sh * ( trace.numLights + 1 );
+	FreeTraceLights( &trace );
+}
+
+
+
+/*
+   CompareRawLightmapCost()
+   compare function for qsort(), most expensive first, ties in index order
+ */
+
+static int CompareRawLightmapCost( const void *a, const void *b ){
+	int n1 = *( (const int*) a ), n2 = *( (const int*) b );
+
+	if ( rawLightmapCosts[ n1 ] > rawLightmapCosts[ n2 ] ) {
+		return -1;
+	}
+	if ( rawLightmapCosts[ n1 ] < rawLightmapCosts[ n2 ] ) {
+		return 1;
+	}
+	return n1 - n2;
+}
+
+
+
+/*
+   SortRawLightmapsByCost()
+   orders the raw lightmaps so IlluminateRawLightmapSorted() hands out the
+   most expensive ones first, instead of leaving a few huge terrain or
+   patch lightmaps for the very end of the pass. must run after
+   SetupEnvelopes(), the light culling counters are left untouched.
+ */
+
+void SortRawLightmapsByCost( void ){
+	int i, planeCulled, envelopeCulled, boundsCulled, clusterCulled;
+	double total;
+
+	if ( illuminateOrder == NULL ) {
+		illuminateOrder = safe_malloc( numRawLightmaps * sizeof( int ) );
+	}
+	for ( i = 0; i < numRawLightmaps; i++ )
+		illuminateOrder[ i ] = i;
+
+	if ( noLightmapSort || numRawLightmaps < 2 ) {
+		return;
+	}
+
+	/* CreateTraceLightsForBounds() counts what it culls, keep the real pass' statistics clean */
+	planeCulled = lightsPlaneCulled;
+	envelopeCulled = lightsEnvelopeCulled;
+	boundsCulled = lightsBoundsCulled;
+	clusterCulled = lightsClusterCulled;
+
+	rawLightmapCosts = safe_malloc( numRawLightmaps * sizeof( double ) );
+	RunThreadsOnIndividual( numRawLightmaps, qfalse, EstimateRawLightmapCost );
+	qsort( illuminateOrder, numRawLightmaps, sizeof( int ), CompareRawLightmapCost );
+
+	total = 0.0;
+	for ( i = 0; i < numRawLightmaps; i++ )
+		total += rawLightmapCosts[ i ];
+	if ( total > 0.0 ) {
+		Sys_FPrintf( SYS_VRB, "Largest raw lightmap %d is %.1f%% of the estimated work\n",
+		             illuminateOrder[ 0 ], 100.0 * rawLightmapCosts[ illuminateOrder[ 0 ] ] / total );
+	}
+
+	free( rawLightmapCosts );
+	rawLightmapCosts = NULL;
+
+	lightsPlaneCulled = planeCulled;
+	lightsEnvelopeCulled = envelopeCulled;
+	lightsBoundsCulled = boundsCulled;
+	lightsClusterCulled = clusterCulled;
+}
+
+
+
+/*
+   IlluminateRawLightmapSorted()
+   RunThreadsOnIndividual() wrapper that walks the raw lightmaps in SortRawLightmapsByCost() order
+ */
+
+void IlluminateRawLightmapSorted( int num ){
+	IlluminateRawLightmap( illuminateOrder[ num ] );
+}
+
+
+
 #ifdef VERTEXLIGHT
 
 /*
@@ -2853,6 +3000,7 @@ void IlluminateVertexes( int num ){
 		/* setup trace */
 		trace.testOcclusion = ( lm != NULL ) ? qfalse : !noTrace;
 		trace.forceSunlight = info->si->forceSunlight;
+		trace.deferOcclusion = qfalse;
 		trace.recvShadows = info->recvShadows;
 		trace.numSurfaces = 1;
 		trace.surfaces = &num;
@@ -3615,6 +3763,370 @@ qboolean ChopBounds( vec3_t mins, vec3_t maxs, vec3_t origin, vec3_t normal ){
 
 
 
+/*
+   light index
+   SetupEnvelopes() files the surface lights into a per cluster visibility table and a
+   uniform grid of their envelopes, so CreateTraceLightsForBounds() only tests the lights
+   that can reach the bounds instead of walking all of them
+ */
+
+#define LIGHT_INDEX_MAX_SIZE    64          /* cells per axis */
+#define LIGHT_INDEX_PAD         1.0f        /* keeps the grid conservative against the envelope test */
+
+static light_t          *indexHead = NULL;
+static int indexNumLights = 0, numIndexLights = 0, numIndexWords = 0, numIndexClusters = 0, numIndexCells = 0;
+static int numIndexEmpty = 0, numIndexOther = 0, numIndexNoCluster = 0;
+static light_t          **indexLights = NULL;
+static unsigned int     *indexAlways = NULL, *indexSuns = NULL, *indexCulls = NULL, *indexClusterBits = NULL;
+static int indexSize[ 3 ], *indexCells = NULL, *indexCellLights = NULL;
+static vec3_t indexMins, indexScale;
+
+
+
+/*
+   CountWordBits()
+   number of set bits in a word
+ */
+
+static int CountWordBits( unsigned int bits ){
+	bits = bits - ( ( bits >> 1 ) & 0x55555555 );
+	bits = ( bits & 0x33333333 ) + ( ( bits >> 2 ) & 0x33333333 );
+	bits = ( bits + ( bits >> 4 ) ) & 0x0F0F0F0F;
+	return ( bits * 0x01010101 ) >> 24;
+}
+
+
+
+/*
+   LightIndexRange()
+   the light index cells a box touches, returns qfalse if it misses the grid
+ */
+
+static qboolean LightIndexRange( const vec3_t mins, const vec3_t maxs, int lo[ 3 ], int hi[ 3 ] ){
+	int i;
+
+
+	for ( i = 0; i < 3; i++ )
+	{
+		lo[ i ] = (int) floor( ( mins[ i ] - indexMins[ i ] ) * indexScale[ i ] );
+		hi[ i ] = (int) floor( ( maxs[ i ] - indexMins[ i ] ) * indexScale[ i ] );
+		if ( hi[ i ] < 0 || lo[ i ] >= indexSize[ i ] ) {
+			return qfalse;
+		}
+		if ( lo[ i ] < 0 ) {
+			lo[ i ] = 0;
+		}
+		if ( hi[ i ] >= indexSize[ i ] ) {
+			hi[ i ] = indexSize[ i ] - 1;
+		}
+	}
+	return qtrue;
+}
+
+
+
+/*
+   FreeLightIndex()
+   drops the light index, CreateTraceLightsForBounds() walks the light list without one
+ */
+
+static void FreeLightIndex( void ){
+	free( indexLights );
+	free( indexAlways );
+	free( indexClusterBits );
+	free( indexCells );
+	free( indexCellLights );
+	indexLights = NULL;
+	indexAlways = indexSuns = indexCulls = indexClusterBits = NULL;
+	indexCells = indexCellLights = NULL;
+	indexHead = NULL;
+	numIndexLights = 0;
+	numIndexEmpty = numIndexOther = numIndexNoCluster = 0;
+	numIndexCells = 0;
+}
+
+
+
+/*
+   SetupLightIndex()
+   builds the light index for the current light list
+ */
+
+static void SetupLightIndex( void ){
+	int i, j, c, x, y, z, w, numGridLights, numEntries, lo[ 3 ], hi[ 3 ];
+	unsigned int bit;
+	float envelope, cellSize;
+	vec3_t mins, maxs, indexMaxs;
+	light_t     *light;
+
+
+	/* gather the surface lights in list order, counting the others the way the full test in CreateTraceLightsForBounds() sees them */
+	FreeLightIndex();
+	indexLights = safe_malloc( ( numLights + 1 ) * sizeof( *indexLights ) );
+	for ( light = lights; light != NULL; light = light->next )
+	{
+		if ( light->envelope <= 0 ) {
+			numIndexEmpty++;
+		}
+		else if ( !( light->flags & LIGHT_SURFACES ) ) {
+			numIndexOther++;
+		}
+		else
+		{
+			if ( light->type != EMIT_SUN && light->cluster < 0 ) {
+				numIndexNoCluster++;
+			}
+			indexLights[ numIndexLights++ ] = light;
+		}
+	}
+	Sys_FPrintf( SYS_VRB, "%9d lights left out of the index (%d without an envelope, %d not lighting surfaces)\n",
+	             numIndexEmpty + numIndexOther, numIndexEmpty, numIndexOther );
+	if ( numIndexLights == 0 ) {
+		FreeLightIndex();
+		return;
+	}
+
+	/* light sets */
+	numIndexWords = ( numIndexLights + 31 ) >> 5;
+	indexAlways = safe_malloc( 3 * numIndexWords * sizeof( *indexAlways ) );
+	memset( indexAlways, 0, 3 * numIndexWords * sizeof( *indexAlways ) );
+	indexSuns = indexAlways + numIndexWords;
+	indexCulls = indexSuns + numIndexWords;
+
+	/* per cluster table of the lights that see it */
+	numIndexClusters = numBSPVisBytes > 8 ? ( (int*) bspVisBytes )[ 0 ] : 0;
+	if ( numIndexClusters > 0 ) {
+		indexClusterBits = safe_malloc( numIndexClusters * numIndexWords * sizeof( *indexClusterBits ) );
+		memset( indexClusterBits, 0, numIndexClusters * numIndexWords * sizeof( *indexClusterBits ) );
+	}
+
+	/* suns and unbounded lights are always tested, the others go in the grid */
+	numGridLights = 0;
+	envelope = 0.0f;
+	ClearBounds( indexMins, indexMaxs );
+	for ( i = 0; i < numIndexLights; i++ )
+	{
+		light = indexLights[ i ];
+		w = i >> 5;
+		bit = 1u << ( i & 31 );
+		if ( light->type == EMIT_SUN ) {
+			indexSuns[ w ] |= bit;
+			indexAlways[ w ] |= bit;
+			continue;
+		}
+		indexCulls[ w ] |= bit;
+		for ( c = 0; c < numIndexClusters; c++ )
+		{
+			if ( ClusterVisible( light->cluster, c ) ) {
+				indexClusterBits[ c * numIndexWords + w ] |= bit;
+			}
+		}
+		if ( light->envelope >= MAX_WORLD_COORD ) {
+			indexAlways[ w ] |= bit;
+			continue;
+		}
+		for ( j = 0; j < 3; j++ )
+		{
+			mins[ j ] = light->origin[ j ] - light->envelope - LIGHT_INDEX_PAD;
+			maxs[ j ] = light->origin[ j ] + light->envelope + LIGHT_INDEX_PAD;
+		}
+		AddPointToBounds( mins, indexMins, indexMaxs );
+		AddPointToBounds( maxs, indexMins, indexMaxs );
+		envelope += light->envelope;
+		numGridLights++;
+	}
+
+	/* cells about the size of an average envelope */
+	if ( numGridLights > 0 ) {
+		cellSize = 2.0f * envelope / numGridLights;
+		for ( j = 0; j < 3; j++ )
+		{
+			if ( cellSize < ( indexMaxs[ j ] - indexMins[ j ] ) / LIGHT_INDEX_MAX_SIZE ) {
+				cellSize = ( indexMaxs[ j ] - indexMins[ j ] ) / LIGHT_INDEX_MAX_SIZE;
+			}
+		}
+		numIndexCells = 1;
+		for ( j = 0; j < 3; j++ )
+		{
+			indexSize[ j ] = (int) ceil( ( indexMaxs[ j ] - indexMins[ j ] ) / cellSize );
+			if ( indexSize[ j ] < 1 ) {
+				indexSize[ j ] = 1;
+			}
+			if ( indexSize[ j ] > LIGHT_INDEX_MAX_SIZE ) {
+				indexSize[ j ] = LIGHT_INDEX_MAX_SIZE;
+			}
+			indexScale[ j ] = indexMaxs[ j ] > indexMins[ j ] ? indexSize[ j ] / ( indexMaxs[ j ] - indexMins[ j ] ) : 0.0f;
+			numIndexCells *= indexSize[ j ];
+		}
+	}
+
+	/* count the cell entries, lights spanning a good part of the grid are always tested instead */
+	indexCells = safe_malloc( ( numIndexCells + 1 ) * sizeof( *indexCells ) );
+	memset( indexCells, 0, ( numIndexCells + 1 ) * sizeof( *indexCells ) );
+	for ( i = 0; i < numIndexLights && numIndexCells > 0; i++ )
+	{
+		light = indexLights[ i ];
+		if ( indexAlways[ i >> 5 ] & ( 1u << ( i & 31 ) ) ) {
+			continue;
+		}
+		for ( j = 0; j < 3; j++ )
+		{
+			mins[ j ] = light->origin[ j ] - light->envelope - LIGHT_INDEX_PAD;
+			maxs[ j ] = light->origin[ j ] + light->envelope + LIGHT_INDEX_PAD;
+		}
+		LightIndexRange( mins, maxs, lo, hi );
+		if ( numIndexCells >= 64 && ( hi[ 0 ] - lo[ 0 ] + 1 ) * ( hi[ 1 ] - lo[ 1 ] + 1 ) * ( hi[ 2 ] - lo[ 2 ] + 1 ) > numIndexCells / 8 ) {
+			indexAlways[ i >> 5 ] |= ( 1u << ( i & 31 ) );
+			continue;
+		}
+		for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+			for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+				for ( x = lo[ 0 ]; x <= hi[ 0 ]; x++ )
+					indexCells[ ( z * indexSize[ 1 ] + y ) * indexSize[ 0 ] + x + 1 ]++;
+	}
+	for ( c = 0; c < numIndexCells; c++ )
+		indexCells[ c + 1 ] += indexCells[ c ];
+
+	/* fill them */
+	numEntries = indexCells[ numIndexCells ];
+	indexCellLights = safe_malloc( ( numEntries + 1 ) * sizeof( *indexCellLights ) );
+	for ( i = 0; i < numIndexLights && numIndexCells > 0; i++ )
+	{
+		light = indexLights[ i ];
+		if ( indexAlways[ i >> 5 ] & ( 1u << ( i & 31 ) ) ) {
+			continue;
+		}
+		for ( j = 0; j < 3; j++ )
+		{
+			mins[ j ] = light->origin[ j ] - light->envelope - LIGHT_INDEX_PAD;
+			maxs[ j ] = light->origin[ j ] + light->envelope + LIGHT_INDEX_PAD;
+		}
+		LightIndexRange( mins, maxs, lo, hi );
+		for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+			for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+				for ( x = lo[ 0 ]; x <= hi[ 0 ]; x++ )
+				{
+					c = ( z * indexSize[ 1 ] + y ) * indexSize[ 0 ] + x;
+					indexCellLights[ indexCells[ c ]++ ] = i;
+				}
+	}
+	for ( c = numIndexCells; c > 0; c-- )
+		indexCells[ c ] = indexCells[ c - 1 ];
+	indexCells[ 0 ] = 0;
+	indexHead = lights;
+	indexNumLights = numLights;
+
+	/* emit some statistics */
+	Sys_FPrintf( SYS_VRB, "%9d indexed lights (%d outside the pvs) in %d x %d x %d cells (%d entries)\n",
+	             numIndexLights, numIndexNoCluster, numIndexCells > 0 ? indexSize[ 0 ] : 0, numIndexCells > 0 ? indexSize[ 1 ] : 0, numIndexCells > 0 ? indexSize[ 2 ] : 0, numEntries );
+}
+
+
+
+/*
+   LightIndexCandidates()
+   puts the surface lights that can reach a sphere into candidates, in light list order, and
+   counts the others as culled like the full test would. returns -1 if the index can't be used
+ */
+
+static int LightIndexCandidates( vec3_t origin, float radius, int numClusters, int *clusters, int flags, light_t **candidates ){
+	int i, w, c, x, y, z, numCandidates, lo[ 3 ], hi[ 3 ];
+	unsigned int bits, left, *cand, *vis, *row;
+	vec3_t mins, maxs;
+
+
+	/* only surface lights are indexed */
+	if ( indexLights == NULL || indexHead != lights || indexNumLights != numLights || flags != LIGHT_SURFACES ) {
+		return -1;
+	}
+	if ( numClusters > 0 && clusters != NULL && numIndexClusters > 0 ) {
+		for ( i = 0; i < numClusters; i++ )
+		{
+			if ( clusters[ i ] >= numIndexClusters ) {
+				return -1;
+			}
+		}
+	}
+
+	/* per thread sets */
+	cand = ThreadScratch( SCRATCH_LIGHT_INDEX, 2 * numIndexWords * sizeof( *cand ) );
+	vis = cand + numIndexWords;
+
+	/* the full test counts the lights without an envelope before anything else */
+	lightsEnvelopeCulled += numIndexEmpty;
+
+	/* only suns with -sunonly, the other lights are skipped without being counted */
+	if ( sunOnly ) {
+		memcpy( cand, indexSuns, numIndexWords * sizeof( *cand ) );
+	}
+	else
+	{
+		/* lights in the cells the sphere touches */
+		memcpy( cand, indexAlways, numIndexWords * sizeof( *cand ) );
+		for ( i = 0; i < 3; i++ )
+		{
+			mins[ i ] = origin[ i ] - radius;
+			maxs[ i ] = origin[ i ] + radius;
+		}
+		if ( numIndexCells > 0 && LightIndexRange( mins, maxs, lo, hi ) ) {
+			for ( z = lo[ 2 ]; z <= hi[ 2 ]; z++ )
+				for ( y = lo[ 1 ]; y <= hi[ 1 ]; y++ )
+					for ( x = lo[ 0 ]; x <= hi[ 0 ]; x++ )
+					{
+						c = ( z * indexSize[ 1 ] + y ) * indexSize[ 0 ] + x;
+						for ( i = indexCells[ c ]; i < indexCells[ c + 1 ]; i++ )
+							cand[ indexCellLights[ i ] >> 5 ] |= 1u << ( indexCellLights[ i ] & 31 );
+					}
+		}
+
+		/* lights seen by any of the clusters */
+		if ( numClusters > 0 && clusters != NULL ) {
+			memset( vis, 0, numIndexWords * sizeof( *vis ) );
+			for ( i = 0; i < numClusters; i++ )
+			{
+				if ( clusters[ i ] < 0 ) {
+					continue;
+				}
+				if ( numIndexClusters <= 0 ) {
+					memcpy( vis, indexCulls, numIndexWords * sizeof( *vis ) );
+					break;
+				}
+				row = indexClusterBits + clusters[ i ] * numIndexWords;
+				for ( w = 0; w < numIndexWords; w++ )
+					vis[ w ] |= row[ w ];
+			}
+		}
+		else{
+			memcpy( vis, indexCulls, numIndexWords * sizeof( *vis ) );
+		}
+
+		/* the lights left out fail the pvs test, or else the envelope test */
+		for ( w = 0; w < numIndexWords; w++ )
+		{
+			left = indexCulls[ w ] & ~cand[ w ];
+			if ( left ) {
+				lightsClusterCulled += CountWordBits( left & ~vis[ w ] );
+				lightsEnvelopeCulled += CountWordBits( left & vis[ w ] );
+			}
+		}
+	}
+
+	/* gather them in list order */
+	numCandidates = 0;
+	for ( w = 0; w < numIndexWords; w++ )
+	{
+		for ( i = w << 5, bits = cand[ w ]; bits; i++, bits >>= 1 )
+		{
+			if ( bits & 1 ) {
+				candidates[ numCandidates++ ] = indexLights[ i ];
+			}
+		}
+	}
+	return numCandidates;
+}
+
+
+
 /*
    SetupEnvelopes()
    calculates each light's effective envelope,
@@ -3633,6 +4145,9 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
 	light_t     *buckets[ 256 ];
 
 
+	/* the light list is about to change */
+	FreeLightIndex();
+
 	/* early out for weird cases where there are no lights */
 	if ( lights == NULL ) {
 		return;
@@ -3945,6 +4460,11 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
 		}
 	}
 
+	/* index the surface lights for CreateTraceLightsForBounds() */
+	if ( !forGrid ) {
+		SetupLightIndex();
+	}
+
 	/* emit some statistics */
 	Sys_Printf( "%9d total lights\n", numLights );
 	Sys_Printf( "%9d culled lights\n", numCulledLights );
@@ -3958,8 +4478,8 @@ void SetupEnvelopes( qboolean forGrid, qboolean fastFlag ){
  */
 
 void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int numClusters, int *clusters, int flags, trace_t *trace ){
-	int i;
-	light_t     *light;
+	int i, j, numCandidates;
+	light_t     *light, **candidates;
 	vec3_t origin, dir, nullVector = { 0.0f, 0.0f, 0.0f };
 	float radius, dist, length;
 
@@ -3972,9 +4492,10 @@ void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int nu
 	/* debug code */
 	//% Sys_Printf( "CTWLFB: (%4.1f %4.1f %4.1f) (%4.1f %4.1f %4.1f)\n", mins[ 0 ], mins[ 1 ], mins[ 2 ], maxs[ 0 ], maxs[ 1 ], maxs[ 2 ] );
 
-	/* allocate the light list */
-	trace->lights = safe_malloc( sizeof( light_t* ) * ( numLights + 1 ) );
+	/* get the light list (per-thread, reused across lightmaps and bounces), the candidates share it */
+	trace->lights = ThreadScratch( SCRATCH_TRACE_LIGHTS, sizeof( light_t* ) * ( 2 * numLights + 1 ) );
 	trace->numLights = 0;
+	candidates = trace->lights + numLights + 1;
 
 	/* calculate spherical bounds */
 	VectorAdd( mins, maxs, origin );
@@ -3992,10 +4513,20 @@ void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int nu
 		length = 0;
 	}
 
+	/* the light index leaves out the lights that can't reach the sphere */
+	numCandidates = LightIndexCandidates( origin, radius, numClusters, clusters, flags, candidates );
+	if ( numCandidates < 0 ) {
+		numCandidates = 0;
+		for ( light = lights; light; light = light->next )
+			candidates[ numCandidates++ ] = light;
+	}
+
 	/* test each light and see if it reaches the sphere */
 	/* note: the attenuation code MUST match LightingAtSample() */
-	for ( light = lights; light; light = light->next )
+	for ( j = 0; j < numCandidates; j++ )
 	{
+		light = candidates[ j ];
+
 		/* check zero sized envelope */
 		if ( light->envelope <= 0 ) {
 			lightsEnvelopeCulled++;
@@ -4082,9 +4613,8 @@ void CreateTraceLightsForBounds( vec3_t mins, vec3_t maxs, vec3_t normal, int nu
 
 
 void FreeTraceLights( trace_t *trace ){
-	if ( trace->lights != NULL ) {
-		free( trace->lights );
-	}
+	/* the list lives in thread scratch, just drop the reference */
+	trace->lights = NULL;
 }
 
 
@@ -163,6 +163,18 @@ int main( int argc, char **argv ){
 			numthreads = atoi( argv[ i ] );
 			argv[ i ] = NULL;
 		}
+
+		/* old global-lock work dispatcher, for comparison */
+		else if ( !strcmp( argv[ i ], "-legacydispatch" ) ) {
+			legacydispatch = qtrue;
+			argv[ i ] = NULL;
+		}
+
+		/* allocation statistics, kept from every thread */
+		else if ( !strcmp( argv[ i ], "-allocstats" ) ) {
+			allocstats = qtrue;
+			argv[ i ] = NULL;
+		}
 	}
 
 	/* init model library */
@@ -173,8 +185,9 @@ int main( int argc, char **argv ){
 	PicoSetLoadFileFunc( PicoLoadFileFunc );
 	PicoSetFreeFileFunc( free );
 
-	/* set number of threads */
+	/* set number of threads and start the worker pool */
 	ThreadSetDefault();
+	ThreadPoolInit();
 
 	/* generate sinusoid jitter table */
 	for ( i = 0; i < MAX_JITTERS; i++ )
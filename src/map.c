@@ -42,7 +42,11 @@
 
 /* undefine to make plane finding use linear sort (note: really slow) */
 #define USE_HASHING
-#define PLANE_HASHES    8192
+#define PLANE_HASHES        65536
+#define PLANE_NORMAL_CELLS  64.0    /* hash cells per unit of a normal component */
+#define PLANE_DIST_CELLS    1.0     /* hash cells per unit of dist */
+#define PLANE_MAX_PROBES    32      /* more than that and FindFloatPlane() scans all planes */
+#define PLANE_DIST_BINS     8192    /* the old dist-only hash, see PlaneOrder() */
 
 int planehash[ PLANE_HASHES ];
 
@@ -85,6 +89,52 @@ qboolean PlaneEqual( plane_t *p, vec3_t normal, vec_t dist ){
 
 
 
+/*
+   PlaneCell()
+   quantizes one plane component for the hash
+ */
+
+static int PlaneCell( double v, double cells ){
+	return (int) floor( v * cells + 0.5 );
+}
+
+
+
+/*
+   PlaneHash()
+   mixes the normal and dist cells of a plane into a hash bucket
+ */
+
+static int PlaneHash( int x, int y, int z, int d ){
+	unsigned int h;
+
+
+	h = ( (unsigned int) x * 73856093u ) ^ ( (unsigned int) y * 19349663u ) ^ ( (unsigned int) z * 83492791u ) ^ ( (unsigned int) d * 2654435761u );
+	h ^= h >> 16;
+	return h & ( PLANE_HASHES - 1 );
+}
+
+
+
+/*
+   PlaneOrder()
+   planes used to be hashed on (int) fabs( dist ) alone, and FindFloatPlane()
+   returned the first match walking the bins dist - 1 to dist + 1, newest plane
+   first. when several planes match, the one first in that walk still wins so
+   plane numbering and the bsp do not change. returns the position of the
+   plane's old bin in that walk (0 to 2), or -1 if the walk did not reach it
+ */
+
+static int PlaneOrder( const plane_t *p, int distBin ){
+	int order;
+
+
+	order = ( ( ( PLANE_DIST_BINS - 1 ) & (int) fabs( p->dist ) ) - distBin + 1 ) & ( PLANE_DIST_BINS - 1 );
+	return order <= 2 ? order : -1;
+}
+
+
+
 /*
    AddPlaneToHash()
  */
@@ -93,7 +143,10 @@ void AddPlaneToHash( plane_t *p ){
 	int hash;
 
 
-	hash = ( PLANE_HASHES - 1 ) & (int) fabs( p->dist );
+	hash = PlaneHash( PlaneCell( p->normal[ 0 ], PLANE_NORMAL_CELLS ),
+					  PlaneCell( p->normal[ 1 ], PLANE_NORMAL_CELLS ),
+					  PlaneCell( p->normal[ 2 ], PLANE_NORMAL_CELLS ),
+					  PlaneCell( p->dist, PLANE_DIST_CELLS ) );
 
 	p->hash_chain = planehash[hash];
 	planehash[hash] = p - mapplanes + 1;
@@ -307,6 +360,57 @@ void SnapPlaneImproved( vec3_t normal, vec_t *dist, int numPoints, const vec3_t
 
 
 
+/*
+   TestFloatPlane()
+   makes plane pidx the best match if it matches and the old dist
+   hash would have found it before the best one so far
+ */
+
+#ifdef USE_HASHING
+static void TestFloatPlane( int pidx, vec3_t normal, vec_t dist, int numPoints, vec3_t *points, int distBin, int *best, int *bestOrder ){
+	int j, order;
+	plane_t *p;
+	vec_t d;
+
+
+	p = &mapplanes[pidx];
+
+	/* would the old walk have reached it before the best so far */
+	order = PlaneOrder( p, distBin );
+	if ( order < 0 || order > *bestOrder || ( order == *bestOrder && pidx < *best ) ) {
+		return;
+	}
+
+	/* do standard plane compare */
+	if ( !PlaneEqual( p, normal, dist ) ) {
+		return;
+	}
+
+	/* ydnar: uncomment the following line for old-style plane finding */
+	//%	*best = pidx; *bestOrder = order; return;
+
+	/* ydnar: test supplied points against this plane */
+	for ( j = 0; j < numPoints; j++ )
+	{
+		// NOTE: When dist approaches 2^16, the resolution of 32 bit floating
+		// point number is greatly decreased.  The distanceEpsilon cannot be
+		// very small when world coordinates extend to 2^16.  Making the
+		// dot product here in 64 bit land will not really help the situation
+		// because the error will already be carried in dist.
+		d = DotProduct( points[ j ], p->normal ) - p->dist;
+		d = fabs( d );
+		if ( d != 0.0 && d >= distanceEpsilon ) {
+			return; // Point is too far from plane.
+		}
+	}
+
+	*best = pidx;
+	*bestOrder = order;
+}
+#endif
+
+
+
 /*
    FindFloatPlane()
    ydnar: changed to allow a number of test points to be supplied that
@@ -318,10 +422,9 @@ int FindFloatPlane( vec3_t innormal, vec_t dist, int numPoints, vec3_t *points )
 #ifdef USE_HASHING
 
 {
-	int i, j, hash, h;
-	int pidx;
-	plane_t *p;
-	vec_t d;
+	int i, k, h, pidx, best, bestOrder, distBin, numProbes;
+	int lo[ 4 ], hi[ 4 ], cell[ 4 ], probes[ PLANE_MAX_PROBES ];
+	double ne, de;
 	vec3_t normal;
 
 	VectorCopy( innormal, normal );
@@ -330,47 +433,60 @@ int FindFloatPlane( vec3_t innormal, vec_t dist, int numPoints, vec3_t *points )
 #else
 	SnapPlane( normal, &dist );
 #endif
-	/* hash the plane */
-	hash = ( PLANE_HASHES - 1 ) & (int) fabs( dist );
 
-	/* search the border bins as well */
-	for ( i = -1; i <= 1; i++ )
+	/* a match can be in any cell within the epsilons, doubled so rounding can't hide one */
+	ne = 2.0 * normalEpsilon;
+	de = 2.0 * distanceEpsilon;
+	numProbes = 1;
+	for ( i = 0; i < 4; i++ )
 	{
-		h = ( hash + i ) & ( PLANE_HASHES - 1 );
-		for ( pidx = planehash[ h ] - 1; pidx != -1; pidx = mapplanes[pidx].hash_chain - 1 )
-		{
-			p = &mapplanes[pidx];
-
-			/* do standard plane compare */
-			if ( !PlaneEqual( p, normal, dist ) ) {
-				continue;
-			}
+		lo[ i ] = i < 3 ? PlaneCell( normal[ i ] - ne, PLANE_NORMAL_CELLS ) : PlaneCell( dist - de, PLANE_DIST_CELLS );
+		hi[ i ] = i < 3 ? PlaneCell( normal[ i ] + ne, PLANE_NORMAL_CELLS ) : PlaneCell( dist + de, PLANE_DIST_CELLS );
+		numProbes *= hi[ i ] - lo[ i ] + 1;
+	}
 
-			/* ydnar: uncomment the following line for old-style plane finding */
-			//%	return p - mapplanes;
+	distBin = ( PLANE_DIST_BINS - 1 ) & (int) fabs( dist );
+	best = -1;
+	bestOrder = 3;
 
-			/* ydnar: test supplied points against this plane */
-			for ( j = 0; j < numPoints; j++ )
-			{
-				// NOTE: When dist approaches 2^16, the resolution of 32 bit floating
-				// point number is greatly decreased.  The distanceEpsilon cannot be
-				// very small when world coordinates extend to 2^16.  Making the
-				// dot product here in 64 bit land will not really help the situation
-				// because the error will already be carried in dist.
-				d = DotProduct( points[ j ], p->normal ) - p->dist;
-				d = fabs( d );
-				if ( d != 0.0 && d >= distanceEpsilon ) {
-					break; // Point is too far from plane.
-				}
-			}
+	/* huge epsilons, just check every plane */
+	if ( numProbes > PLANE_MAX_PROBES ) {
+		for ( pidx = nummapplanes - 1; pidx >= 0; pidx-- )
+			TestFloatPlane( pidx, normal, dist, numPoints, points, distBin, &best, &bestOrder );
+	}
+	else
+	{
+		/* the buckets of those cells, usually just one */
+		numProbes = 0;
+		for ( cell[ 0 ] = lo[ 0 ]; cell[ 0 ] <= hi[ 0 ]; cell[ 0 ]++ )
+			for ( cell[ 1 ] = lo[ 1 ]; cell[ 1 ] <= hi[ 1 ]; cell[ 1 ]++ )
+				for ( cell[ 2 ] = lo[ 2 ]; cell[ 2 ] <= hi[ 2 ]; cell[ 2 ]++ )
+					for ( cell[ 3 ] = lo[ 3 ]; cell[ 3 ] <= hi[ 3 ]; cell[ 3 ]++ )
+					{
+						h = PlaneHash( cell[ 0 ], cell[ 1 ], cell[ 2 ], cell[ 3 ] );
+						for ( k = 0; k < numProbes; k++ )
+						{
+							if ( probes[ k ] == h ) {
+								break;
+							}
+						}
+						if ( k == numProbes ) {
+							probes[ numProbes++ ] = h;
+						}
+					}
 
-			/* found a matching plane */
-			if ( j >= numPoints ) {
-				return p - mapplanes;
-			}
+		for ( k = 0; k < numProbes; k++ )
+		{
+			for ( pidx = planehash[ probes[ k ] ] - 1; pidx != -1; pidx = mapplanes[pidx].hash_chain - 1 )
+				TestFloatPlane( pidx, normal, dist, numPoints, points, distBin, &best, &bestOrder );
 		}
 	}
 
+	/* found a matching plane */
+	if ( best >= 0 ) {
+		return best;
+	}
+
 	/* none found, so create a new one */
 	return CreateNewFloatPlane( normal, dist );
 }
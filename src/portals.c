@@ -42,8 +42,6 @@
 extern qboolean FixWinding( winding_t *w );
 
 
-int c_active_portals;
-int c_peak_portals;
 int c_boundary;
 int c_boundary_sides;
 
@@ -55,15 +53,7 @@ int c_boundary_sides;
 portal_t *AllocPortal( void ){
 	portal_t    *p;
 
-	if ( numthreads == 1 ) {
-		c_active_portals++;
-	}
-	if ( c_active_portals > c_peak_portals ) {
-		c_peak_portals = c_active_portals;
-	}
-
-	p = safe_malloc( sizeof( portal_t ) );
-	memset( p, 0, sizeof( portal_t ) );
+	p = ThreadArenaAlloc( CACHE_PORTAL, sizeof( portal_t ) );
 
 	return p;
 }
@@ -72,10 +62,7 @@ void FreePortal( portal_t *p ){
 	if ( p->winding ) {
 		FreeWinding( p->winding );
 	}
-	if ( numthreads == 1 ) {
-		c_active_portals--;
-	}
-	free( p );
+	ThreadArenaFree( CACHE_PORTAL, p );
 }
 
 
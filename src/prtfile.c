@@ -55,6 +55,12 @@ int num_visclusters;                    // clusters the player can be in
 int num_visportals;
 int num_solidfaces;
 
+// binary portal file records, collected so they can be written as flat arrays
+prtbPortal_t    *prtbPortals;
+int numPrtbPortals;
+float           *prtbPoints;
+int numPrtbPoints, maxPrtbPoints;
+
 void WriteFloat( FILE *f, vec_t v ){
 	if ( fabs( v - Q_rint( v ) ) < 0.001 ) {
 		fprintf( f,"%i ",(int)Q_rint( v ) );
@@ -64,6 +70,61 @@ void WriteFloat( FILE *f, vec_t v ){
 	}
 }
 
+/*
+   =================
+   PortalFloat
+
+   returns v as vis reads it back from WriteFloat, so both portal
+   file formats give the same vis
+   =================
+ */
+float PortalFloat( vec_t v ){
+	char buf[ 64 ];
+
+	if ( fabs( v - Q_rint( v ) ) < 0.001 ) {
+		return (int)Q_rint( v );
+	}
+	sprintf( buf, "%f", v );
+	return atof( buf );
+}
+
+/*
+   =================
+   AddBinaryPortal
+
+   queues a portal or face record for the binary portal file,
+   reverse stores the winding points backwards
+   =================
+ */
+void AddBinaryPortal( winding_t *w, int leaf0, int leaf1, int flags, qboolean reverse ){
+	int i, j;
+	prtbPortal_t    *out;
+	float           *points;
+
+	if ( numPrtbPoints + w->numpoints > maxPrtbPoints ) {
+		maxPrtbPoints = ( numPrtbPoints + w->numpoints ) * 2;
+		points = safe_malloc( maxPrtbPoints * 3 * sizeof( *points ) );
+		if ( numPrtbPoints ) {
+			memcpy( points, prtbPoints, numPrtbPoints * 3 * sizeof( *points ) );
+		}
+		free( prtbPoints );
+		prtbPoints = points;
+	}
+
+	out = &prtbPortals[ numPrtbPortals++ ];
+	out->numPoints = LittleLong( w->numpoints );
+	out->firstPoint = LittleLong( numPrtbPoints );
+	out->leafs[ 0 ] = LittleLong( leaf0 );
+	out->leafs[ 1 ] = LittleLong( leaf1 );
+	out->flags = LittleLong( flags );
+
+	points = &prtbPoints[ numPrtbPoints * 3 ];
+	for ( i = 0; i < w->numpoints; i++ )
+		for ( j = 0; j < 3; j++ )
+			*points++ = LittleFloat( PortalFloat( w->p[ reverse ? w->numpoints - 1 - i : i ][ j ] ) );
+	numPrtbPoints += w->numpoints;
+}
+
 void CountVisportals_r( node_t *node ){
 	int s;
 	portal_t    *p;
@@ -107,6 +168,7 @@ void WritePortalFile_r( node_t *node ){
 	winding_t   *w;
 	vec3_t normal;
 	vec_t dist;
+	qboolean backwards;
 
 	// decision node
 	if ( node->planenum != PLANENUM_LEAF ) {
@@ -138,13 +200,7 @@ void WritePortalFile_r( node_t *node ){
 			// plane the same way vis will, and flip the side orders if needed
 			// FIXME: is this still relevent?
 			WindingPlane( w, normal, &dist );
-
-			if ( DotProduct( p->plane.normal, normal ) < 0.99 ) { // backwards...
-				fprintf( pf,"%i %i %i ",w->numpoints, p->nodes[1]->cluster, p->nodes[0]->cluster );
-			}
-			else{
-				fprintf( pf,"%i %i %i ",w->numpoints, p->nodes[0]->cluster, p->nodes[1]->cluster );
-			}
+			backwards = DotProduct( p->plane.normal, normal ) < 0.99;
 
 			flags = 0;
 
@@ -158,6 +214,12 @@ void WritePortalFile_r( node_t *node ){
 				flags |= 2;
 			}
 
+			if ( binaryPortals ) {
+				AddBinaryPortal( w, p->nodes[backwards]->cluster, p->nodes[!backwards]->cluster, flags, qfalse );
+				continue;
+			}
+
+			fprintf( pf,"%i %i %i ",w->numpoints, p->nodes[backwards]->cluster, p->nodes[!backwards]->cluster );
 			fprintf( pf, "%d ", flags );
 
 			/* write the winding */
@@ -243,7 +305,10 @@ void WriteFaceFile_r( node_t *node ){
 			}
 			// write out to the file
 
-			if ( p->nodes[0] == node ) {
+			if ( binaryPortals ) {
+				AddBinaryPortal( w, node->cluster, -1, 0, p->nodes[0] != node );
+			}
+			else if ( p->nodes[0] == node ) {
 				fprintf( pf,"%i %i ",w->numpoints, p->nodes[0]->cluster );
 				for ( i = 0; i < w->numpoints; i++ )
 				{
@@ -366,6 +431,41 @@ void NumberClusters( tree_t *tree ) {
 	Sys_FPrintf( SYS_VRB, "%9d solidfaces\n", num_solidfaces );
 }
 
+/*
+   ================
+   WriteBinaryPortalFile
+
+   writes the portals and faces as flat arrays, see prtbHeader_t
+   ================
+ */
+void WriteBinaryPortalFile( tree_t *tree ){
+	prtbHeader_t header;
+
+	numPrtbPortals = 0;
+	numPrtbPoints = 0;
+	prtbPortals = safe_malloc( ( num_visportals + num_solidfaces ) * sizeof( *prtbPortals ) + 1 );
+
+	memcpy( header.magic, PORTALFILE_BINARY, 4 );
+	header.version = LittleLong( PORTALFILE_BINARY_VERSION );
+	header.numClusters = LittleLong( num_visclusters );
+	header.numPortals = LittleLong( num_visportals );
+	header.numFaces = LittleLong( num_solidfaces );
+
+	WritePortalFile_r( tree->headnode );
+	WriteFaceFile_r( tree->headnode );
+	header.numPoints = LittleLong( numPrtbPoints );
+
+	SafeWrite( pf, &header, sizeof( header ) );
+	SafeWrite( pf, prtbPortals, numPrtbPortals * sizeof( *prtbPortals ) );
+	SafeWrite( pf, prtbPoints, numPrtbPoints * 3 * sizeof( *prtbPoints ) );
+
+	free( prtbPortals );
+	free( prtbPoints );
+	prtbPortals = NULL;
+	prtbPoints = NULL;
+	maxPrtbPoints = 0;
+}
+
 /*
    ================
    WritePortalFile
@@ -377,11 +477,17 @@ void WritePortalFile( tree_t *tree, const char *portalFilePath ){
 
 	// write the file
 	Sys_Printf( "writing %s\n", portalFilePath );
-	pf = fopen( portalFilePath, "w" );
+	pf = fopen( portalFilePath, binaryPortals ? "wb" : "w" );
 	if ( !pf ) {
 		Error( "Error opening %s", portalFilePath );
 	}
 
+	if ( binaryPortals ) {
+		WriteBinaryPortalFile( tree );
+		fclose( pf );
+		return;
+	}
+
 	fprintf( pf, "%s\n", PORTALFILE );
 	fprintf( pf, "%i\n", num_visclusters );
 	fprintf( pf, "%i\n", num_visportals );
@@ -1676,7 +1676,8 @@ static void MetaTrianglesToSurface( int numPossibles, metaTriangle_t *possibles,
 	qboolean added;
 
 
-	/* allocate arrays */
+	/* allocate arrays (only the first numVerts/numIndexes entries are ever read, so these
+	   are not cleared per seed; with large game limits that was most of the time spent here) */
 	verts = safe_malloc( sizeof( *verts ) * maxSurfaceVerts );
 	indexes = safe_malloc( sizeof( *indexes ) * maxSurfaceIndexes );
 
@@ -1712,10 +1713,6 @@ static void MetaTrianglesToSurface( int numPossibles, metaTriangle_t *possibles,
 
 		ClearBounds( ds->mins, ds->maxs );
 
-		/* clear verts/indexes */
-		memset( verts, 0, sizeof( *verts ) * maxSurfaceVerts );
-		memset( indexes, 0, sizeof( *indexes ) * maxSurfaceIndexes );
-
 		/* add the first triangle */
 		if ( AddMetaTriangleToSurface( ds, seed, qfalse ) ) {
 			( *numAdded )++;
@@ -109,7 +109,7 @@ void FreeTree_r( node_t *node ){
 		FreeBrush( node->volume );
 	}
 
-	free( node );
+	ThreadArenaFree( CACHE_NODE, node );
 }
 
 
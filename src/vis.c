@@ -36,6 +36,12 @@
 /* dependencies */
 #include "vmap.h"
 
+#ifdef Q_UNIX
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+#endif
+
 
 
 
@@ -168,9 +174,9 @@ static int clustersizehistogram[MAX_MAP_LEAFS] = {0};
 
 void ClusterMerge( int leafnum ){
 	leaf_t      *leaf;
-	byte portalvector[MAX_PORTALS / 8];
+	byte        *portalvector;
 	byte uncompressed[MAX_MAP_LEAFS / 8];
-	int i, j;
+	int i;
 	int numvis, mergedleafnum;
 	vportal_t   *p;
 	int pnum;
@@ -181,6 +187,7 @@ void ClusterMerge( int leafnum ){
 	while ( leafs[mergedleafnum].merged >= 0 )
 		mergedleafnum = leafs[mergedleafnum].merged;
 
+	portalvector = safe_malloc( portalbytes );
 	memset( portalvector, 0, portalbytes );
 	leaf = &leafs[mergedleafnum];
 	for ( i = 0; i < leaf->numportals; i++ )
@@ -193,8 +200,7 @@ void ClusterMerge( int leafnum ){
 		if ( p->status != stat_done ) {
 			Error( "portal not done" );
 		}
-		for ( j = 0; j < portallongs; j++ )
-			( (long *)portalvector )[j] |= ( (long *)p->portalvis )[j];
+		VisBitsOr( portalvector, p->portalvis, portalbytes );
 		pnum = p - portals;
 		portalvector[pnum >> 3] |= 1 << ( pnum & 7 );
 	}
@@ -204,6 +210,7 @@ void ClusterMerge( int leafnum ){
 	uncompressed[mergedleafnum >> 3] |= ( 1 << ( mergedleafnum & 7 ) );
 	// convert portal bits to leaf bits
 	numvis = LeafVectorFromPortalVector( portalvector, uncompressed );
+	free( portalvector );
 
 //	if (uncompressed[leafnum>>3] & (1<<(leafnum&7)))
 //		Sys_Printf ("WARNING: Leaf portals saw into leaf\n");
@@ -252,6 +259,7 @@ void CalcPassageVis( void ){
 #else
 	Sys_Printf( "\n--- CreatePassages (%d) ---\n", numportals * 2 );
 	RunThreadsOnIndividual( numportals * 2, qtrue, CreatePassages );
+	PassageMemoryUsed();
 
 	Sys_Printf( "\n--- PassageFlow (%d) ---\n", numportals * 2 );
 	RunThreadsOnIndividual( numportals * 2, qtrue, PassageFlow );
@@ -276,6 +284,7 @@ void CalcPassagePortalVis( void ){
 #else
 	Sys_Printf( "\n--- CreatePassages (%d) ---\n", numportals * 2 );
 	RunThreadsOnIndividual( numportals * 2, qtrue, CreatePassages );
+	PassageMemoryUsed();
 
 	Sys_Printf( "\n--- PassagePortalFlow (%d) ---\n", numportals * 2 );
 	RunThreadsOnIndividual( numportals * 2, qtrue, PassagePortalFlow );
@@ -298,6 +307,89 @@ void CalcFastVis( void ){
 	}
 }
 
+/*
+   ==================
+   CheckSampledVis
+
+   -samplecheck: flows the portals again and counts the leaf pairs the flow
+   sees that -sampled culled, the sampled portalvis is what goes in the bsp
+   ==================
+ */
+static void CheckSampledVis( void ){
+	int i, j, k, missing;
+	byte        *sampled, *flowLeafs, *sampledLeafs, *vis;
+	leaf_t      *leaf;
+	vportal_t   *p;
+
+
+	sampled = safe_malloc( numportals * 2 * portalbytes );
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		memcpy( sampled + i * portalbytes, portals[i].portalvis, portalbytes );
+		memset( portals[i].portalvis, 0, portalbytes );
+		portals[i].status = stat_none;
+	}
+
+	if ( noPassageVis ) {
+		CalcPortalVis();
+	}
+	else if ( passageVisOnly ) {
+		CalcPassageVis();
+	}
+	else {
+		CalcPassagePortalVis();
+	}
+
+	// the leaves each leaf sees through its portals, by the flow and sampled
+	flowLeafs = safe_malloc( leafbytes );
+	sampledLeafs = safe_malloc( leafbytes );
+	missing = 0;
+	for ( i = 0; i < portalclusters; i++ )
+	{
+		leaf = &leafs[i];
+		if ( leaf->merged >= 0 ) {
+			continue;
+		}
+		memset( flowLeafs, 0, leafbytes );
+		memset( sampledLeafs, 0, leafbytes );
+		for ( j = 0; j < leaf->numportals; j++ )
+		{
+			p = leaf->portals[j];
+			if ( p->removed ) {
+				continue;
+			}
+			vis = sampled + ( p - portals ) * portalbytes;
+			for ( k = 0; k < numportals * 2; k++ )
+			{
+				if ( p->portalvis[k >> 3] & ( 1 << ( k & 7 ) ) ) {
+					flowLeafs[portals[k].leaf >> 3] |= ( 1 << ( portals[k].leaf & 7 ) );
+				}
+				if ( vis[k >> 3] & ( 1 << ( k & 7 ) ) ) {
+					sampledLeafs[portals[k].leaf >> 3] |= ( 1 << ( portals[k].leaf & 7 ) );
+				}
+			}
+		}
+		for ( j = 0; j < portalclusters; j++ )
+		{
+			if ( ( flowLeafs[j >> 3] & ( 1 << ( j & 7 ) ) ) && !( sampledLeafs[j >> 3] & ( 1 << ( j & 7 ) ) ) ) {
+				missing++;
+			}
+		}
+	}
+
+	// back to the sampled vis
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		memcpy( portals[i].portalvis, sampled + i * portalbytes, portalbytes );
+		portals[i].status = stat_done;
+	}
+	free( sampled );
+	free( flowLeafs );
+	free( sampledLeafs );
+
+	Sys_Printf( "%9d leaf pairs the flow sees were culled by -sampled\n", missing );
+}
+
 /*
    ==================
    CalcVis
@@ -331,15 +423,38 @@ void CalcVis( void ){
 
 
 	Sys_Printf( "\n--- BasePortalVis (%d) ---\n", numportals * 2 );
+	BenchVisPhase( "BasePortalVis" );
+	SetupBasePortalVis();
 	RunThreadsOnIndividual( numportals * 2, qtrue, BasePortalVis );
 
 //	RunThreadsOnIndividual (numportals*2, qtrue, BetterPortalVis);
 
 	SortPortals();
 
+	/* a worker only flows what the coordinator hands it */
+	if ( visWorkerAddress[ 0 ] != '\0' ) {
+		RunVisWorker();
+		return;
+	}
+
+	/* a cached portal would make the flow look faster than it is */
+	if ( visCache && !fastvis && !sampledVis && !visBench ) {
+		SetupVisCache( source );
+	}
+
+	BenchVisPhase( "flow" );
 	if ( fastvis ) {
 		CalcFastVis();
 	}
+	else if ( sampledVis ) {
+		CalcSampledVis();
+		if ( visSampleCheck ) {
+			CheckSampledVis();
+		}
+	}
+	else if ( visNetPort > 0 ) {
+		CalcDistributedVis();
+	}
 	else if ( noPassageVis ) {
 		CalcPortalVis();
 	}
@@ -349,10 +464,16 @@ void CalcVis( void ){
 	else {
 		CalcPassagePortalVis();
 	}
+	if ( !fastvis && !sampledVis ) {
+		Sys_Printf( "%9d flow recursions\n", c_chains );
+		Sys_Printf( "%9d mightsee portals pruned by symmetry\n", c_mightseepruned );
+	}
+	FinishVisCache();
 	//
 	// assemble the leaf vis lists by oring and compressing the portal lists
 	//
 	Sys_Printf( "creating leaf vis...\n" );
+	BenchVisPhase( "ClusterMerge" );
 	for ( i = 0; i < portalclusters; i++ )
 		ClusterMerge( i );
 
@@ -384,6 +505,10 @@ void CalcVis( void ){
 	Sys_Printf( "  Standard deviation: %.2f (%.3f%%/total, %.3f%%/avg)\n", sigma, sigma / portalclusters * 100.0, sigma / mu * 100.0 );
 	Sys_Printf( "  Minimum: %i (%.3f%%/total, %.3f%%/avg)\n", minvis, minvis / (double) portalclusters * 100.0, minvis / mu * 100.0 );
 	Sys_Printf( "  Maximum: %i (%.3f%%/total, %.3f%%/avg)\n", maxvis, maxvis / (double) portalclusters * 100.0, maxvis / mu * 100.0 );
+
+	if ( visBench ) {
+		WriteVisBench( totalvis, minvis, maxvis );
+	}
 }
 
 /*
@@ -460,11 +585,11 @@ int Winding_PlanesConcave( fixedWinding_t *w1, fixedWinding_t *w2,
    ============
  */
 int TryMergeLeaves( int l1num, int l2num ){
-	int i, j, k, n, numportals;
+	int i, j, k, n, numportals, maxportals;
 	visPlane_t plane1, plane2;
 	leaf_t *l1, *l2;
 	vportal_t *p1, *p2;
-	vportal_t *portals[MAX_PORTALS_ON_LEAF];
+	vportal_t **portals;
 
 	for ( k = 0; k < 2; k++ )
 	{
@@ -512,6 +637,8 @@ int TryMergeLeaves( int l1num, int l2num ){
 			l2 = &faceleafs[l2num];
 		}
 		numportals = 0;
+		maxportals = l1->numportals + l2->numportals;
+		portals = maxportals ? safe_malloc( maxportals * sizeof( *portals ) ) : NULL;
 		//the leaves can be merged now
 		for ( i = 0; i < l1->numportals; i++ )
 		{
@@ -531,11 +658,10 @@ int TryMergeLeaves( int l1num, int l2num ){
 			}
 			portals[numportals++] = p2;
 		}
-		for ( i = 0; i < numportals; i++ )
-		{
-			l2->portals[i] = portals[i];
-		}
+		free( l2->portals );
+		l2->portals = portals;
 		l2->numportals = numportals;
+		l2->maxportals = maxportals;
 		l1->merged = l2num;
 	}
 	return qtrue;
@@ -888,46 +1014,40 @@ void WritePortals( char *portalpathfile ){
 
 /*
    ============
-   LoadPortals
+   AddLeafPortal
+
+   appends a portal to a leaf, the portal list grows as needed
    ============
  */
-void LoadPortals( char *name ){
-	int i, j, flags;
-	vportal_t   *p;
-	leaf_t      *l;
-	char magic[80];
-	FILE        *f;
-	int numpoints;
-	fixedWinding_t  *w;
-	int leafnums[2];
-	visPlane_t plane;
-
-	if ( !strcmp( name,"-" ) ) {
-		f = stdin;
-	}
-	else
-	{
-		f = fopen( name, "r" );
-		if ( !f ) {
-			Error( "LoadPortals: couldn't read %s\n",name );
+void AddLeafPortal( leaf_t *l, vportal_t *p ){
+	vportal_t **portals;
+
+	if ( l->numportals == l->maxportals ) {
+		l->maxportals = l->maxportals ? l->maxportals * 2 : 8;
+		portals = safe_malloc( l->maxportals * sizeof( *portals ) );
+		if ( l->numportals ) {
+			memcpy( portals, l->portals, l->numportals * sizeof( *portals ) );
 		}
+		free( l->portals );
+		l->portals = portals;
 	}
+	l->portals[l->numportals++] = p;
+}
 
-	if ( fscanf( f,"%79s\n%i\n%i\n%i\n",magic, &portalclusters, &numportals, &numfaces ) != 4 ) {
-		Error( "LoadPortals: failed to read header" );
-	}
-	if ( strcmp( magic,PORTALFILE ) ) {
-		Error( "LoadPortals: not a portal file" );
-	}
+/*
+   ============
+   AllocPortals
+
+   sets up the portal, leaf and vis arrays once the portal file header is read
+   ============
+ */
+void AllocPortals( void ){
+	int i;
 
 	Sys_Printf( "%6i portalclusters\n", portalclusters );
 	Sys_Printf( "%6i numportals\n", numportals );
 	Sys_Printf( "%6i numfaces\n", numfaces );
 
-	if ( numportals > MAX_PORTALS ) {
-		Error( "MAX_PORTALS" );
-	}
-
 	// these counts should take advantage of 64 bit systems automatically
 	leafbytes = ( ( portalclusters + 63 ) & ~63 ) >> 3;
 	leaflongs = leafbytes / sizeof( long );
@@ -938,6 +1058,7 @@ void LoadPortals( char *name ){
 	// each file portal is split into two memory portals
 	portals = safe_malloc( 2 * numportals * sizeof( vportal_t ) );
 	memset( portals, 0, 2 * numportals * sizeof( vportal_t ) );
+	sorted_portals = safe_malloc( 2 * numportals * sizeof( *sorted_portals ) );
 
 	leafs = safe_malloc( portalclusters * sizeof( leaf_t ) );
 	memset( leafs, 0, portalclusters * sizeof( leaf_t ) );
@@ -954,7 +1075,268 @@ void LoadPortals( char *name ){
 	( (int *)bspVisBytes )[0] = portalclusters;
 	( (int *)bspVisBytes )[1] = leafbytes;
 
-	for ( i = 0, p = portals; i < numportals; i++ )
+	faces = safe_malloc( 2 * numfaces * sizeof( vportal_t ) );
+	memset( faces, 0, 2 * numfaces * sizeof( vportal_t ) );
+
+	faceleafs = safe_malloc( portalclusters * sizeof( leaf_t ) );
+	memset( faceleafs, 0, portalclusters * sizeof( leaf_t ) );
+}
+
+/*
+   ============
+   AddPortal
+
+   creates the forward and backward memory portals for file portal i
+   ============
+ */
+void AddPortal( int i, fixedWinding_t *w, int leafnums[2], int flags ){
+	int j;
+	vportal_t   *p;
+	visPlane_t plane;
+
+	p = &portals[i * 2];
+
+	// calc plane
+	PlaneFromWinding( w, &plane );
+
+	// create forward portal
+	AddLeafPortal( &leafs[leafnums[0]], p );
+
+	p->num = i + 1;
+	p->hint = (qboolean)(((flags & 1) != 0));
+	p->sky = (qboolean)(((flags & 2) != 0));
+	p->winding = w;
+	VectorSubtract( vec3_origin, plane.normal, p->plane.normal );
+	p->plane.dist = -plane.dist;
+	p->leaf = leafnums[1];
+	SetPortalSphere( p );
+	p++;
+
+	// create backwards portal
+	AddLeafPortal( &leafs[leafnums[1]], p );
+
+	p->num = i + 1;
+	p->hint = hint;
+	p->winding = NewFixedWinding( w->numpoints );
+	p->winding->numpoints = w->numpoints;
+	for ( j = 0; j < w->numpoints; j++ )
+	{
+		VectorCopy( w->points[w->numpoints - 1 - j], p->winding->points[j] );
+	}
+
+	p->plane = plane;
+	p->leaf = leafnums[0];
+	SetPortalSphere( p );
+}
+
+/*
+   ============
+   AddFace
+
+   creates the memory portal for file face i
+   ============
+ */
+void AddFace( int i, fixedWinding_t *w, int leafnum ){
+	vportal_t   *p;
+	leaf_t      *l;
+	visPlane_t plane;
+
+	p = &faces[i];
+
+	// calc plane
+	PlaneFromWinding( w, &plane );
+
+	l = &faceleafs[leafnum];
+	l->merged = -1;
+	AddLeafPortal( l, p );
+
+	p->num = i + 1;
+	p->winding = w;
+	// normal pointing out of the leaf
+	VectorSubtract( vec3_origin, plane.normal, p->plane.normal );
+	p->plane.dist = -plane.dist;
+	p->leaf = -1;
+	SetPortalSphere( p );
+}
+
+/*
+   ============
+   MapPortalFile
+
+   maps a whole file read only, falls back to reading it where mapping is not available
+   ============
+ */
+byte *MapPortalFile( const char *name, size_t *size ){
+#if GDEF_OS_WINDOWS
+	HANDLE file, mapping;
+	byte        *buffer;
+
+	file = CreateFileA( name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( file == INVALID_HANDLE_VALUE ) {
+		Error( "LoadPortals: couldn't read %s\n", name );
+	}
+	*size = GetFileSize( file, NULL );
+	mapping = CreateFileMapping( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	buffer = mapping ? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if ( mapping ) {
+		CloseHandle( mapping );
+	}
+	CloseHandle( file );
+	if ( !buffer ) {
+		Error( "LoadPortals: couldn't map %s\n", name );
+	}
+	return buffer;
+#elif defined( Q_UNIX )
+	int fd;
+	struct stat st;
+	void        *buffer;
+
+	fd = open( name, O_RDONLY );
+	if ( fd < 0 || fstat( fd, &st ) ) {
+		Error( "LoadPortals: couldn't read %s\n", name );
+	}
+	*size = st.st_size;
+	buffer = mmap( NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( buffer == MAP_FAILED ) {
+		Error( "LoadPortals: couldn't map %s\n", name );
+	}
+	return buffer;
+#else
+	void        *buffer;
+
+	*size = LoadFile( name, &buffer );
+	return buffer;
+#endif
+}
+
+/*
+   ============
+   UnmapPortalFile
+   ============
+ */
+void UnmapPortalFile( byte *buffer, size_t size ){
+#if GDEF_OS_WINDOWS
+	UnmapViewOfFile( buffer );
+#elif defined( Q_UNIX )
+	munmap( buffer, size );
+#else
+	free( buffer );
+#endif
+}
+
+/*
+   ============
+   LoadBinaryPortals
+
+   reads a portal file written by -bsp -binaryprt, see prtbHeader_t
+   ============
+ */
+void LoadBinaryPortals( const char *name ){
+	int i, j, k, numpoints, firstpoint, totalpoints;
+	int leafnums[2];
+	byte        *buffer;
+	size_t size;
+	prtbHeader_t    *header;
+	prtbPortal_t    *in;
+	float           *points;
+	fixedWinding_t  *w;
+
+	buffer = MapPortalFile( name, &size );
+	header = (prtbHeader_t*) buffer;
+	if ( size < sizeof( *header ) || memcmp( header->magic, PORTALFILE_BINARY, 4 ) ) {
+		Error( "LoadPortals: not a portal file" );
+	}
+	if ( LittleLong( header->version ) != PORTALFILE_BINARY_VERSION ) {
+		Error( "LoadPortals: %s is version %d, expected %d", name, LittleLong( header->version ), PORTALFILE_BINARY_VERSION );
+	}
+
+	portalclusters = LittleLong( header->numClusters );
+	numportals = LittleLong( header->numPortals );
+	numfaces = LittleLong( header->numFaces );
+	totalpoints = LittleLong( header->numPoints );
+	if ( portalclusters < 0 || numportals < 0 || numfaces < 0 || totalpoints < 0
+	     || size < sizeof( *header ) + ( numportals + numfaces ) * sizeof( *in ) + totalpoints * 3 * sizeof( *points ) ) {
+		Error( "LoadPortals: %s is truncated", name );
+	}
+
+	AllocPortals();
+
+	in = (prtbPortal_t*) ( header + 1 );
+	points = (float*) ( in + numportals + numfaces );
+	for ( i = 0; i < numportals + numfaces; i++, in++ )
+	{
+		numpoints = LittleLong( in->numPoints );
+		firstpoint = LittleLong( in->firstPoint );
+		leafnums[0] = LittleLong( in->leafs[0] );
+		leafnums[1] = LittleLong( in->leafs[1] );
+		if ( numpoints > MAX_POINTS_ON_WINDING || numpoints < 0 || firstpoint < 0 || firstpoint > totalpoints - numpoints ) {
+			Error( "LoadPortals: portal %i has bad points", i );
+		}
+		if ( leafnums[0] < 0 || leafnums[0] >= portalclusters
+		     || ( i < numportals && ( leafnums[1] < 0 || leafnums[1] >= portalclusters ) ) ) {
+			Error( "LoadPortals: reading portal %i", i );
+		}
+
+		w = NewFixedWinding( numpoints );
+		w->numpoints = numpoints;
+		for ( j = 0; j < numpoints; j++ )
+			for ( k = 0; k < 3; k++ )
+				w->points[j][k] = LittleFloat( points[( firstpoint + j ) * 3 + k] );
+
+		if ( i < numportals ) {
+			AddPortal( i, w, leafnums, LittleLong( in->flags ) );
+		}
+		else{
+			AddFace( i - numportals, w, leafnums[0] );
+		}
+	}
+
+	UnmapPortalFile( buffer, size );
+}
+
+/*
+   ============
+   LoadPortals
+   ============
+ */
+void LoadPortals( char *name ){
+	int i, j, flags;
+	char magic[80];
+	FILE        *f;
+	int numpoints;
+	fixedWinding_t  *w;
+	int leafnums[2];
+
+	if ( !strcmp( name,"-" ) ) {
+		f = stdin;
+	}
+	else
+	{
+		f = fopen( name, "rb" );
+		if ( !f ) {
+			Error( "LoadPortals: couldn't read %s\n",name );
+		}
+
+		/* binary portal files are mapped instead */
+		if ( fread( magic, 1, 4, f ) == 4 && !memcmp( magic, PORTALFILE_BINARY, 4 ) ) {
+			fclose( f );
+			LoadBinaryPortals( name );
+			return;
+		}
+		rewind( f );
+	}
+
+	if ( fscanf( f,"%79s\n%i\n%i\n%i\n",magic, &portalclusters, &numportals, &numfaces ) != 4 ) {
+		Error( "LoadPortals: failed to read header" );
+	}
+	if ( strcmp( magic,PORTALFILE ) ) {
+		Error( "LoadPortals: not a portal file" );
+	}
+
+	AllocPortals();
+
+	for ( i = 0; i < numportals; i++ )
 	{
 		if ( fscanf( f, "%i %i %i ", &numpoints, &leafnums[0], &leafnums[1] ) != 3 ) {
 			Error( "LoadPortals: reading portal %i", i );
@@ -970,7 +1352,7 @@ void LoadPortals( char *name ){
 			Error( "LoadPortals: reading flags" );
 		}
 
-		w = p->winding = NewFixedWinding( numpoints );
+		w = NewFixedWinding( numpoints );
 		w->numpoints = numpoints;
 
 		for ( j = 0; j < numpoints; j++ )
@@ -991,64 +1373,16 @@ void LoadPortals( char *name ){
 			// silence gcc warning
 		}
 
-		// calc plane
-		PlaneFromWinding( w, &plane );
-
-		// create forward portal
-		l = &leafs[leafnums[0]];
-		if ( l->numportals == MAX_PORTALS_ON_LEAF ) {
-			Error( "Leaf with too many portals" );
-		}
-		l->portals[l->numportals] = p;
-		l->numportals++;
-
-		p->num = i + 1;
-		p->hint = (qboolean)(((flags & 1) != 0));
-		p->sky = (qboolean)(((flags & 2) != 0));
-		p->winding = w;
-		VectorSubtract( vec3_origin, plane.normal, p->plane.normal );
-		p->plane.dist = -plane.dist;
-		p->leaf = leafnums[1];
-		SetPortalSphere( p );
-		p++;
-
-		// create backwards portal
-		l = &leafs[leafnums[1]];
-		if ( l->numportals == MAX_PORTALS_ON_LEAF ) {
-			Error( "Leaf with too many portals" );
-		}
-		l->portals[l->numportals] = p;
-		l->numportals++;
-
-		p->num = i + 1;
-		p->hint = hint;
-		p->winding = NewFixedWinding( w->numpoints );
-		p->winding->numpoints = w->numpoints;
-		for ( j = 0; j < w->numpoints; j++ )
-		{
-			VectorCopy( w->points[w->numpoints - 1 - j], p->winding->points[j] );
-		}
-
-		p->plane = plane;
-		p->leaf = leafnums[0];
-		SetPortalSphere( p );
-		p++;
-
+		AddPortal( i, w, leafnums, flags );
 	}
 
-	faces = safe_malloc( 2 * numfaces * sizeof( vportal_t ) );
-	memset( faces, 0, 2 * numfaces * sizeof( vportal_t ) );
-
-	faceleafs = safe_malloc( portalclusters * sizeof( leaf_t ) );
-	memset( faceleafs, 0, portalclusters * sizeof( leaf_t ) );
-
-	for ( i = 0, p = faces; i < numfaces; i++ )
+	for ( i = 0; i < numfaces; i++ )
 	{
 		if ( fscanf( f, "%i %i ", &numpoints, &leafnums[0] ) != 2 ) {
 			Error( "LoadPortals: reading portal %i", i );
 		}
 
-		w = p->winding = NewFixedWinding( numpoints );
+		w = NewFixedWinding( numpoints );
 		w->numpoints = numpoints;
 
 		for ( j = 0; j < numpoints; j++ )
@@ -1069,25 +1403,7 @@ void LoadPortals( char *name ){
 			// silence gcc warning
 		}
 
-		// calc plane
-		PlaneFromWinding( w, &plane );
-
-		l = &faceleafs[leafnums[0]];
-		l->merged = -1;
-		if ( l->numportals == MAX_PORTALS_ON_LEAF ) {
-			Error( "Leaf with too many faces" );
-		}
-		l->portals[l->numportals] = p;
-		l->numportals++;
-
-		p->num = i + 1;
-		p->winding = w;
-		// normal pointing out of the leaf
-		VectorSubtract( vec3_origin, plane.normal, p->plane.normal );
-		p->plane.dist = -plane.dist;
-		p->leaf = -1;
-		SetPortalSphere( p );
-		p++;
+		AddFace( i, w, leafnums[0] );
 	}
 
 	fclose( f );
@@ -1124,6 +1440,56 @@ int VisMain( int argc, char **argv ){
 			Sys_Printf( "mergeportals = true\n" );
 			mergevisportals = qtrue;
 		}
+		else if ( !strcmp( argv[i], "-sampled" ) ) {
+			Sys_Printf( "Sampled ray vis enabled\n" );
+			sampledVis = qtrue;
+		}
+		else if ( !strcmp( argv[i], "-samples" ) ) {
+			visSamples = atoi( argv[i + 1] );
+			if ( visSamples < 1 ) {
+				visSamples = 1;
+			}
+			i++;
+			sampledVis = qtrue;
+			Sys_Printf( "Up to %d rays per sampled portal\n", visSamples );
+		}
+		else if ( !strcmp( argv[i], "-sampleepsilon" ) ) {
+			visSampleEpsilon = atof( argv[i + 1] );
+			i++;
+			sampledVis = qtrue;
+			Sys_Printf( "Sampled rays pass within %g units of a portal\n", visSampleEpsilon );
+		}
+		else if ( !strcmp( argv[i], "-samplehidden" ) ) {
+			visSampleHidden = atoi( argv[i + 1] );
+			if ( visSampleHidden < 1 ) {
+				visSampleHidden = 1;
+			}
+			i++;
+			sampledVis = qtrue;
+			Sys_Printf( "Sampled leaf pairs are culled after %d blocked rays\n", visSampleHidden );
+		}
+		else if ( !strcmp( argv[i], "-samplemargin" ) ) {
+			visSampleMargin = atof( argv[i + 1] );
+			i++;
+			sampledVis = qtrue;
+			Sys_Printf( "Sampled rays only count as blocked %g units away from a portal\n", visSampleMargin );
+		}
+		else if ( !strcmp( argv[i], "-samplecheck" ) ) {
+			sampledVis = qtrue;
+			visSampleCheck = qtrue;
+			Sys_Printf( "Checking the sampled vis against the flow\n" );
+		}
+		else if ( !strcmp( argv[i], "-samplebudget" ) ) {
+			visSampleBudget = atof( argv[i + 1] );
+			i++;
+			sampledVis = qtrue;
+			Sys_Printf( "Sampled vis budget of %g seconds\n", visSampleBudget );
+		}
+		else if ( !strcmp( argv[i], "-passagememory" ) ) {
+			visPassageMemory = atof( argv[i + 1] );
+			i++;
+			Sys_Printf( "Keeping at most %g MB of passage bits\n", visPassageMemory );
+		}
 		else if ( !strcmp( argv[i], "-nopassage" ) ) {
 			Sys_Printf( "nopassage = true\n" );
 			noPassageVis = qtrue;
@@ -1136,6 +1502,35 @@ int VisMain( int argc, char **argv ){
 			Sys_Printf( "nosort = true\n" );
 			nosort = qtrue;
 		}
+		else if ( !strcmp( argv[i], "-incremental" ) ) {
+			Sys_Printf( "Reusing finished portals from the vis cache\n" );
+			visCache = qtrue;
+		}
+		else if ( !strcmp( argv[i], "-checkpoint" ) ) {
+			visCheckpoint = atof( argv[i + 1] );
+			i++;
+			visCache = qtrue;
+			Sys_Printf( "Writing the vis cache every %g seconds\n", visCheckpoint );
+		}
+		else if ( !strcmp( argv[i], "-bench" ) ) {
+			Sys_Printf( "Benchmarking the vis phases, the BSP will not be written\n" );
+			visBench = qtrue;
+		}
+		else if ( !strcmp( argv[i], "-coordinator" ) ) {
+			visNetPort = atoi( argv[i + 1] );
+			i++;
+			Sys_Printf( "Handing out portals to vis workers on port %d\n", visNetPort );
+		}
+		else if ( !strcmp( argv[i], "-workertimeout" ) ) {
+			visWorkerTimeout = atof( argv[i + 1] );
+			i++;
+			Sys_Printf( "Requeueing the ranges of vis workers after %g seconds\n", visWorkerTimeout );
+		}
+		else if ( !strcmp( argv[i], "-worker" ) ) {
+			strncpy( visWorkerAddress, argv[i + 1], sizeof( visWorkerAddress ) - 1 );
+			i++;
+			Sys_Printf( "Flowing portals for the vis coordinator at %s\n", visWorkerAddress );
+		}
 		else if ( !strcmp( argv[i],"-saveprt" ) ) {
 			Sys_Printf( "saveprt = true\n" );
 			saveprt = qtrue;
@@ -1218,6 +1613,16 @@ int VisMain( int argc, char **argv ){
 
 	CalcVis();
 
+	/* the coordinator writes the bsp */
+	if ( visWorkerAddress[ 0 ] != '\0' ) {
+		return 0;
+	}
+
+	/* keep the bsp and the prt file as they were so the bench can be run again */
+	if ( visBench ) {
+		return 0;
+	}
+
 	/* delete the prt file */
 	if ( !saveprt ) {
 		remove( portalFilePath );
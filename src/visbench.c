@@ -0,0 +1,245 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+
+/* marker */
+#define VISBENCH_C
+
+
+
+/* dependencies */
+#include "vmap.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+   vis benchmark
+
+   -bench times every vis phase in wall and process cpu seconds, together with
+   how long each worker thread was busy in it, and writes that with the flow
+   counters, the passage memory and the pvs density of the result to
+   <map>.visbench.json. the bsp and the prt file are left alone, so the same
+   map can be benched again with other options or another build.
+
+   ------------------------------------------------------------------------------- */
+
+#define MAX_BENCH_PHASES    8
+#define MAX_BENCH_THREADS   64
+
+typedef struct benchPhase_s
+{
+	const char          *name;
+	double wall, cpu;
+	int numthreads;
+	double busy[ MAX_BENCH_THREADS ];
+}
+benchPhase_t;
+
+static benchPhase_t benchPhases[ MAX_BENCH_PHASES ];
+static int numBenchPhases;
+static benchPhase_t *benchPhase;
+static double benchWall, benchCPU;
+
+
+
+/*
+   BenchCPUTime()
+   process cpu seconds, summed over all threads, clock() only counts wall time on windows
+ */
+
+static double BenchCPUTime( void ){
+#if GDEF_OS_WINDOWS
+	FILETIME created, exited, kernel, user;
+	ULARGE_INTEGER k, u;
+
+	if ( !GetProcessTimes( GetCurrentProcess(), &created, &exited, &kernel, &user ) ) {
+		return 0.0;
+	}
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return ( k.QuadPart + u.QuadPart ) * 1e-7;
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+
+/*
+   BenchVisPhase()
+   ends the running phase and starts timing the named one, NULL just ends it
+ */
+
+void BenchVisPhase( const char *name ){
+	int i;
+
+	if ( !visBench ) {
+		return;
+	}
+
+	/* finish the running phase */
+	if ( benchPhase != NULL ) {
+		benchPhase->wall = I_PreciseTime() - benchWall;
+		benchPhase->cpu = BenchCPUTime() - benchCPU;
+		benchPhase->numthreads = numthreads < 1 ? 1 : numthreads > MAX_BENCH_THREADS ? MAX_BENCH_THREADS : numthreads;
+		for ( i = 0; i < benchPhase->numthreads; i++ )
+			benchPhase->busy[ i ] = ThreadBusyTime( i );
+		benchPhase = NULL;
+	}
+
+	if ( name == NULL ) {
+		return;
+	}
+	if ( numBenchPhases >= MAX_BENCH_PHASES ) {
+		Error( "BenchVisPhase: MAX_BENCH_PHASES" );
+	}
+
+	/* start the next one */
+	benchPhase = &benchPhases[ numBenchPhases++ ];
+	memset( benchPhase, 0, sizeof( *benchPhase ) );
+	benchPhase->name = name;
+	ResetThreadBusyTime();
+	benchWall = I_PreciseTime();
+	benchCPU = BenchCPUTime();
+}
+
+
+
+/*
+   WriteBenchString()
+   writes a quoted json string
+ */
+
+static void WriteBenchString( FILE *file, const char *s ){
+	fputc( '"', file );
+	for ( ; *s; s++ )
+	{
+		if ( *s == '"' || *s == '\\' ) {
+			fputc( '\\', file );
+		}
+		if ( (unsigned char) *s >= ' ' ) {
+			fputc( *s, file );
+		}
+	}
+	fputc( '"', file );
+}
+
+
+
+/*
+   VisFlowName()
+   the flow CalcVis() picked
+ */
+
+static const char *VisFlowName( void ){
+	if ( fastvis ) {
+		return "fast";
+	}
+	if ( sampledVis ) {
+		return "sampled";
+	}
+	if ( visNetPort > 0 ) {
+		return "distributed";
+	}
+	if ( noPassageVis ) {
+		return "portal";
+	}
+	if ( passageVisOnly ) {
+		return "passage";
+	}
+	return "passageportal";
+}
+
+
+
+/*
+   WriteVisBench()
+   writes <map>.visbench.json from the timed phases and the merged cluster stats
+ */
+
+void WriteVisBench( double totalvis, int minvis, int maxvis ){
+	int i, j;
+	double wall, cpu;
+	char path[ 1024 ];
+	FILE *file;
+	benchPhase_t *phase;
+
+	BenchVisPhase( NULL );
+
+	strcpy( path, source );
+	StripExtension( path );
+	strcat( path, ".visbench.json" );
+	Sys_Printf( "Writing %s\n", path );
+	file = SafeOpenWrite( path );
+
+	fprintf( file, "{\n\t\"map\": " );
+	WriteBenchString( file, source );
+	fprintf( file, ",\n\t\"flow\": \"%s\",\n", VisFlowName() );
+	fprintf( file, "\t\"threads\": %d,\n", numthreads < 1 ? 1 : numthreads );
+	fprintf( file, "\t\"portals\": %d,\n", numportals * 2 );
+	fprintf( file, "\t\"clusters\": %d,\n", portalclusters );
+
+	/* phases */
+	wall = 0;
+	cpu = 0;
+	fprintf( file, "\t\"phases\": [\n" );
+	for ( i = 0; i < numBenchPhases; i++ )
+	{
+		phase = &benchPhases[ i ];
+		wall += phase->wall;
+		cpu += phase->cpu;
+		fprintf( file, "\t\t{ \"name\": \"%s\", \"wall\": %.6f, \"cpu\": %.6f, \"busy\": [", phase->name, phase->wall, phase->cpu );
+		for ( j = 0; j < phase->numthreads; j++ )
+			fprintf( file, "%s%.6f", j ? ", " : " ", phase->busy[ j ] );
+		fprintf( file, " ] }%s\n", i < numBenchPhases - 1 ? "," : "" );
+	}
+	fprintf( file, "\t],\n" );
+	fprintf( file, "\t\"wall\": %.6f,\n", wall );
+	fprintf( file, "\t\"cpu\": %.6f,\n", cpu );
+
+	/* flow counters */
+	fprintf( file, "\t\"chains\": %d,\n", c_chains );
+	fprintf( file, "\t\"portalskip\": %d,\n", c_portalskip );
+	fprintf( file, "\t\"leafskip\": %d,\n", c_leafskip );
+	fprintf( file, "\t\"mightseepruned\": %d,\n", c_mightseepruned );
+	fprintf( file, "\t\"passagebytes\": %.0f,\n", (double) c_passagebytes );
+
+	/* pvs */
+	fprintf( file, "\t\"visible\": %.0f,\n", totalvis );
+	fprintf( file, "\t\"minvisible\": %d,\n", minvis );
+	fprintf( file, "\t\"maxvisible\": %d,\n", maxvis );
+	fprintf( file, "\t\"density\": %.6f\n", portalclusters > 0 ? totalvis / ( (double) portalclusters * portalclusters ) : 0.0 );
+	fprintf( file, "}\n" );
+
+	fclose( file );
+}
@@ -0,0 +1,302 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define VISBITS_C
+
+
+/* dependencies */
+#include "vmap.h"
+
+#if defined( __AVX2__ )
+	#define VISBITS_AVX2    1
+	#include <immintrin.h>
+#endif
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+	#define VISBITS_SSE2    1
+	#include <emmintrin.h>
+#endif
+
+
+
+/*
+
+   bitset kernels for the vis flow
+
+   the portal and leaf vectors are sized in whole 64 bit blocks (see LoadPortals),
+   so every kernel works on a byte count that is a multiple of 8. the widest vector
+   unit available at compile time eats the bulk, the tail is done a long at a time.
+   loads are unaligned, pstack_t::mightsee lives on the stack.
+
+ */
+
+
+
+/*
+   VisBitsAndMore()
+   out = a & b, returns qtrue if out has any bit not set in vis
+   this is the "can this portal show us anything new" test of the flow
+ */
+
+qboolean VisBitsAndMore( void *out, const void *a, const void *b, const void *vis, int numBytes ){
+	int i;
+	long        *o, more;
+	const long  *la, *lb, *lv;
+
+
+	i = 0;
+	more = 0;
+
+#if VISBITS_AVX2
+	{
+		__m256i acc = _mm256_setzero_si256();
+
+		for ( ; i + 32 <= numBytes; i += 32 )
+		{
+			__m256i m = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*) ( (const byte*) a + i ) ),
+										  _mm256_loadu_si256( (const __m256i*) ( (const byte*) b + i ) ) );
+			_mm256_storeu_si256( (__m256i*) ( (byte*) out + i ), m );
+			acc = _mm256_or_si256( acc, _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i*) ( (const byte*) vis + i ) ), m ) );
+		}
+		more = !_mm256_testz_si256( acc, acc );
+	}
+#endif
+#if VISBITS_SSE2
+	{
+		__m128i acc = _mm_setzero_si128();
+
+		for ( ; i + 16 <= numBytes; i += 16 )
+		{
+			__m128i m = _mm_and_si128( _mm_loadu_si128( (const __m128i*) ( (const byte*) a + i ) ),
+									   _mm_loadu_si128( (const __m128i*) ( (const byte*) b + i ) ) );
+			_mm_storeu_si128( (__m128i*) ( (byte*) out + i ), m );
+			acc = _mm_or_si128( acc, _mm_andnot_si128( _mm_loadu_si128( (const __m128i*) ( (const byte*) vis + i ) ), m ) );
+		}
+		more |= _mm_movemask_epi8( _mm_cmpeq_epi8( acc, _mm_setzero_si128() ) ) != 0xFFFF;
+	}
+#endif
+
+	/* scalar tail (or everything without simd) */
+	o = (long*) ( (byte*) out + i );
+	la = (const long*) ( (const byte*) a + i );
+	lb = (const long*) ( (const byte*) b + i );
+	lv = (const long*) ( (const byte*) vis + i );
+	for ( ; i < numBytes; i += sizeof( long ), o++, la++, lb++, lv++ )
+	{
+		*o = *la & *lb;
+		more |= *o & ~*lv;
+	}
+
+	return more ? qtrue : qfalse;
+}
+
+
+
+/*
+   VisBitsAnd3More()
+   out = a & b & c, returns qtrue if out has any bit not set in vis
+   used by the passage flows, where the mightsee is clipped by the passage and the portal
+ */
+
+qboolean VisBitsAnd3More( void *out, const void *a, const void *b, const void *c, const void *vis, int numBytes ){
+	int i;
+	long        *o, more;
+	const long  *la, *lb, *lc, *lv;
+
+
+	i = 0;
+	more = 0;
+
+#if VISBITS_AVX2
+	{
+		__m256i acc = _mm256_setzero_si256();
+
+		for ( ; i + 32 <= numBytes; i += 32 )
+		{
+			__m256i m = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*) ( (const byte*) a + i ) ),
+										  _mm256_loadu_si256( (const __m256i*) ( (const byte*) b + i ) ) );
+			m = _mm256_and_si256( m, _mm256_loadu_si256( (const __m256i*) ( (const byte*) c + i ) ) );
+			_mm256_storeu_si256( (__m256i*) ( (byte*) out + i ), m );
+			acc = _mm256_or_si256( acc, _mm256_andnot_si256( _mm256_loadu_si256( (const __m256i*) ( (const byte*) vis + i ) ), m ) );
+		}
+		more = !_mm256_testz_si256( acc, acc );
+	}
+#endif
+#if VISBITS_SSE2
+	{
+		__m128i acc = _mm_setzero_si128();
+
+		for ( ; i + 16 <= numBytes; i += 16 )
+		{
+			__m128i m = _mm_and_si128( _mm_loadu_si128( (const __m128i*) ( (const byte*) a + i ) ),
+									   _mm_loadu_si128( (const __m128i*) ( (const byte*) b + i ) ) );
+			m = _mm_and_si128( m, _mm_loadu_si128( (const __m128i*) ( (const byte*) c + i ) ) );
+			_mm_storeu_si128( (__m128i*) ( (byte*) out + i ), m );
+			acc = _mm_or_si128( acc, _mm_andnot_si128( _mm_loadu_si128( (const __m128i*) ( (const byte*) vis + i ) ), m ) );
+		}
+		more |= _mm_movemask_epi8( _mm_cmpeq_epi8( acc, _mm_setzero_si128() ) ) != 0xFFFF;
+	}
+#endif
+
+	/* scalar tail */
+	o = (long*) ( (byte*) out + i );
+	la = (const long*) ( (const byte*) a + i );
+	lb = (const long*) ( (const byte*) b + i );
+	lc = (const long*) ( (const byte*) c + i );
+	lv = (const long*) ( (const byte*) vis + i );
+	for ( ; i < numBytes; i += sizeof( long ), o++, la++, lb++, lc++, lv++ )
+	{
+		*o = *la & *lb & *lc;
+		more |= *o & ~*lv;
+	}
+
+	return more ? qtrue : qfalse;
+}
+
+
+
+/*
+   VisBitsOr()
+   out |= a
+ */
+
+void VisBitsOr( void *out, const void *a, int numBytes ){
+	int i;
+	long        *o;
+	const long  *la;
+
+
+	i = 0;
+
+#if VISBITS_AVX2
+	for ( ; i + 32 <= numBytes; i += 32 )
+	{
+		__m256i *po = (__m256i*) ( (byte*) out + i );
+		_mm256_storeu_si256( po, _mm256_or_si256( _mm256_loadu_si256( po ), _mm256_loadu_si256( (const __m256i*) ( (const byte*) a + i ) ) ) );
+	}
+#endif
+#if VISBITS_SSE2
+	for ( ; i + 16 <= numBytes; i += 16 )
+	{
+		__m128i *po = (__m128i*) ( (byte*) out + i );
+		_mm_storeu_si128( po, _mm_or_si128( _mm_loadu_si128( po ), _mm_loadu_si128( (const __m128i*) ( (const byte*) a + i ) ) ) );
+	}
+#endif
+
+	o = (long*) ( (byte*) out + i );
+	la = (const long*) ( (const byte*) a + i );
+	for ( ; i < numBytes; i += sizeof( long ) )
+		*o++ |= *la++;
+}
+
+
+
+/*
+   VisBitsAny()
+   returns qtrue if any bit of a & b is set
+ */
+
+qboolean VisBitsAny( const void *a, const void *b, int numBytes ){
+	int i;
+	const long  *la, *lb;
+
+
+	i = 0;
+
+#if VISBITS_SSE2
+	for ( ; i + 16 <= numBytes; i += 16 )
+	{
+		__m128i m = _mm_and_si128( _mm_loadu_si128( (const __m128i*) ( (const byte*) a + i ) ),
+								   _mm_loadu_si128( (const __m128i*) ( (const byte*) b + i ) ) );
+		if ( _mm_movemask_epi8( _mm_cmpeq_epi8( m, _mm_setzero_si128() ) ) != 0xFFFF ) {
+			return qtrue;
+		}
+	}
+#endif
+
+	la = (const long*) ( (const byte*) a + i );
+	lb = (const long*) ( (const byte*) b + i );
+	for ( ; i < numBytes; i += sizeof( long ) )
+		if ( *la++ & *lb++ ) {
+			return qtrue;
+		}
+
+	return qfalse;
+}
+
+
+
+/*
+   CountWord()
+   population count of a 32 bit word
+ */
+
+static int CountWord( unsigned int w ){
+#if defined( __GNUC__ )
+	return __builtin_popcount( w );
+#else
+	w = w - ( ( w >> 1 ) & 0x55555555 );
+	w = ( w & 0x33333333 ) + ( ( w >> 2 ) & 0x33333333 );
+	return ( ( ( w + ( w >> 4 ) ) & 0x0F0F0F0F ) * 0x01010101 ) >> 24;
+#endif
+}
+
+
+
+/*
+   CountBits()
+   counts the set bits among the first numbits of a bit vector
+ */
+
+int CountBits( byte *bits, int numbits ){
+	int i, c, numBytes;
+	unsigned int w;
+
+
+	/* whole words, byte order does not matter for a popcount */
+	c = 0;
+	numBytes = numbits >> 3;
+	for ( i = 0; i + 4 <= numBytes; i += 4 )
+	{
+		memcpy( &w, bits + i, 4 );
+		c += CountWord( w );
+	}
+
+	/* whole bytes */
+	for ( ; i < numBytes; i++ )
+		c += CountWord( bits[ i ] );
+
+	/* trailing bits */
+	if ( numbits & 7 ) {
+		c += CountWord( bits[ i ] & ( ( 1 << ( numbits & 7 ) ) - 1 ) );
+	}
+
+	return c;
+}
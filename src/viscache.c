@@ -0,0 +1,448 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define VISCACHE_C
+
+
+
+/* dependencies */
+#include "vmap.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+   resumable vis
+
+   -incremental keeps a <map>.vcache file next to the bsp with the portalvis of
+   every portal the flow has finished. it is rewritten every -checkpoint seconds
+   while the flow runs and once more at the end, so an interrupted vis picks up
+   where the last checkpoint left it, and a re-vis after an edit only flows the
+   portals whose flood region changed.
+
+   an entry is keyed on the portal's own winding and the windings of every portal
+   in its portalflood, which is everything the flow through it can touch. the
+   portal numbering changes with every bsp, so the file also lists a winding hash
+   per portal and the cached bits are renumbered through it on load.
+
+   restored portals start out as stat_done, other portals flowing through them
+   clip against their portalvis like they would in a threaded run.
+
+   ------------------------------------------------------------------------------- */
+
+#define VIS_CACHE_MAGIC         ( ( '1' << 24 ) + ( 'C' << 16 ) + ( 'S' << 8 ) + 'V' )
+#define VIS_CACHE_VERSION       1
+
+typedef struct visCacheHeader_s
+{
+	int magic, version;
+	unsigned int optionsHash[ 2 ];
+	int numPortals;                     /* memory portals, numportals * 2 of the writing run */
+	int numEntries;
+}
+visCacheHeader_t;
+
+/* the header is followed by numPortals winding hashes, then numEntries of
+   a key and the portalvis bits, ( ( numPortals + 63 ) & ~63 ) >> 3 bytes each */
+
+typedef struct visCacheHash_s
+{
+	unsigned int hash[ 2 ];
+	int num;
+}
+visCacheHash_t;
+
+static char cachePath[ 1024 ], cacheTempPath[ 1024 ];
+static unsigned int optionsHash[ 2 ];
+static unsigned int         *portalHashes, *portalKeys;
+static int                  *checkpointPortals;
+static qboolean checkpointBusy;
+static double lastCheckpoint;
+static int numRestoredPortals;
+
+
+
+/*
+   CompareCacheHashes()
+   qsort/bsearch callback for visCacheHash_t
+ */
+
+static int CompareCacheHashes( const void *a, const void *b ){
+	const visCacheHash_t *ha = (const visCacheHash_t*) a, *hb = (const visCacheHash_t*) b;
+
+	if ( ha->hash[ 0 ] != hb->hash[ 0 ] ) {
+		return ha->hash[ 0 ] < hb->hash[ 0 ] ? -1 : 1;
+	}
+	if ( ha->hash[ 1 ] != hb->hash[ 1 ] ) {
+		return ha->hash[ 1 ] < hb->hash[ 1 ] ? -1 : 1;
+	}
+	return 0;
+}
+
+
+
+/*
+   HashPortal()
+   hashes what the flow sees of a memory portal: its winding, plane and flags
+ */
+
+static void HashPortal( unsigned int hash[ 2 ], const vportal_t *p ){
+	int flags;
+
+
+	hash[ 0 ] = 2166136261u;
+	hash[ 1 ] = VIS_CACHE_VERSION;
+	flags = ( p->hint ? 1 : 0 ) | ( p->sky ? 2 : 0 ) | ( p->removed ? 4 : 0 );
+	HashBytes( hash, &flags, sizeof( flags ) );
+	HashBytes( hash, &p->plane, sizeof( p->plane ) );
+	HashBytes( hash, &p->winding->numpoints, sizeof( p->winding->numpoints ) );
+	HashBytes( hash, p->winding->points, p->winding->numpoints * sizeof( p->winding->points[ 0 ] ) );
+}
+
+
+
+/*
+   ReadVisCache()
+   restores the portals whose key is in the old cache file
+ */
+
+static void ReadVisCache( void ){
+	int i, j, k, numOldPortals, oldBytes;
+	FILE                *f;
+	visCacheHeader_t header;
+	visCacheHash_t      *current, *found, search;
+	unsigned int        *oldHashes, key[ 2 ];
+	int                 *renumber;
+	byte                *bits, *portalvis;
+	vportal_t           *p;
+
+
+	f = fopen( cachePath, "rb" );
+	if ( f == NULL ) {
+		return;
+	}
+	if ( fread( &header, sizeof( header ), 1, f ) != 1 ||
+	     header.magic != VIS_CACHE_MAGIC || header.version != VIS_CACHE_VERSION ||
+	     header.optionsHash[ 0 ] != optionsHash[ 0 ] || header.optionsHash[ 1 ] != optionsHash[ 1 ] ||
+	     header.numPortals <= 0 || header.numEntries < 0 ) {
+		Sys_Printf( "Vis cache %s does not match these options, flowing everything\n", cachePath );
+		fclose( f );
+		return;
+	}
+	numOldPortals = header.numPortals;
+	oldBytes = ( ( numOldPortals + 63 ) & ~63 ) >> 3;
+
+	/* map the old portal numbers onto this run's, by winding */
+	oldHashes = safe_malloc( numOldPortals * 2 * sizeof( *oldHashes ) );
+	if ( fread( oldHashes, sizeof( *oldHashes ) * 2, numOldPortals, f ) != (size_t) numOldPortals ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Vis cache %s is truncated\n", cachePath );
+		free( oldHashes );
+		fclose( f );
+		return;
+	}
+	current = safe_malloc( numportals * 2 * sizeof( *current ) );
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		current[ i ].hash[ 0 ] = portalHashes[ i * 2 ];
+		current[ i ].hash[ 1 ] = portalHashes[ i * 2 + 1 ];
+		current[ i ].num = i;
+	}
+	qsort( current, numportals * 2, sizeof( *current ), CompareCacheHashes );
+	renumber = safe_malloc( numOldPortals * sizeof( *renumber ) );
+	for ( i = 0; i < numOldPortals; i++ )
+	{
+		search.hash[ 0 ] = oldHashes[ i * 2 ];
+		search.hash[ 1 ] = oldHashes[ i * 2 + 1 ];
+		found = bsearch( &search, current, numportals * 2, sizeof( *current ), CompareCacheHashes );
+		renumber[ i ] = found ? found->num : -1;
+	}
+
+	/* this run's keys, sorted for lookup */
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		current[ i ].hash[ 0 ] = portalKeys[ i * 2 ];
+		current[ i ].hash[ 1 ] = portalKeys[ i * 2 + 1 ];
+		current[ i ].num = i;
+	}
+	qsort( current, numportals * 2, sizeof( *current ), CompareCacheHashes );
+
+	/* walk the entries */
+	bits = safe_malloc( oldBytes );
+	for ( i = 0; i < header.numEntries; i++ )
+	{
+		if ( fread( key, sizeof( key ), 1, f ) != 1 || fread( bits, oldBytes, 1, f ) != 1 ) {
+			Sys_FPrintf( SYS_WRN, "WARNING: Vis cache %s is truncated\n", cachePath );
+			break;
+		}
+		search.hash[ 0 ] = key[ 0 ];
+		search.hash[ 1 ] = key[ 1 ];
+		found = bsearch( &search, current, numportals * 2, sizeof( *current ), CompareCacheHashes );
+		if ( found == NULL ) {
+			continue;
+		}
+		p = &portals[ found->num ];
+		if ( p->removed || p->status == stat_done ) {
+			continue;
+		}
+
+		/* renumber the bits, any portal that went away voids the entry */
+		portalvis = safe_malloc( portalbytes );
+		memset( portalvis, 0, portalbytes );
+		for ( j = 0; j < numOldPortals; j++ )
+		{
+			if ( !( bits[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) ) {
+				continue;
+			}
+			k = renumber[ j ];
+			if ( k < 0 ) {
+				break;
+			}
+			portalvis[ k >> 3 ] |= ( 1 << ( k & 7 ) );
+		}
+		if ( j < numOldPortals ) {
+			free( portalvis );
+			continue;
+		}
+
+		free( p->portalvis );
+		p->portalvis = portalvis;
+		p->status = stat_done;
+		numRestoredPortals++;
+	}
+
+	free( bits );
+	free( renumber );
+	free( current );
+	free( oldHashes );
+	fclose( f );
+}
+
+
+
+/*
+   SetupVisCache()
+   keys every portal on its flood region and restores the ones the last run finished,
+   call after BasePortalVis()
+ */
+
+void SetupVisCache( const char *BSPFilePath ){
+	int i, j, count;
+	unsigned int sum[ 2 ];
+	vportal_t           *p;
+
+
+	/* note it */
+	Sys_FPrintf( SYS_VRB, "--- SetupVisCache ---\n" );
+
+	strcpy( cachePath, BSPFilePath );
+	StripExtension( cachePath );
+	DefaultExtension( cachePath, ".vcache" );
+	sprintf( cacheTempPath, "%s.tmp", cachePath );
+
+	/* anything that changes what a flow computes */
+	optionsHash[ 0 ] = 2166136261u;
+	optionsHash[ 1 ] = VIS_CACHE_VERSION;
+	HashBytes( optionsHash, &noPassageVis, sizeof( noPassageVis ) );
+	HashBytes( optionsHash, &passageVisOnly, sizeof( passageVisOnly ) );
+	HashBytes( optionsHash, &mergevis, sizeof( mergevis ) );
+	HashBytes( optionsHash, &mergevisportals, sizeof( mergevisportals ) );
+	HashBytes( optionsHash, &hint, sizeof( hint ) );
+	HashBytes( optionsHash, &farPlaneDist, sizeof( farPlaneDist ) );
+
+	/* hash the windings */
+	portalHashes = safe_malloc( numportals * 2 * 2 * sizeof( *portalHashes ) );
+	for ( i = 0; i < numportals * 2; i++ )
+		HashPortal( &portalHashes[ i * 2 ], &portals[ i ] );
+
+	/* key each portal on its own winding and the (order independent) sum of its flood */
+	portalKeys = safe_malloc( numportals * 2 * 2 * sizeof( *portalKeys ) );
+	for ( i = 0, p = portals; i < numportals * 2; i++, p++ )
+	{
+		sum[ 0 ] = sum[ 1 ] = 0;
+		count = 0;
+		if ( p->portalflood != NULL ) {
+			for ( j = 0; j < numportals * 2; j++ )
+			{
+				if ( p->portalflood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) {
+					sum[ 0 ] += portalHashes[ j * 2 ];
+					sum[ 1 ] += portalHashes[ j * 2 + 1 ];
+					count++;
+				}
+			}
+		}
+		portalKeys[ i * 2 ] = portalHashes[ i * 2 ];
+		portalKeys[ i * 2 + 1 ] = portalHashes[ i * 2 + 1 ];
+		HashBytes( &portalKeys[ i * 2 ], sum, sizeof( sum ) );
+		HashBytes( &portalKeys[ i * 2 ], &count, sizeof( count ) );
+	}
+
+	/* restore */
+	numRestoredPortals = 0;
+	ReadVisCache();
+	if ( numRestoredPortals > 0 ) {
+		Sys_Printf( "Reusing %d of %d portals from %s\n", numRestoredPortals, numportals * 2, cachePath );
+	}
+
+	checkpointPortals = safe_malloc( numportals * 2 * sizeof( *checkpointPortals ) );
+	checkpointBusy = qfalse;
+	lastCheckpoint = I_FloatTime();
+}
+
+
+
+/*
+   CollectDonePortals()
+   lists the portals the flow has finished so far, the portalvis of a finished portal does not change any more
+ */
+
+static int CollectDonePortals( int *done ){
+	int i, numDone;
+	vportal_t           *p;
+
+
+	numDone = 0;
+	for ( i = 0, p = portals; i < numportals * 2; i++, p++ )
+	{
+		if ( !p->removed && p->status == stat_done ) {
+			done[ numDone++ ] = i;
+		}
+	}
+	return numDone;
+}
+
+
+
+/*
+   WriteVisCache()
+   writes the listed portals to the temp file and moves it over the cache,
+   a failed write only warns and leaves the old cache alone, returns qfalse then
+ */
+
+static qboolean WriteVisCache( const int *done, int numDone ){
+	int i;
+	qboolean ok;
+	FILE                *f;
+	visCacheHeader_t header;
+
+
+	memset( &header, 0, sizeof( header ) );
+	header.magic = VIS_CACHE_MAGIC;
+	header.version = VIS_CACHE_VERSION;
+	header.optionsHash[ 0 ] = optionsHash[ 0 ];
+	header.optionsHash[ 1 ] = optionsHash[ 1 ];
+	header.numPortals = numportals * 2;
+	header.numEntries = numDone;
+
+	f = fopen( cacheTempPath, "wb" );
+	if ( f == NULL ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Unable to open %s, skipping the vis cache write\n", cacheTempPath );
+		return qfalse;
+	}
+	ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+		 fwrite( portalHashes, numportals * 2 * 2 * sizeof( *portalHashes ), 1, f ) == 1;
+	for ( i = 0; i < numDone && ok; i++ )
+	{
+		ok = fwrite( &portalKeys[ done[ i ] * 2 ], 2 * sizeof( *portalKeys ), 1, f ) == 1 &&
+			 fwrite( portals[ done[ i ] ].portalvis, portalbytes, 1, f ) == 1;
+	}
+	if ( fclose( f ) != 0 ) {
+		ok = qfalse;
+	}
+	if ( !ok ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Unable to write %s, skipping the vis cache write\n", cacheTempPath );
+		remove( cacheTempPath );
+		return qfalse;
+	}
+
+	remove( cachePath );
+	if ( rename( cacheTempPath, cachePath ) != 0 ) {
+		Sys_FPrintf( SYS_WRN, "WARNING: Unable to write vis cache %s\n", cachePath );
+		return qfalse;
+	}
+	return qtrue;
+}
+
+
+
+/*
+   VisCacheCheckpoint()
+   called by the flows after finishing a portal, writes the cache every visCheckpoint seconds.
+   only the list of finished portals is taken under the lock, the other threads keep flowing while it is written
+ */
+
+void VisCacheCheckpoint( void ){
+	int numDone;
+
+
+	if ( portalKeys == NULL || visCheckpoint <= 0 || checkpointBusy || I_FloatTime() - lastCheckpoint < visCheckpoint ) {
+		return;
+	}
+
+	ThreadLock();
+	if ( checkpointBusy || I_FloatTime() - lastCheckpoint < visCheckpoint ) {
+		ThreadUnlock();
+		return;
+	}
+	checkpointBusy = qtrue;
+	numDone = CollectDonePortals( checkpointPortals );
+	ThreadUnlock();
+
+	WriteVisCache( checkpointPortals, numDone );
+
+	ThreadLock();
+	lastCheckpoint = I_FloatTime();
+	checkpointBusy = qfalse;
+	ThreadUnlock();
+}
+
+
+
+/*
+   FinishVisCache()
+   writes the final cache once every portal has flowed
+ */
+
+void FinishVisCache( void ){
+	if ( portalKeys == NULL ) {
+		return;
+	}
+
+	if ( WriteVisCache( checkpointPortals, CollectDonePortals( checkpointPortals ) ) ) {
+		Sys_FPrintf( SYS_VRB, "Wrote vis cache %s (%d portals reused)\n", cachePath, numRestoredPortals );
+	}
+
+	free( portalHashes );
+	free( portalKeys );
+	free( checkpointPortals );
+	portalHashes = NULL;
+	portalKeys = NULL;
+	checkpointPortals = NULL;
+}
@@ -58,25 +58,39 @@
    void CalcMightSee (leaf_t *leaf,
  */
 
-int CountBits( byte *bits, int numbits ){
-	int i;
-	int c;
-
-	c = 0;
-	for ( i = 0; i < numbits; i++ )
-		if ( bits[i >> 3] & ( 1 << ( i & 7 ) ) ) {
-			c++;
-		}
-
-	return c;
-}
-
 int c_fullskip;
 
 int c_chop, c_nochop;
 
 int active;
 
+#define FLOW_MIGHTSEE_LEVELS    64
+
+/*
+   FlowMightsee
+
+   returns the mightsee vector for a flow recursion level, portalbytes long.
+   the first FLOW_MIGHTSEE_LEVELS levels share one per-thread scratch block so
+   a chain walks consecutive memory, deeper levels are allocated on their own
+ */
+static byte *FlowMightsee( int depth ){
+	if ( depth < FLOW_MIGHTSEE_LEVELS ) {
+		return (byte*) ThreadScratch( SCRATCH_VIS_MIGHTSEE, FLOW_MIGHTSEE_LEVELS * portalbytes ) + depth * portalbytes;
+	}
+	return safe_malloc( portalbytes );
+}
+
+/*
+   FreeFlowMightsee
+
+   hands back a vector from FlowMightsee
+ */
+static void FreeFlowMightsee( byte *mightsee, int depth ){
+	if ( depth >= FLOW_MIGHTSEE_LEVELS ) {
+		free( mightsee );
+	}
+}
+
 void CheckStack( leaf_t *leaf, threaddata_t *thread ){
 	pstack_t    *p, *p2;
 
@@ -425,8 +439,9 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
 	vportal_t   *p;
 	visPlane_t backplane;
 	leaf_t      *leaf;
-	int i, j, n;
-	long        *test, *might, *prevmight, *vis, more;
+	int i, n;
+	long        *test, *might, *vis;
+	qboolean more;
 	int pnum;
 
 	thread->c_chains++;
@@ -440,6 +455,7 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
 	stack.leaf = leaf;
 	stack.portal = NULL;
 	stack.depth = prevstack->depth + 1;
+	stack.mightsee = FlowMightsee( stack.depth );
 
 #ifdef SEPERATORCACHE
 	stack.numseperators[0] = 0;
@@ -478,6 +494,7 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
 		 */
 
 		if ( !( prevstack->mightsee[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {
+			thread->c_portalskip++;
 			continue;   // can't possibly see it
 		}
 
@@ -490,16 +507,11 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
 			test = (long *)p->portalflood;
 		}
 
-		more = 0;
-		prevmight = (long *)prevstack->mightsee;
-		for ( j = 0; j < portallongs; j++ )
-		{
-			might[j] = prevmight[j] & test[j];
-			more |= ( might[j] & ~vis[j] );
-		}
+		more = VisBitsAndMore( might, prevstack->mightsee, test, vis, portalbytes );
 
 		if ( !more &&
 		     ( thread->base->portalvis[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {     // can't see anything new
+			thread->c_leafskip++;
 			continue;
 		}
 
@@ -638,6 +650,50 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
 		//
 		stack.next = NULL;
 	}
+
+	FreeFlowMightsee( stack.mightsee, stack.depth );
+}
+
+/*
+   ===============
+   PruneMightsee
+
+   vis is symmetric: the base portal can only see a portal if the reverse
+   of that portal can see the reverse of the base. portals sorted ahead of
+   the base are mostly done by now, so every done reverse portal that does
+   not see the reverse base takes its portal off the mightsee before the
+   flow starts, along with everything that would only be reached through it.
+   returns the number of portals pruned
+   ===============
+ */
+static int PruneMightsee( vportal_t *base, byte *mightsee ){
+	int i, num, c_pruned;
+	vportal_t   *r;
+
+
+	/* the far plane skips sky portals, which are only flagged on one side */
+	num = ( base - portals ) ^ 1;
+	if ( farPlaneDist > 0.0f || portals[num].removed ) {
+		return 0;
+	}
+
+	c_pruned = 0;
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		if ( !( mightsee[i >> 3] & ( 1 << ( i & 7 ) ) ) ) {
+			continue;
+		}
+		r = &portals[i ^ 1];
+		if ( r->status != stat_done || r->removed ) {
+			continue;
+		}
+		if ( !( r->portalvis[num >> 3] & ( 1 << ( num & 7 ) ) ) ) {
+			mightsee[i >> 3] &= ~( 1 << ( i & 7 ) );
+			c_pruned++;
+		}
+	}
+
+	return c_pruned;
 }
 
 /*
@@ -649,9 +705,8 @@ void RecursiveLeafFlow( int leafnum, threaddata_t *thread, pstack_t *prevstack )
  */
 void PortalFlow( int portalnum ){
 	threaddata_t data;
-	int i;
 	vportal_t       *p;
-	int c_might, c_can;
+	int c_might, c_can, c_pruned;
 
 #ifdef MREDEBUG
 	Sys_Printf( "\r%6d", portalnum );
@@ -664,6 +719,11 @@ void PortalFlow( int portalnum ){
 		return;
 	}
 
+	/* restored from the vis cache */
+	if ( p->status == stat_done ) {
+		return;
+	}
+
 	p->status = stat_working;
 
 	c_might = CountBits( p->portalflood, numportals * 2 );
@@ -675,12 +735,21 @@ void PortalFlow( int portalnum ){
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for ( i = 0; i < portallongs; i++ )
-		( (long *)data.pstack_head.mightsee )[i] = ( (long *)p->portalflood )[i];
+	data.pstack_head.mightsee = FlowMightsee( 0 );
+	memcpy( data.pstack_head.mightsee, p->portalflood, portalbytes );
+	c_pruned = PruneMightsee( p, data.pstack_head.mightsee );
 
 	RecursiveLeafFlow( p->leaf, &data, &data.pstack_head );
 
+	ThreadLock();
+	c_chains += data.c_chains;
+	c_portalskip += data.c_portalskip;
+	c_leafskip += data.c_leafskip;
+	c_mightseepruned += c_pruned;
+	ThreadUnlock();
+
 	p->status = stat_done;
+	VisCacheCheckpoint();
 
 	c_can = CountBits( p->portalvis, numportals * 2 );
 
@@ -688,6 +757,43 @@ void PortalFlow( int portalnum ){
 	             (int)( p - portals ), c_might, c_can, data.c_chains );
 }
 
+/*
+   ==================
+   PassageMightsee
+
+   out = mightsee & passage cansee & portalvis, returns qtrue if out has
+   anything that is not in vis yet. a passage over -passagememory only kept
+   the runs of its cansee, the flood of the portal it leaves from fills them
+   ==================
+ */
+static qboolean PassageMightsee( byte *out, const byte *mightsee, const vportal_t *portal, const passage_t *passage, const byte *portalvis, const byte *vis ){
+	int i, start, end;
+	qboolean more;
+	const byte  *cansee;
+
+	// only the runs can have bits, everything between them is clear
+	more = qfalse;
+	end = 0;
+	cansee = passage->cansee;
+	for ( i = 0; i < passage->numruns; i++ )
+	{
+		start = passage->runs[ i ].start << 3;
+		memset( out + end, 0, start - end );
+		end = start + ( passage->runs[ i ].count << 3 );
+		if ( cansee == NULL ) {
+			more |= VisBitsAnd3More( out + start, mightsee + start, portal->portalflood + start, portalvis + start, vis + start, end - start );
+		}
+		else
+		{
+			more |= VisBitsAnd3More( out + start, mightsee + start, cansee, portalvis + start, vis + start, end - start );
+			cansee += end - start;
+		}
+	}
+	memset( out + end, 0, portalbytes - end );
+
+	return more;
+}
+
 /*
    ==================
    RecursivePassageFlow
@@ -698,18 +804,22 @@ void RecursivePassageFlow( vportal_t *portal, threaddata_t *thread, pstack_t *pr
 	vportal_t   *p;
 	leaf_t      *leaf;
 	passage_t   *passage, *nextpassage;
-	int i, j;
-	long        *might, *vis, *prevmight, *cansee, *portalvis, more;
+	int i;
+	byte        *vis, *portalvis;
+	qboolean more;
 	int pnum;
 
+	thread->c_chains++;
+
 	leaf = &leafs[portal->leaf];
 
 	prevstack->next = &stack;
 
 	stack.next = NULL;
 	stack.depth = prevstack->depth + 1;
+	stack.mightsee = FlowMightsee( stack.depth );
 
-	vis = (long *)thread->base->portalvis;
+	vis = thread->base->portalvis;
 
 	passage = portal->passages;
 	nextpassage = passage;
@@ -724,39 +834,24 @@ void RecursivePassageFlow( vportal_t *portal, threaddata_t *thread, pstack_t *pr
 		pnum = p - portals;
 
 		if ( !( prevstack->mightsee[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {
+			thread->c_portalskip++;
 			continue;   // can't possibly see it
 		}
 
 		// mark the portal as visible
 		thread->base->portalvis[pnum >> 3] |= ( 1 << ( pnum & 7 ) );
 
-		prevmight = (long *)prevstack->mightsee;
-		cansee = (long *)passage->cansee;
-		might = (long *)stack.mightsee;
-		memcpy( might, prevmight, portalbytes );
 		if ( p->status == stat_done ) {
-			portalvis = (long *) p->portalvis;
+			portalvis = p->portalvis;
 		}
 		else{
-			portalvis = (long *) p->portalflood;
-		}
-		more = 0;
-		for ( j = 0; j < portallongs; j++ )
-		{
-			if ( *might ) {
-				*might &= *cansee++ & *portalvis++;
-				more |= ( *might & ~vis[j] );
-			}
-			else
-			{
-				cansee++;
-				portalvis++;
-			}
-			might++;
+			portalvis = p->portalflood;
 		}
+		more = PassageMightsee( stack.mightsee, prevstack->mightsee, portal, passage, portalvis, vis );
 
 		if ( !more ) {
 			// can't see anything new
+			thread->c_leafskip++;
 			continue;
 		}
 
@@ -765,6 +860,8 @@ void RecursivePassageFlow( vportal_t *portal, threaddata_t *thread, pstack_t *pr
 
 		stack.next = NULL;
 	}
+
+	FreeFlowMightsee( stack.mightsee, stack.depth );
 }
 
 /*
@@ -774,7 +871,6 @@ void RecursivePassageFlow( vportal_t *portal, threaddata_t *thread, pstack_t *pr
  */
 void PassageFlow( int portalnum ){
 	threaddata_t data;
-	int i;
 	vportal_t       *p;
 //	int				c_might, c_can;
 
@@ -789,6 +885,11 @@ void PassageFlow( int portalnum ){
 		return;
 	}
 
+	/* restored from the vis cache */
+	if ( p->status == stat_done ) {
+		return;
+	}
+
 	p->status = stat_working;
 
 //	c_might = CountBits (p->portalflood, numportals*2);
@@ -800,12 +901,21 @@ void PassageFlow( int portalnum ){
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for ( i = 0; i < portallongs; i++ )
-		( (long *)data.pstack_head.mightsee )[i] = ( (long *)p->portalflood )[i];
+	data.pstack_head.mightsee = FlowMightsee( 0 );
+	memcpy( data.pstack_head.mightsee, p->portalflood, portalbytes );
 
+	/* no PruneMightsee() here: this flow floods until the portalvis stops
+	   growing, so smaller portalvis sets only keep it going for longer */
 	RecursivePassageFlow( p, &data, &data.pstack_head );
 
+	ThreadLock();
+	c_chains += data.c_chains;
+	c_portalskip += data.c_portalskip;
+	c_leafskip += data.c_leafskip;
+	ThreadUnlock();
+
 	p->status = stat_done;
+	VisCacheCheckpoint();
 
 	/*
 	   c_can = CountBits (p->portalvis, numportals*2);
@@ -826,11 +936,12 @@ void RecursivePassagePortalFlow( vportal_t *portal, threaddata_t *thread, pstack
 	leaf_t      *leaf;
 	visPlane_t backplane;
 	passage_t   *passage, *nextpassage;
-	int i, j, n;
-	long        *might, *vis, *prevmight, *cansee, *portalvis, more;
+	int i, n;
+	byte        *vis, *portalvis;
+	qboolean more;
 	int pnum;
 
-//	thread->c_chains++;
+	thread->c_chains++;
 
 	leaf = &leafs[portal->leaf];
 //	CheckStack (leaf, thread);
@@ -841,13 +952,14 @@ void RecursivePassagePortalFlow( vportal_t *portal, threaddata_t *thread, pstack
 	stack.leaf = leaf;
 	stack.portal = NULL;
 	stack.depth = prevstack->depth + 1;
+	stack.mightsee = FlowMightsee( stack.depth );
 
 #ifdef SEPERATORCACHE
 	stack.numseperators[0] = 0;
 	stack.numseperators[1] = 0;
 #endif
 
-	vis = (long *)thread->base->portalvis;
+	vis = thread->base->portalvis;
 
 	passage = portal->passages;
 	nextpassage = passage;
@@ -862,35 +974,20 @@ void RecursivePassagePortalFlow( vportal_t *portal, threaddata_t *thread, pstack
 		pnum = p - portals;
 
 		if ( !( prevstack->mightsee[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {
+			thread->c_portalskip++;
 			continue;   // can't possibly see it
 
 		}
-		prevmight = (long *)prevstack->mightsee;
-		cansee = (long *)passage->cansee;
-		might = (long *)stack.mightsee;
-		memcpy( might, prevmight, portalbytes );
 		if ( p->status == stat_done ) {
-			portalvis = (long *) p->portalvis;
+			portalvis = p->portalvis;
 		}
 		else{
-			portalvis = (long *) p->portalflood;
-		}
-		more = 0;
-		for ( j = 0; j < portallongs; j++ )
-		{
-			if ( *might ) {
-				*might &= *cansee++ & *portalvis++;
-				more |= ( *might & ~vis[j] );
-			}
-			else
-			{
-				cansee++;
-				portalvis++;
-			}
-			might++;
+			portalvis = p->portalflood;
 		}
+		more = PassageMightsee( stack.mightsee, prevstack->mightsee, portal, passage, portalvis, vis );
 
 		if ( !more && ( thread->base->portalvis[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) { // can't see anything new
+			thread->c_leafskip++;
 			continue;
 		}
 
@@ -1029,6 +1126,8 @@ void RecursivePassagePortalFlow( vportal_t *portal, threaddata_t *thread, pstack
 		//
 		stack.next = NULL;
 	}
+
+	FreeFlowMightsee( stack.mightsee, stack.depth );
 }
 
 /*
@@ -1038,8 +1137,8 @@ void RecursivePassagePortalFlow( vportal_t *portal, threaddata_t *thread, pstack
  */
 void PassagePortalFlow( int portalnum ){
 	threaddata_t data;
-	int i;
 	vportal_t       *p;
+	int c_pruned;
 //	int				c_might, c_can;
 
 #ifdef MREDEBUG
@@ -1053,6 +1152,11 @@ void PassagePortalFlow( int portalnum ){
 		return;
 	}
 
+	/* restored from the vis cache */
+	if ( p->status == stat_done ) {
+		return;
+	}
+
 	p->status = stat_working;
 
 //	c_might = CountBits (p->portalflood, numportals*2);
@@ -1064,12 +1168,21 @@ void PassagePortalFlow( int portalnum ){
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
 	data.pstack_head.depth = 0;
-	for ( i = 0; i < portallongs; i++ )
-		( (long *)data.pstack_head.mightsee )[i] = ( (long *)p->portalflood )[i];
+	data.pstack_head.mightsee = FlowMightsee( 0 );
+	memcpy( data.pstack_head.mightsee, p->portalflood, portalbytes );
+	c_pruned = PruneMightsee( p, data.pstack_head.mightsee );
 
 	RecursivePassagePortalFlow( p, &data, &data.pstack_head );
 
+	ThreadLock();
+	c_chains += data.c_chains;
+	c_portalskip += data.c_portalskip;
+	c_leafskip += data.c_leafskip;
+	c_mightseepruned += c_pruned;
+	ThreadUnlock();
+
 	p->status = stat_done;
+	VisCacheCheckpoint();
 
 	/*
 	   c_can = CountBits (p->portalvis, numportals*2);
@@ -1322,6 +1435,54 @@ int AddSeperators( fixedWinding_t *source, fixedWinding_t *pass, qboolean flipcl
 	return numseperators;
 }
 
+/*
+   ===============
+   StorePassage
+
+   packs the non-empty blocks of a cansee bit string behind a new passage,
+   once -passagememory is used up only the runs of them are kept
+   ===============
+ */
+static passage_t *StorePassage( const byte *cansee, const passageRun_t *runs, int numruns, int numblocks ){
+	int i;
+	size_t size;
+	passage_t       *passage;
+	byte            *out;
+
+	size = sizeof( passage_t ) + numruns * sizeof( passageRun_t );
+
+	ThreadLock();
+	if ( visPassageMemory > 0.0f && c_passagebytes + size + ( numblocks << 3 ) > visPassageMemory * 1024.0 * 1024.0 ) {
+		numblocks = 0;
+		c_passagesdropped++;
+	}
+	size += numblocks << 3;
+	c_passagebytes += size;
+	ThreadUnlock();
+
+	/* the blocks go first to keep them 8 byte aligned */
+	passage = (passage_t *) safe_malloc( size );
+	passage->next = NULL;
+	passage->numruns = numruns;
+	passage->cansee = (byte *) ( passage + 1 );
+	passage->runs = (passageRun_t *) ( passage->cansee + ( numblocks << 3 ) );
+	memcpy( passage->runs, runs, numruns * sizeof( passageRun_t ) );
+
+	out = passage->cansee;
+	for ( i = 0; i < numruns && numblocks > 0; i++ )
+	{
+		memcpy( out, cansee + ( runs[i].start << 3 ), runs[i].count << 3 );
+		out += runs[i].count << 3;
+	}
+
+	/* over the cap */
+	if ( numblocks == 0 && numruns > 0 ) {
+		passage->cansee = NULL;
+	}
+
+	return passage;
+}
+
 /*
    ===============
    CreatePassages
@@ -1332,7 +1493,7 @@ int AddSeperators( fixedWinding_t *source, fixedWinding_t *pass, qboolean flipcl
    ===============
  */
 void CreatePassages( int portalnum ){
-	int i, j, k, n, numseperators, numsee;
+	int i, j, k, n, numseperators, numsee, numruns, numblocks, block;
 	float d;
 	vportal_t       *portal, *p, *target;
 	leaf_t          *leaf;
@@ -1340,6 +1501,8 @@ void CreatePassages( int portalnum ){
 	visPlane_t seperators[MAX_SEPERATORS * 2];
 	fixedWinding_t  *w;
 	fixedWinding_t in, out, *res;
+	byte            *cansee;
+	passageRun_t    *runs;
 
 
 #ifdef MREDEBUG
@@ -1353,6 +1516,15 @@ void CreatePassages( int portalnum ){
 		return;
 	}
 
+	/* passage runs index 64 bit blocks with shorts */
+	if ( ( portalbytes >> 3 ) > 0xFFFF ) {
+		Error( "CreatePassages: too many portals (%d)", numportals * 2 );
+	}
+
+	/* the full cansee bit string of a passage, followed by the runs of its non-empty blocks */
+	cansee = ThreadScratch( SCRATCH_VIS_PASSAGE, portalbytes + ( portalbytes >> 3 ) * sizeof( passageRun_t ) );
+	runs = (passageRun_t *) ( cansee + portalbytes );
+
 	lastpassage = NULL;
 	leaf = &leafs[portal->leaf];
 	for ( i = 0; i < leaf->numportals; i++ )
@@ -1362,24 +1534,21 @@ void CreatePassages( int portalnum ){
 			continue;
 		}
 
-		passage = (passage_t *) safe_malloc( sizeof( passage_t ) + portalbytes );
-		memset( passage, 0, sizeof( passage_t ) + portalbytes );
+		memset( cansee, 0, portalbytes );
+		numruns = 0;
+		numblocks = 0;
 		numseperators = AddSeperators( portal->winding, target->winding, qfalse, seperators, MAX_SEPERATORS * 2 );
 		numseperators += AddSeperators( target->winding, portal->winding, qtrue, &seperators[numseperators], MAX_SEPERATORS * 2 - numseperators );
 
-		passage->next = NULL;
-		if ( lastpassage ) {
-			lastpassage->next = passage;
-		}
-		else{
-			portal->passages = passage;
-		}
-		lastpassage = passage;
-
 		numsee = 0;
 		//create the passage->cansee
 		for ( j = 0; j < numportals * 2; j++ )
 		{
+			/* skip whole 64 portal blocks where no portal is in both floods */
+			if ( !( j & 63 ) && !VisBitsAny( target->portalflood + ( j >> 3 ), portal->portalflood + ( j >> 3 ), 8 ) ) {
+				j += 63;
+				continue;
+			}
 			p = &portals[j];
 			if ( p->removed ) {
 				continue;
@@ -1450,14 +1619,37 @@ void CreatePassages( int portalnum ){
 			if ( k < numseperators ) {
 				continue;
 			}
-			passage->cansee[j >> 3] |= ( 1 << ( j & 7 ) );
+			cansee[j >> 3] |= ( 1 << ( j & 7 ) );
 			numsee++;
+
+			/* j only goes up, so a new block either extends the last run or starts one */
+			block = j >> 6;
+			if ( numruns == 0 || runs[numruns - 1].start + runs[numruns - 1].count < block ) {
+				runs[numruns].start = block;
+				runs[numruns].count = 1;
+				numruns++;
+				numblocks++;
+			}
+			else if ( runs[numruns - 1].start + runs[numruns - 1].count == block ) {
+				runs[numruns - 1].count++;
+				numblocks++;
+			}
+		}
+
+		passage = StorePassage( cansee, runs, numruns, numblocks );
+		if ( lastpassage ) {
+			lastpassage->next = passage;
 		}
+		else{
+			portal->passages = passage;
+		}
+		lastpassage = passage;
 	}
 }
 
 void PassageMemory( void ){
-	int i, j, totalmem, totalportals;
+	int i, j, totalportals;
+	double totalmem;
 	vportal_t *portal, *target;
 	leaf_t *leaf;
 
@@ -1481,7 +1673,21 @@ void PassageMemory( void ){
 		}
 	}
 	Sys_Printf( "%7i average number of passages per leaf\n", totalportals / numportals );
-	Sys_Printf( "%7i MB required passage memory\n", totalmem >> 10 >> 10 );
+	Sys_Printf( "%7.0f MB passage memory without packing\n", totalmem / ( 1024.0 * 1024.0 ) );
+}
+
+/*
+   ===============
+   PassageMemoryUsed
+
+   what CreatePassages actually kept
+   ===============
+ */
+void PassageMemoryUsed( void ){
+	Sys_Printf( "%7.0f MB passage memory used\n", c_passagebytes / ( 1024.0 * 1024.0 ) );
+	if ( c_passagesdropped > 0 ) {
+		Sys_Printf( "%7i passages over -passagememory only kept their runs\n", c_passagesdropped );
+	}
 }
 
 /*
@@ -1533,34 +1739,153 @@ int c_flood, c_vis;
    ==================
    SimpleFlood
 
+   flood fills the portals of srcportal->portalfront reachable from leafnum
+   into srcportal->portalflood. walks the packed leaf portal lists from
+   SetupBasePortalVis() with a per thread stack instead of recursing through
+   the portal structs
    ==================
  */
+static int *leafPortalStart, *leafPortalNums, *portalLeafs;
+
 void SimpleFlood( vportal_t *srcportal, int leafnum ){
-	int i;
-	leaf_t  *leaf;
-	vportal_t   *p;
-	int pnum;
+	int i, end, pnum, numStack;
+	int         *stack;
+	byte        *front, *flood;
 
-	leaf = &leafs[leafnum];
 
-	for ( i = 0; i < leaf->numportals; i++ )
+	stack = ThreadScratch( SCRATCH_VIS_FLOOD, numportals * 2 * sizeof( *stack ) );
+	front = srcportal->portalfront;
+	flood = srcportal->portalflood;
+
+	numStack = 0;
+	for ( ;; )
 	{
-		p = leaf->portals[i];
-		if ( p->removed ) {
-			continue;
+		end = leafPortalStart[leafnum + 1];
+		for ( i = leafPortalStart[leafnum]; i < end; i++ )
+		{
+			pnum = leafPortalNums[i];
+			if ( !( front[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {
+				continue;
+			}
+			if ( flood[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) {
+				continue;
+			}
+			flood[pnum >> 3] |= ( 1 << ( pnum & 7 ) );
+			stack[numStack++] = pnum;
 		}
-		pnum = p - portals;
-		if ( !( srcportal->portalfront[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) ) {
-			continue;
+		if ( numStack == 0 ) {
+			break;
 		}
+		leafnum = portalLeafs[stack[--numStack]];
+	}
+}
 
-		if ( srcportal->portalflood[pnum >> 3] & ( 1 << ( pnum & 7 ) ) ) {
-			continue;
+/*
+   BASEVIS_BLOCK portals share a bounding sphere, one 64 bit word of
+   portalfront. SPHERE_EPSILON covers the float error of the point tests, so
+   the sphere tests only decide pairs the point tests would decide the same way
+ */
+#define BASEVIS_BLOCK           64
+#define SPHERE_EPSILON          1.0f
+
+typedef struct
+{
+	vec3_t origin;
+	float radius;                       /* < 0 for removed portals and empty blocks */
+	visPlane_t plane;
+}
+visSphere_t;
+
+static visSphere_t  *portalSpheres, *blockSpheres;
+static int numBlocks;
+
+/*
+   ==============
+   SetupBasePortalVis
+
+   packs the portal spheres and planes that BasePortalVis tests into one
+   array and puts a sphere around every block of portals. portals are
+   numbered in bsp tree order, so a block is mostly one part of the map and
+   a portal can throw out all blocks behind it with a single plane test.
+   also packs the leaf portal lists for SimpleFlood
+   ==============
+ */
+void SetupBasePortalVis( void ){
+	int i, j, b, n, end;
+	vportal_t   *p;
+	leaf_t      *leaf;
+	visSphere_t *s, *bs;
+	vec3_t dir;
+	float r;
+
+
+	/* leaves merged away keep their old lists, so a portal can be in more than one */
+	n = 0;
+	for ( i = 0; i < portalclusters; i++ )
+		n += leafs[i].numportals;
+	leafPortalStart = safe_malloc( ( portalclusters + 1 ) * sizeof( *leafPortalStart ) );
+	leafPortalNums = safe_malloc( ( n > 0 ? n : 1 ) * sizeof( *leafPortalNums ) );
+	portalLeafs = safe_malloc( numportals * 2 * sizeof( *portalLeafs ) );
+	n = 0;
+	for ( i = 0, leaf = leafs; i < portalclusters; i++, leaf++ )
+	{
+		leafPortalStart[i] = n;
+		for ( j = 0; j < leaf->numportals; j++ )
+		{
+			if ( !leaf->portals[j]->removed ) {
+				leafPortalNums[n++] = leaf->portals[j] - portals;
+			}
+		}
+	}
+	leafPortalStart[portalclusters] = n;
+	for ( i = 0, p = portals; i < numportals * 2; i++, p++ )
+		portalLeafs[i] = p->leaf;
+
+	portalSpheres = safe_malloc( numportals * 2 * sizeof( *portalSpheres ) );
+	numBlocks = ( numportals * 2 + BASEVIS_BLOCK - 1 ) / BASEVIS_BLOCK;
+	blockSpheres = safe_malloc( numBlocks * sizeof( *blockSpheres ) );
+	memset( blockSpheres, 0, numBlocks * sizeof( *blockSpheres ) );
+
+	for ( i = 0, p = portals; i < numportals * 2; i++, p++ )
+	{
+		s = &portalSpheres[i];
+		VectorCopy( p->origin, s->origin );
+		s->radius = p->removed ? -1.0f : p->radius;
+		s->plane = p->plane;
+	}
+
+	for ( b = 0; b < numBlocks; b++ )
+	{
+		bs = &blockSpheres[b];
+		end = ( b + 1 ) * BASEVIS_BLOCK;
+		if ( end > numportals * 2 ) {
+			end = numportals * 2;
 		}
 
-		srcportal->portalflood[pnum >> 3] |= ( 1 << ( pnum & 7 ) );
+		n = 0;
+		for ( j = b * BASEVIS_BLOCK; j < end; j++ )
+		{
+			if ( portalSpheres[j].radius >= 0.0f ) {
+				VectorAdd( bs->origin, portalSpheres[j].origin, bs->origin );
+				n++;
+			}
+		}
+		if ( n == 0 ) {
+			bs->radius = -1.0f;
+			continue;
+		}
+		VectorScale( bs->origin, 1.0f / n, bs->origin );
 
-		SimpleFlood( srcportal, p->leaf );
+		for ( j = b * BASEVIS_BLOCK; j < end; j++ )
+		{
+			if ( portalSpheres[j].radius >= 0.0f ) {
+				VectorSubtract( portalSpheres[j].origin, bs->origin, dir );
+				r = VectorLength( dir ) + portalSpheres[j].radius;
+				if ( r > bs->radius ) {
+					bs->radius = r;
+				}
+			}
+		}
 	}
 }
 
@@ -1570,8 +1895,9 @@ void SimpleFlood( vportal_t *srcportal, int leafnum ){
    ==============
  */
 void BasePortalVis( int portalnum ){
-	int j, k;
+	int j, k, b, end;
 	vportal_t   *tp, *p;
+	visSphere_t *s;
 	float d;
 	fixedWinding_t  *w;
 	vec3_t dir;
@@ -1592,62 +1918,91 @@ void BasePortalVis( int portalnum ){
 	p->portalvis = safe_malloc( portalbytes );
 	memset( p->portalvis, 0, portalbytes );
 
-	for ( j = 0, tp = portals; j < numportals * 2; j++, tp++ )
+	for ( b = 0; b < numBlocks; b++ )
 	{
-		if ( j == portalnum ) {
+		/* nothing in a block entirely behind the portal can be in front of it */
+		s = &blockSpheres[b];
+		if ( s->radius < 0.0f || DotProduct( s->origin, p->plane.normal ) - p->plane.dist + s->radius < ON_EPSILON - SPHERE_EPSILON ) {
 			continue;
 		}
-		if ( tp->removed ) {
-			continue;
-		}
-
-		/* ydnar: this is old farplane vis code from mre */
-		/*
-		   if (farplanedist >= 0)
-		   {
-		    vec3_t dir;
-		    VectorSubtract(p->origin, tp->origin, dir);
-		    if (VectorLength(dir) > farplanedist - p->radius - tp->radius)
-		        continue;
-		   }
-		 */
 
-		/* ydnar: this is known-to-be-working farplane code */
-		if ( !p->sky && !tp->sky && farPlaneDist > 0.0f ) {
-			VectorSubtract( p->origin, tp->origin, dir );
-			if ( VectorLength( dir ) - p->radius - tp->radius > farPlaneDist ) {
+		end = ( b + 1 ) * BASEVIS_BLOCK;
+		if ( end > numportals * 2 ) {
+			end = numportals * 2;
+		}
+		for ( j = b * BASEVIS_BLOCK; j < end; j++ )
+		{
+			if ( j == portalnum ) {
 				continue;
 			}
-		}
+			s = &portalSpheres[j];
+			if ( s->radius < 0.0f ) {
+				continue;
+			}
+			tp = portals + j;
+
+			/* ydnar: this is old farplane vis code from mre */
+			/*
+			   if (farplanedist >= 0)
+			   {
+			    vec3_t dir;
+			    VectorSubtract(p->origin, tp->origin, dir);
+			    if (VectorLength(dir) > farplanedist - p->radius - tp->radius)
+			        continue;
+			   }
+			 */
+
+			/* ydnar: this is known-to-be-working farplane code */
+			if ( farPlaneDist > 0.0f && !p->sky && !tp->sky ) {
+				VectorSubtract( p->origin, s->origin, dir );
+				if ( VectorLength( dir ) - p->radius - s->radius > farPlaneDist ) {
+					continue;
+				}
+			}
 
+			/* tp needs a point on the front of p, the sphere settles most pairs */
+			d = DotProduct( s->origin, p->plane.normal ) - p->plane.dist;
+			if ( d + s->radius < ON_EPSILON - SPHERE_EPSILON ) {
+				continue;
+			}
+			if ( d - s->radius <= ON_EPSILON + SPHERE_EPSILON ) {
+				w = tp->winding;
+				for ( k = 0; k < w->numpoints; k++ )
+				{
+					d = DotProduct( w->points[k], p->plane.normal )
+					    - p->plane.dist;
+					if ( d > ON_EPSILON ) {
+						break;
+					}
+				}
+				if ( k == w->numpoints ) {
+					continue;   // no points on front
 
-		w = tp->winding;
-		for ( k = 0; k < w->numpoints; k++ )
-		{
-			d = DotProduct( w->points[k], p->plane.normal )
-			    - p->plane.dist;
-			if ( d > ON_EPSILON ) {
-				break;
+				}
 			}
-		}
-		if ( k == w->numpoints ) {
-			continue;   // no points on front
 
-		}
-		w = p->winding;
-		for ( k = 0; k < w->numpoints; k++ )
-		{
-			d = DotProduct( w->points[k], tp->plane.normal )
-			    - tp->plane.dist;
-			if ( d < -ON_EPSILON ) {
-				break;
+			/* and p a point on the back of tp */
+			d = DotProduct( p->origin, s->plane.normal ) - s->plane.dist;
+			if ( d - p->radius > -ON_EPSILON + SPHERE_EPSILON ) {
+				continue;
 			}
-		}
-		if ( k == w->numpoints ) {
-			continue;   // no points on front
+			if ( d + p->radius >= -ON_EPSILON - SPHERE_EPSILON ) {
+				w = p->winding;
+				for ( k = 0; k < w->numpoints; k++ )
+				{
+					d = DotProduct( w->points[k], s->plane.normal )
+					    - s->plane.dist;
+					if ( d < -ON_EPSILON ) {
+						break;
+					}
+				}
+				if ( k == w->numpoints ) {
+					continue;   // no points on front
 
+				}
+			}
+			p->portalfront[j >> 3] |= ( 1 << ( j & 7 ) );
 		}
-		p->portalfront[j >> 3] |= ( 1 << ( j & 7 ) );
 	}
 
 	SimpleFlood( p, p->leaf );
@@ -1679,15 +2034,15 @@ void BasePortalVis( int portalnum ){
 
    ==================
  */
-void RecursiveLeafBitFlow( int leafnum, byte *mightsee, byte *cansee ){
+void RecursiveLeafBitFlow( int leafnum, byte *mightsee, byte *cansee, int depth ){
 	vportal_t   *p;
 	leaf_t      *leaf;
-	int i, j;
-	long more;
+	int i;
 	int pnum;
-	byte newmight[MAX_PORTALS / 8];
+	byte        *newmight;
 
 	leaf = &leafs[leafnum];
+	newmight = FlowMightsee( depth );
 
 	// check all portals for flowing into other leafs
 	for ( i = 0; i < leaf->numportals; i++ )
@@ -1704,22 +2059,16 @@ void RecursiveLeafBitFlow( int leafnum, byte *mightsee, byte *cansee ){
 		}
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for ( j = 0; j < portallongs; j++ )
-		{
-			( (long *)newmight )[j] = ( (long *)mightsee )[j]
-			                          & ( (long *)p->portalflood )[j];
-			more |= ( (long *)newmight )[j] & ~( (long *)cansee )[j];
-		}
-
-		if ( !more ) {
+		if ( !VisBitsAndMore( newmight, mightsee, p->portalflood, cansee, portalbytes ) ) {
 			continue;   // can't see anything new
 
 		}
 		cansee[pnum >> 3] |= ( 1 << ( pnum & 7 ) );
 
-		RecursiveLeafBitFlow( p->leaf, newmight, cansee );
+		RecursiveLeafBitFlow( p->leaf, newmight, cansee, depth + 1 );
 	}
+
+	FreeFlowMightsee( newmight, depth );
 }
 
 /*
@@ -1736,7 +2085,7 @@ void BetterPortalVis( int portalnum ){
 		return;
 	}
 
-	RecursiveLeafBitFlow( p->leaf, p->portalflood, p->portalvis );
+	RecursiveLeafBitFlow( p->leaf, p->portalflood, p->portalvis, 0 );
 
 	// build leaf vis information
 	p->nummightsee = CountBits( p->portalvis, numportals * 2 );
@@ -0,0 +1,717 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define VISNET_C
+
+
+
+/* dependencies */
+#include "vmap.h"
+#include "l_net/l_net.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+   distributed vis
+
+   -vis -coordinator <port> runs the flow like any other vis, but also listens
+   on port for -vis -worker <host:port> processes. every process loads the same
+   bsp and portal file and runs BasePortalVis and CreatePassages itself, then
+   the coordinator hands out ranges of portals in sorted order: a worker flows
+   its range with its own threads, sends the portalvis bits back and asks for
+   more. the coordinator threads take single portals off the same queue and
+   poll the workers between portals, so the workers never wait for a whole
+   range of the coordinator's. a range is a few portals per worker thread, and
+   the ranges of a worker that drops out go back into the queue.
+
+   before each range the coordinator sends the worker the finished portals in
+   the portalflood of the range it does not have yet, which are the only ones
+   its flow can clip against. what to send is picked under the thread lock,
+   the sending itself happens after it is released, so a slow socket does not
+   hold up the flow threads. a worker only talks after it read the whole
+   answer, so neither side can block the other with a full socket. a worker
+   that has not finished its range after -workertimeout seconds is dropped.
+   all traffic uses the l_net messages, so the bit vectors go out in slices.
+
+   ------------------------------------------------------------------------------- */
+
+#define VISNET_VERSION          2
+
+#define VISNET_HELLO            1       /* worker: version, input hash, range size */
+#define VISNET_RANGE            2       /* coordinator: count, portal numbers, a count of 0 ends the worker */
+#define VISNET_RESULT           3       /* both: portal, first word, words */
+#define VISNET_REQUEST          4       /* worker: done with the last range */
+
+#define VISNET_RANGE_THREAD     4       /* portals per worker thread in a range */
+#define VISNET_MAX_RANGE        240     /* portal numbers that fit in one message */
+#define VISNET_RESULT_WORDS     240
+#define MAX_VIS_WORKERS         64
+
+typedef struct visWorker_s
+{
+	socket_t            *sock;
+	address_t address;
+	qboolean hello, idle;
+	qboolean sending;                   /* a thread is sending to it outside the lock */
+	double deadline;
+	byte                *hasBits;       /* finished portals the worker has */
+	int                 *sendPortals;   /* finished portals to send with the next range */
+	int numSend;
+	int rangeSize;
+	int numPortals;
+	int portals[ VISNET_MAX_RANGE ];
+}
+visWorker_t;
+
+static void ( *flowFunc )( int );
+static int                  *sortIndex;
+static unsigned int inputHash[ 2 ];
+static int rangePortals[ VISNET_MAX_RANGE ], numRangePortals;
+
+/* coordinator */
+static visWorker_t workers[ MAX_VIS_WORKERS ];
+static int numWorkers;
+static int                  *queue;
+static int queueHead, queueTail, numQueue;
+static byte                 *doneBits;
+static int numDone;
+static socket_t             *listenSock;
+
+
+
+/*
+   SetupFlow()
+   does the per portal setup of the chosen flow and picks the flow function
+ */
+
+static void SetupFlow( void ){
+	int i;
+
+
+	if ( noPassageVis ) {
+		flowFunc = PortalFlow;
+	}
+	else
+	{
+		PassageMemory();
+		Sys_Printf( "\n--- CreatePassages (%d) ---\n", numportals * 2 );
+		RunThreadsOnIndividual( numportals * 2, qtrue, CreatePassages );
+		PassageMemoryUsed();
+		flowFunc = passageVisOnly ? PassageFlow : PassagePortalFlow;
+	}
+
+	/* the flows take sorted_portals indexes */
+	sortIndex = safe_malloc( numportals * 2 * sizeof( *sortIndex ) );
+	for ( i = 0; i < numportals * 2; i++ )
+		sortIndex[ sorted_portals[ i ] - portals ] = i;
+
+	/* coordinator and workers have to agree on the input and the flow */
+	inputHash[ 0 ] = 2166136261u;
+	inputHash[ 1 ] = VISNET_VERSION;
+	HashBytes( inputHash, &numportals, sizeof( numportals ) );
+	HashBytes( inputHash, &portalclusters, sizeof( portalclusters ) );
+	HashBytes( inputHash, &noPassageVis, sizeof( noPassageVis ) );
+	HashBytes( inputHash, &passageVisOnly, sizeof( passageVisOnly ) );
+	HashBytes( inputHash, &farPlaneDist, sizeof( farPlaneDist ) );
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		HashBytes( inputHash, &portals[ i ].leaf, sizeof( portals[ i ].leaf ) );
+		HashBytes( inputHash, &portals[ i ].removed, sizeof( portals[ i ].removed ) );
+		HashBytes( inputHash, portals[ i ].winding->points, portals[ i ].winding->numpoints * sizeof( portals[ i ].winding->points[ 0 ] ) );
+	}
+}
+
+
+
+/*
+   RangeFlow()
+   RunThreadsOnIndividual() callback over the current range
+ */
+
+static void RangeFlow( int num ){
+	flowFunc( sortIndex[ rangePortals[ num ] ] );
+}
+
+
+
+/*
+   WaitMessage()
+   blocks until a whole message came in, returns qfalse if the connection went away
+ */
+
+static qboolean WaitMessage( socket_t *sock, netmessage_t *msg ){
+	int size;
+
+
+	while ( ( size = Net_Receive( sock, msg ) ) == 0 )
+		Sys_Sleep( 1 );
+	if ( size < 0 ) {
+		return qfalse;
+	}
+	NMSG_ReadStart( msg );
+	return qtrue;
+}
+
+
+
+/*
+   SendPortalBits()
+   sends the portalvis of a portal in slices, 4 bytes per long in file byte order
+ */
+
+static void SendPortalBits( socket_t *sock, int num ){
+	int i, first, count;
+	byte                *bits;
+	netmessage_t msg;
+
+
+	for ( first = 0; first < portalbytes / 4; first += count )
+	{
+		count = portalbytes / 4 - first;
+		if ( count > VISNET_RESULT_WORDS ) {
+			count = VISNET_RESULT_WORDS;
+		}
+		NMSG_Clear( &msg );
+		NMSG_WriteLong( &msg, VISNET_RESULT );
+		NMSG_WriteLong( &msg, num );
+		NMSG_WriteLong( &msg, first );
+		NMSG_WriteLong( &msg, count );
+		for ( i = 0; i < count; i++ )
+		{
+			bits = portals[ num ].portalvis + ( first + i ) * 4;
+			NMSG_WriteLong( &msg, bits[ 0 ] | ( bits[ 1 ] << 8 ) | ( bits[ 2 ] << 16 ) | ( bits[ 3 ] << 24 ) );
+		}
+		Net_Send( sock, &msg );
+	}
+}
+
+
+
+/*
+   ReadPortalBits()
+   stores a slice sent by SendPortalBits(), returns the portal once its last slice is in, -1 before that and -2 for garbage
+ */
+
+static int ReadPortalBits( netmessage_t *msg ){
+	int i, w, num, first, count;
+	byte                *bits;
+
+
+	num = NMSG_ReadLong( msg );
+	first = NMSG_ReadLong( msg );
+	count = NMSG_ReadLong( msg );
+	if ( num < 0 || num >= numportals * 2 || first < 0 || count < 0 || ( first + count ) * 4 > portalbytes ) {
+		return -2;
+	}
+	for ( i = 0; i < count; i++ )
+	{
+		w = NMSG_ReadLong( msg );
+		if ( portals[ num ].status == stat_done ) {
+			continue;       /* finished twice, the first answer stays */
+		}
+		bits = portals[ num ].portalvis + ( first + i ) * 4;
+		bits[ 0 ] = w & 0xFF;
+		bits[ 1 ] = ( w >> 8 ) & 0xFF;
+		bits[ 2 ] = ( w >> 16 ) & 0xFF;
+		bits[ 3 ] = ( w >> 24 ) & 0xFF;
+	}
+	return ( first + count ) * 4 == portalbytes ? num : -1;
+}
+
+
+
+/*
+   FinishPortal()
+   records a portal finished by the coordinator (NULL) or a worker, called with the thread lock held
+ */
+
+static void FinishPortal( int num, visWorker_t *worker ){
+	portals[ num ].status = stat_done;
+	doneBits[ num >> 3 ] |= ( 1 << ( num & 7 ) );
+	if ( worker != NULL ) {
+		worker->hasBits[ num >> 3 ] |= ( 1 << ( num & 7 ) );
+	}
+	numDone++;
+}
+
+
+
+/*
+   QueueRange()
+   takes the next range off the queue for a worker and picks the finished portals it needs with it,
+   or marks it idle if the queue is empty. called with the thread lock held, SendRange() does the sending
+ */
+
+static void QueueRange( visWorker_t *worker ){
+	int i, j, k;
+	byte need;
+	const byte          *flood;
+
+
+	worker->numPortals = 0;
+	worker->numSend = 0;
+	while ( numQueue > 0 && worker->numPortals < worker->rangeSize )
+	{
+		worker->portals[ worker->numPortals++ ] = queue[ queueHead ];
+		queueHead = ( queueHead + 1 ) % ( numportals * 2 );
+		numQueue--;
+	}
+	worker->idle = ( worker->numPortals == 0 );
+	if ( worker->idle ) {
+		return;
+	}
+	worker->deadline = I_FloatTime() + visWorkerTimeout;
+
+	/* the flow of a portal only clips against the finished portals in its flood */
+	for ( i = 0; i < worker->numPortals; i++ )
+	{
+		flood = portals[ worker->portals[ i ] ].portalflood;
+		for ( j = 0; j < portalbytes; j++ )
+		{
+			need = flood[ j ] & doneBits[ j ] & ~worker->hasBits[ j ];
+			if ( need == 0 ) {
+				continue;
+			}
+			worker->hasBits[ j ] |= need;
+			for ( k = 0; k < 8; k++ )
+			{
+				if ( need & ( 1 << k ) ) {
+					worker->sendPortals[ worker->numSend++ ] = j * 8 + k;
+				}
+			}
+		}
+	}
+	worker->sending = qtrue;
+}
+
+
+
+/*
+   SendRange()
+   sends a worker what QueueRange() picked, called without the thread lock. the bits of a finished portal do not change any more
+ */
+
+static void SendRange( visWorker_t *worker ){
+	int i;
+	netmessage_t msg;
+
+
+	for ( i = 0; i < worker->numSend; i++ )
+		SendPortalBits( worker->sock, worker->sendPortals[ i ] );
+
+	NMSG_Clear( &msg );
+	NMSG_WriteLong( &msg, VISNET_RANGE );
+	NMSG_WriteLong( &msg, worker->numPortals );
+	for ( i = 0; i < worker->numPortals; i++ )
+		NMSG_WriteLong( &msg, worker->portals[ i ] );
+	Net_Send( worker->sock, &msg );
+}
+
+
+
+/*
+   DropWorker()
+   disconnects a worker and queues its unfinished portals again
+ */
+
+static void DropWorker( visWorker_t *worker ){
+	int i;
+
+
+	for ( i = 0; i < worker->numPortals; i++ )
+	{
+		if ( portals[ worker->portals[ i ] ].status != stat_done ) {
+			queue[ queueTail ] = worker->portals[ i ];
+			queueTail = ( queueTail + 1 ) % ( numportals * 2 );
+			numQueue++;
+		}
+	}
+	Sys_Printf( "Vis worker %s dropped out, %d portals requeued\n", worker->address.ip, worker->numPortals );
+	Net_Disconnect( worker->sock );
+	worker->sock = NULL;
+	worker->numPortals = 0;
+	free( worker->hasBits );
+	free( worker->sendPortals );
+	worker->hasBits = NULL;
+	worker->sendPortals = NULL;
+}
+
+
+
+/*
+   ServiceWorker()
+   handles everything a worker sent, called with the thread lock held
+ */
+
+static void ServiceWorker( visWorker_t *worker ){
+	int i, size, type;
+	netmessage_t msg;
+	unsigned int hash[ 2 ];
+
+
+	while ( !worker->sending && worker->sock != NULL && ( size = Net_Receive( worker->sock, &msg ) ) != 0 )
+	{
+		if ( size < 0 ) {
+			DropWorker( worker );
+			break;
+		}
+		NMSG_ReadStart( &msg );
+		type = NMSG_ReadLong( &msg );
+
+		if ( type == VISNET_HELLO && !worker->hello ) {
+			i = NMSG_ReadLong( &msg );
+			hash[ 0 ] = NMSG_ReadLong( &msg );
+			hash[ 1 ] = NMSG_ReadLong( &msg );
+			worker->rangeSize = NMSG_ReadLong( &msg );
+			if ( i != VISNET_VERSION || hash[ 0 ] != inputHash[ 0 ] || hash[ 1 ] != inputHash[ 1 ] ) {
+				Sys_FPrintf( SYS_WRN, "WARNING: Vis worker %s has a different map or options, ignoring it\n", worker->address.ip );
+				DropWorker( worker );
+				break;
+			}
+			if ( worker->rangeSize < 1 || worker->rangeSize > VISNET_MAX_RANGE ) {
+				worker->rangeSize = VISNET_MAX_RANGE;
+			}
+			Sys_Printf( "Vis worker %s joined, %d portals per range\n", worker->address.ip, worker->rangeSize );
+			worker->hello = qtrue;
+			QueueRange( worker );
+		}
+		else if ( type == VISNET_RESULT && worker->hello ) {
+			i = ReadPortalBits( &msg );
+			if ( i == -2 ) {
+				DropWorker( worker );
+				break;
+			}
+			if ( i >= 0 && portals[ i ].status != stat_done ) {
+				FinishPortal( i, worker );
+			}
+		}
+		else if ( type == VISNET_REQUEST && worker->hello ) {
+			QueueRange( worker );
+		}
+		else
+		{
+			DropWorker( worker );
+			break;
+		}
+	}
+}
+
+
+
+/*
+   ServiceWorkers()
+   accepts new workers, handles everything the workers sent and drops the ones past their deadline.
+   called with the thread lock held, returns the number of workers put in sendTo, which the caller
+   has to SendRange() after releasing the lock and then clear their sending flag
+ */
+
+static int ServiceWorkers( visWorker_t **sendTo ){
+	int i, numSendTo;
+	socket_t            *sock;
+	double now;
+
+
+	/* new workers */
+	while ( ( sock = Net_Accept( listenSock ) ) != NULL )
+	{
+		for ( i = 0; i < MAX_VIS_WORKERS && workers[ i ].sock != NULL; i++ ) ;
+		if ( i == MAX_VIS_WORKERS ) {
+			Net_Disconnect( sock );
+			continue;
+		}
+		memset( &workers[ i ], 0, sizeof( workers[ i ] ) );
+		workers[ i ].sock = sock;
+		workers[ i ].hasBits = safe_malloc( portalbytes );
+		memset( workers[ i ].hasBits, 0, portalbytes );
+		workers[ i ].sendPortals = safe_malloc( numportals * 2 * sizeof( *workers[ i ].sendPortals ) );
+		Net_SocketToAddress( sock, &workers[ i ].address );
+		numWorkers = i + 1 > numWorkers ? i + 1 : numWorkers;
+	}
+
+	/* results and requests */
+	numSendTo = 0;
+	now = I_FloatTime();
+	for ( i = 0; i < numWorkers; i++ )
+	{
+		if ( workers[ i ].sock == NULL || workers[ i ].sending ) {
+			continue;
+		}
+		ServiceWorker( &workers[ i ] );
+		if ( workers[ i ].sock == NULL ) {
+			continue;
+		}
+		if ( !workers[ i ].sending && workers[ i ].hello && !workers[ i ].idle && visWorkerTimeout > 0.0f && now > workers[ i ].deadline ) {
+			Sys_FPrintf( SYS_WRN, "WARNING: Vis worker %s did not finish its range in %g seconds\n", workers[ i ].address.ip, visWorkerTimeout );
+			DropWorker( &workers[ i ] );
+			continue;
+		}
+		if ( workers[ i ].idle && numQueue > 0 ) {
+			QueueRange( &workers[ i ] );
+		}
+		if ( workers[ i ].sending ) {
+			sendTo[ numSendTo++ ] = &workers[ i ];
+		}
+	}
+	return numSendTo;
+}
+
+
+
+/*
+   CoordinatorFlow()
+   RunThreadsOnIndividual() callback, one per coordinator thread: polls the
+   workers and flows the next queued portal until every portal is done
+ */
+
+static void CoordinatorFlow( int threadnum ){
+	int i, num, total, numSendTo;
+	visWorker_t         *sendTo[ MAX_VIS_WORKERS ];
+
+
+	( void ) threadnum;
+	total = numportals * 2;
+	while ( 1 )
+	{
+		ThreadLock();
+		numSendTo = ServiceWorkers( sendTo );
+		num = -1;
+		if ( numQueue > 0 ) {
+			num = queue[ queueHead ];
+			queueHead = ( queueHead + 1 ) % total;
+			numQueue--;
+		}
+		else if ( numDone >= total && numSendTo == 0 ) {
+			ThreadUnlock();
+			break;
+		}
+		ThreadUnlock();
+
+		/* talk to the workers outside the lock */
+		if ( numSendTo > 0 ) {
+			for ( i = 0; i < numSendTo; i++ )
+				SendRange( sendTo[ i ] );
+			ThreadLock();
+			for ( i = 0; i < numSendTo; i++ )
+				sendTo[ i ]->sending = qfalse;
+			ThreadUnlock();
+		}
+		VisCacheCheckpoint();
+
+		/* the rest is out with the workers */
+		if ( num < 0 ) {
+			Sys_Sleep( 1 );
+			continue;
+		}
+
+		flowFunc( sortIndex[ num ] );
+		ThreadLock();
+		FinishPortal( num, NULL );
+		ThreadUnlock();
+	}
+}
+
+
+
+/*
+   CalcDistributedVis()
+   the coordinator side of -vis -coordinator
+ */
+
+void CalcDistributedVis( void ){
+	int i, total;
+	netmessage_t msg;
+	double start;
+
+
+	SetupFlow();
+
+	/* queue every portal not restored from the vis cache, in sorted order */
+	total = numportals * 2;
+	queue = safe_malloc( total * sizeof( *queue ) );
+	doneBits = safe_malloc( portalbytes );
+	memset( doneBits, 0, portalbytes );
+	queueHead = queueTail = numQueue = numDone = 0;
+	for ( i = 0; i < total; i++ )
+	{
+		if ( sorted_portals[ i ]->status == stat_done ) {
+			FinishPortal( sorted_portals[ i ] - portals, NULL );
+			continue;
+		}
+		queue[ queueTail++ ] = sorted_portals[ i ] - portals;
+		numQueue++;
+	}
+	queueTail %= total;
+
+	Net_Setup();
+	listenSock = Net_ListenSocket( visNetPort );
+	if ( listenSock == NULL ) {
+		Error( "Unable to listen for vis workers on port %d", visNetPort );
+	}
+	Sys_Printf( "\n--- CalcDistributedVis (%d) ---\n", total );
+	Sys_Printf( "Waiting for vis workers on port %d\n", visNetPort );
+
+	memset( workers, 0, sizeof( workers ) );
+	numWorkers = 0;
+	start = I_FloatTime();
+	if ( numthreads == -1 ) {
+		ThreadSetDefault();
+	}
+	RunThreadsOnIndividual( numthreads, qfalse, CoordinatorFlow );
+
+	/* send the workers home */
+	for ( i = 0; i < numWorkers; i++ )
+	{
+		if ( workers[ i ].sock == NULL ) {
+			continue;
+		}
+		NMSG_Clear( &msg );
+		NMSG_WriteLong( &msg, VISNET_RANGE );
+		NMSG_WriteLong( &msg, 0 );
+		Net_Send( workers[ i ].sock, &msg );
+		Net_Disconnect( workers[ i ].sock );
+		free( workers[ i ].hasBits );
+		free( workers[ i ].sendPortals );
+	}
+	Net_Disconnect( listenSock );
+	listenSock = NULL;
+
+	Sys_Printf( "Distributed vis done in %.0f seconds\n", I_FloatTime() - start );
+	free( queue );
+	free( doneBits );
+	free( sortIndex );
+}
+
+
+
+/*
+   RunVisWorker()
+   the worker side of -vis -worker, flows the ranges the coordinator hands out until it is done
+ */
+
+void RunVisWorker( void ){
+	int i, j, type, count, rangeSize, numRanges, numFlowed, numReceived;
+	qboolean finished;
+	address_t address;
+	socket_t            *sock;
+	netmessage_t msg;
+
+
+	SetupFlow();
+
+	/* enough portals per range to keep every thread busy */
+	if ( numthreads == -1 ) {
+		ThreadSetDefault();
+	}
+	rangeSize = VISNET_RANGE_THREAD * numthreads;
+	if ( rangeSize > VISNET_MAX_RANGE ) {
+		rangeSize = VISNET_MAX_RANGE;
+	}
+
+	/* the coordinator may still be setting up */
+	Net_Setup();
+	Net_StringToAddress( visWorkerAddress, &address );
+	sock = NULL;
+	for ( i = 0; i < 300 && sock == NULL; i++ )
+	{
+		sock = Net_Connect( &address, 0 );
+		if ( sock == NULL ) {
+			Sys_Sleep( 200 );
+		}
+	}
+	if ( sock == NULL ) {
+		Error( "Unable to reach the vis coordinator at %s", visWorkerAddress );
+	}
+	Sys_Printf( "\n--- RunVisWorker (%s) ---\n", visWorkerAddress );
+
+	NMSG_Clear( &msg );
+	NMSG_WriteLong( &msg, VISNET_HELLO );
+	NMSG_WriteLong( &msg, VISNET_VERSION );
+	NMSG_WriteLong( &msg, inputHash[ 0 ] );
+	NMSG_WriteLong( &msg, inputHash[ 1 ] );
+	NMSG_WriteLong( &msg, rangeSize );
+	Net_Send( sock, &msg );
+
+	numRanges = numFlowed = numReceived = 0;
+	finished = qfalse;
+	while ( WaitMessage( sock, &msg ) )
+	{
+		/* portals finished elsewhere */
+		type = NMSG_ReadLong( &msg );
+		if ( type == VISNET_RESULT ) {
+			i = ReadPortalBits( &msg );
+			if ( i == -2 ) {
+				Error( "Bad portal bits from the vis coordinator" );
+			}
+			if ( i >= 0 ) {
+				portals[ i ].status = stat_done;
+				numReceived++;
+			}
+			continue;
+		}
+		if ( type != VISNET_RANGE ) {
+			Error( "Unexpected message from the vis coordinator" );
+		}
+
+		/* a range of our own */
+		count = NMSG_ReadLong( &msg );
+		if ( count <= 0 ) {
+			finished = qtrue;
+			break;
+		}
+		numRangePortals = 0;
+		for ( i = 0; i < count && i < VISNET_MAX_RANGE; i++ )
+		{
+			j = NMSG_ReadLong( &msg );
+			if ( j < 0 || j >= numportals * 2 ) {
+				Error( "Bad portal %d from the vis coordinator", j );
+			}
+			rangePortals[ numRangePortals++ ] = j;
+		}
+		RunThreadsOnIndividual( numRangePortals, qfalse, RangeFlow );
+		numRanges++;
+		numFlowed += numRangePortals;
+
+		for ( i = 0; i < numRangePortals; i++ )
+			SendPortalBits( sock, rangePortals[ i ] );
+		NMSG_Clear( &msg );
+		NMSG_WriteLong( &msg, VISNET_REQUEST );
+		Net_Send( sock, &msg );
+	}
+	Net_Disconnect( sock );
+	if ( !finished && numRanges == 0 ) {
+		Error( "The vis coordinator at %s turned this worker down, check the map and options", visWorkerAddress );
+	}
+	free( sortIndex );
+	Sys_Printf( "%9d ranges\n", numRanges );
+	Sys_Printf( "%9d portals flowed\n", numFlowed );
+	Sys_Printf( "%9d portals from other processes\n", numReceived );
+}
@@ -0,0 +1,717 @@
+/* -------------------------------------------------------------------------------
+
+   Copyright (C) 1999-2007 id Software, Inc. and contributors.
+   For a list of contributors, see the accompanying CONTRIBUTORS file.
+
+   This file is part of GtkRadiant.
+
+   GtkRadiant is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   GtkRadiant is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with GtkRadiant; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+   ----------------------------------------------------------------------------------
+
+   This code has been altered significantly from its original form, to support
+   several games based on the Quake III Arena engine, in the form of "Q3Map2."
+
+   ------------------------------------------------------------------------------- */
+
+
+
+/* marker */
+#define VISSAMPLE_C
+
+
+
+/* dependencies */
+#include "vmap.h"
+
+
+
+/* -------------------------------------------------------------------------------
+
+   sampled vis
+
+   -sampled replaces the flow with rays. for every leaf it shoots rays from
+   points on the portals out of the leaf to points on the portals in their
+   portalflood and walks each ray through the leaves: a leaf is convex, so the
+   ray leaves it where it first crosses one of the leaf's portal planes, and
+   if that point is not on a portal winding the ray ran into something solid.
+   every leaf a ray gets into is visible. ClusterMerge only needs one visible
+   portal per leaf, so each pair of leaves gets up to -samples rays, spread
+   over the portals between them, and the farthest targets go first so their
+   rays mark most of the nearer leaves on the way.
+
+   leaf visibility goes both ways, so a pair of leaves that might see each
+   other is only sampled by the lower numbered one. a first pass records which
+   leaves each leaf will sample, the sampling pass records which of them it
+   found visible, and a last pass copies those answers to the higher leaf of
+   each pair. a row of those matrices is only written by the leaf it belongs
+   to and only read in a later pass, so the result does not depend on the
+   threads.
+
+   a ray can only prove a pair visible, so a pair keeps the portalflood bits
+   between its leaves unless it is decided hidden: no ray got into the other
+   leaf and at least -samplehidden rays towards it hit something solid more
+   than -samplemargin units away from any portal they could have left
+   through. a ray that stays within -sampleepsilon units of a winding still
+   gets through, so openings are widened by that much. what can still be
+   missed is visibility through a gap that all those rays step over, so
+   -samplecheck runs the flow afterwards and counts the pairs it sees that
+   were culled. once -samplebudget seconds have passed, the leaves not done
+   yet keep the portalflood of their portals, which is never too small.
+
+   ------------------------------------------------------------------------------- */
+
+#define SAMPLE_T_EPSILON        0.0001f
+
+/* what a ray found out about its target */
+#define SAMPLE_REACHED          0
+#define SAMPLE_BLOCKED          1       /* hit solid well away from the portals */
+#define SAMPLE_UNSURE           2
+
+typedef struct sampleTarget_s
+{
+	float dist;
+	int num;
+}
+sampleTarget_t;
+
+static byte                 *pairDecided, *pairVisible, *leafFellBack;
+static vec4_t               *edgePlanes;
+static int                  *firstEdgePlane;
+static double sampleStart;
+static int c_samplerays, c_samplefallback, c_samplehidden, c_samplekept;
+
+
+
+/*
+   SampleRandom()
+   small deterministic generator, so the result does not depend on the threads
+ */
+
+static float SampleRandom( unsigned int *seed ){
+	*seed = *seed * 1664525u + 1013904223u;
+	return ( *seed >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+
+
+/*
+   SampleWinding()
+   picks a random point on the fan triangles of a winding
+ */
+
+static void SampleWinding( const fixedWinding_t *w, unsigned int *seed, vec3_t point ){
+	int i;
+	float a, b, area, total;
+	vec3_t e1, e2, cross;
+
+
+	/* pick a fan triangle by area */
+	total = 0.0f;
+	for ( i = 2; i < w->numpoints; i++ )
+	{
+		VectorSubtract( w->points[ i - 1 ], w->points[ 0 ], e1 );
+		VectorSubtract( w->points[ i ], w->points[ 0 ], e2 );
+		CrossProduct( e1, e2, cross );
+		total += VectorLength( cross );
+	}
+	area = SampleRandom( seed ) * total;
+	for ( i = 2; i < w->numpoints - 1; i++ )
+	{
+		VectorSubtract( w->points[ i - 1 ], w->points[ 0 ], e1 );
+		VectorSubtract( w->points[ i ], w->points[ 0 ], e2 );
+		CrossProduct( e1, e2, cross );
+		area -= VectorLength( cross );
+		if ( area <= 0.0f ) {
+			break;
+		}
+	}
+
+	/* uniform point on it */
+	a = SampleRandom( seed );
+	b = SampleRandom( seed );
+	if ( a + b > 1.0f ) {
+		a = 1.0f - a;
+		b = 1.0f - b;
+	}
+	VectorSubtract( w->points[ i - 1 ], w->points[ 0 ], e1 );
+	VectorSubtract( w->points[ i ], w->points[ 0 ], e2 );
+	VectorMA( w->points[ 0 ], a, e1, point );
+	VectorMA( point, b, e2, point );
+}
+
+
+
+/*
+   SamplePortals()
+   picks the ends of a ray between two portals, the centers first, then random points
+ */
+
+static void SamplePortals( const vportal_t *p, const vportal_t *q, int sample, unsigned int *seed, vec3_t start, vec3_t end ){
+	if ( sample == 0 ) {
+		VectorCopy( p->origin, start );
+		VectorCopy( q->origin, end );
+		return;
+	}
+	SampleWinding( p->winding, seed, start );
+	SampleWinding( q->winding, seed, end );
+}
+
+
+
+/*
+   SetupEdgePlanes()
+   stores the outward edge planes of every portal winding, widened by -sampleepsilon
+ */
+
+static void SetupEdgePlanes( void ){
+	int i, j, n;
+	vportal_t           *p;
+	const fixedWinding_t *w;
+	const vec_t         *v1, *v2;
+	vec3_t edge, delta;
+	vec_t               *plane;
+
+
+	n = 0;
+	firstEdgePlane = safe_malloc( ( numportals * 2 + 1 ) * sizeof( *firstEdgePlane ) );
+	for ( i = 0; i < numportals * 2; i++ )
+	{
+		firstEdgePlane[ i ] = n;
+		n += portals[ i ].winding->numpoints;
+	}
+	firstEdgePlane[ numportals * 2 ] = n;
+	edgePlanes = safe_malloc( ( n > 0 ? n : 1 ) * sizeof( *edgePlanes ) );
+
+	for ( i = 0, p = portals; i < numportals * 2; i++, p++ )
+	{
+		w = p->winding;
+		for ( j = 0; j < w->numpoints; j++ )
+		{
+			v1 = w->points[ j ];
+			v2 = w->points[ ( j + 1 ) % w->numpoints ];
+			plane = edgePlanes[ firstEdgePlane[ i ] + j ];
+			VectorSubtract( v2, v1, edge );
+			CrossProduct( edge, p->plane.normal, plane );
+			if ( VectorNormalize( plane, plane ) == 0.0f ) {
+				/* degenerate edge, never rejects */
+				plane[ 3 ] = 1e30f;
+				continue;
+			}
+
+			/* the winding can run either way around the plane normal */
+			VectorSubtract( p->origin, v1, delta );
+			if ( DotProduct( delta, plane ) > 0.0f ) {
+				VectorInverse( plane );
+			}
+			plane[ 3 ] = DotProduct( v1, plane ) + visSampleEpsilon;
+		}
+	}
+}
+
+
+
+/*
+   PointOnPortal()
+   tests if a point on the plane of a portal is within -sampleepsilon of its winding
+ */
+
+static qboolean PointOnPortal( const vportal_t *p, const vec3_t point ){
+	int i, end;
+
+
+	end = firstEdgePlane[ p - portals + 1 ];
+	for ( i = firstEdgePlane[ p - portals ]; i < end; i++ )
+	{
+		if ( DotProduct( point, edgePlanes[ i ] ) > edgePlanes[ i ][ 3 ] ) {
+			return qfalse;
+		}
+	}
+	return qtrue;
+}
+
+
+
+/*
+   PortalDistance()
+   how far a point is from a portal winding widened by -sampleepsilon, 0 if it is on it
+ */
+
+static float PortalDistance( const vportal_t *p, const vec3_t point ){
+	int i, end;
+	float d, dist;
+
+
+	dist = fabs( DotProduct( point, p->plane.normal ) - p->plane.dist );
+	end = firstEdgePlane[ p - portals + 1 ];
+	for ( i = firstEdgePlane[ p - portals ]; i < end; i++ )
+	{
+		d = DotProduct( point, edgePlanes[ i ] ) - edgePlanes[ i ][ 3 ];
+		if ( d > dist ) {
+			dist = d;
+		}
+	}
+	return dist;
+}
+
+
+
+/*
+   TraceSample()
+   walks the ray from start on the source portal to end on the target through the leaves,
+   marking every portal it gets through in vis and its leaf in leafSeen, returns SAMPLE_REACHED
+   if it got to the target and SAMPLE_BLOCKED only if it hit solid more than -samplemargin units
+   from every portal it could have left the leaf through
+ */
+
+static int TraceSample( vportal_t *source, vportal_t *target, const vec3_t start, const vec3_t end, byte *vis, byte *leafSeen ){
+	int i, leafnum, pnum, steps;
+	leaf_t          *leaf;
+	vportal_t       *p;
+	vec3_t dir, point;
+	float t, tmin, tcur, denom;
+	float d, nearest;
+
+
+	VectorSubtract( end, start, dir );
+	leafnum = source->leaf;
+	tcur = 0.0f;
+	for ( steps = 0; steps < numportals * 2; steps++ )
+	{
+		leaf = &leafs[ leafnum ];
+
+		/* the ray leaves a convex leaf where it first crosses one of its planes */
+		tmin = 2.0f;
+		for ( i = 0; i < leaf->numportals; i++ )
+		{
+			p = leaf->portals[ i ];
+			if ( p->removed ) {
+				continue;
+			}
+			denom = DotProduct( dir, p->plane.normal );
+			if ( denom <= 0.0f ) {
+				continue;
+			}
+			t = ( p->plane.dist - DotProduct( start, p->plane.normal ) ) / denom;
+			if ( t > tcur - SAMPLE_T_EPSILON && t < tmin ) {
+				tmin = t;
+			}
+		}
+		if ( tmin > 1.0f + SAMPLE_T_EPSILON ) {
+			return SAMPLE_UNSURE;
+		}
+
+		/* through one of the portals on that plane, or into something solid */
+		VectorMA( start, tmin, dir, point );
+		for ( i = 0; i < leaf->numportals; i++ )
+		{
+			p = leaf->portals[ i ];
+			if ( p->removed ) {
+				continue;
+			}
+			denom = DotProduct( dir, p->plane.normal );
+			if ( denom <= 0.0f ) {
+				continue;
+			}
+			t = ( p->plane.dist - DotProduct( start, p->plane.normal ) ) / denom;
+			if ( t > tmin + SAMPLE_T_EPSILON || t < tcur - SAMPLE_T_EPSILON ) {
+				continue;
+			}
+			if ( p == target || PointOnPortal( p, point ) ) {
+				break;
+			}
+		}
+		if ( i == leaf->numportals ) {
+			/* only a hit well away from the portals ahead says anything about the target */
+			nearest = 1e30f;
+			for ( i = 0; i < leaf->numportals; i++ )
+			{
+				p = leaf->portals[ i ];
+				if ( p->removed || DotProduct( dir, p->plane.normal ) <= 0.0f ) {
+					continue;
+				}
+				d = PortalDistance( p, point );
+				if ( d < nearest ) {
+					nearest = d;
+				}
+			}
+			return nearest > visSampleMargin ? SAMPLE_BLOCKED : SAMPLE_UNSURE;
+		}
+
+		pnum = p - portals;
+		vis[ pnum >> 3 ] |= ( 1 << ( pnum & 7 ) );
+		leafSeen[ p->leaf >> 3 ] |= ( 1 << ( p->leaf & 7 ) );
+		if ( p == target ) {
+			return SAMPLE_REACHED;
+		}
+		leafnum = p->leaf;
+		tcur = tmin;
+	}
+
+	return SAMPLE_UNSURE;
+}
+
+
+
+/*
+   CompareSampleTargets()
+   qsort callback, farthest first
+ */
+
+static int CompareSampleTargets( const void *a, const void *b ){
+	float d;
+
+
+	d = ( (const sampleTarget_t*) b )->dist - ( (const sampleTarget_t*) a )->dist;
+	if ( d < 0.0f ) {
+		return -1;
+	}
+	if ( d > 0.0f ) {
+		return 1;
+	}
+	return ( (const sampleTarget_t*) a )->num - ( (const sampleTarget_t*) b )->num;
+}
+
+
+
+/*
+   LeafSources()
+   collects the portals out of a leaf, returns 0 for leaves merged away
+ */
+
+static int LeafSources( int leafnum, vportal_t **sources ){
+	int i, numSources;
+	leaf_t              *leaf;
+
+
+	leaf = &leafs[ leafnum ];
+	if ( leaf->merged >= 0 ) {
+		return 0;
+	}
+	numSources = 0;
+	for ( i = 0; i < leaf->numportals; i++ )
+	{
+		if ( !leaf->portals[ i ]->removed ) {
+			sources[ numSources++ ] = leaf->portals[ i ];
+		}
+	}
+	return numSources;
+}
+
+
+
+/*
+   SampledLeafTargets()
+   RunThreadsOnIndividual() callback, records the leaves the portals out of one leaf might see
+ */
+
+static void SampledLeafTargets( int leafnum ){
+	int i, j, numSources;
+	vportal_t           **sources;
+	byte                *flood, *decided;
+
+
+	sources = safe_malloc( ( leafs[ leafnum ].numportals + 1 ) * sizeof( *sources ) );
+	numSources = LeafSources( leafnum, sources );
+	if ( numSources == 0 ) {
+		free( sources );
+		return;
+	}
+
+	flood = safe_malloc( portalbytes );
+	memcpy( flood, sources[ 0 ]->portalflood, portalbytes );
+	for ( i = 1; i < numSources; i++ )
+		VisBitsOr( flood, sources[ i ]->portalflood, portalbytes );
+	decided = pairDecided + leafnum * leafbytes;
+	for ( j = 0; j < numportals * 2; j++ )
+	{
+		if ( ( flood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) && !portals[ j ].removed ) {
+			decided[ portals[ j ].leaf >> 3 ] |= ( 1 << ( portals[ j ].leaf & 7 ) );
+		}
+	}
+
+	free( sources );
+	free( flood );
+}
+
+
+
+/*
+   SampledLeafFlow()
+   RunThreadsOnIndividual() callback, fills the portalvis of the portals out of one leaf from sampled rays
+ */
+
+void SampledLeafFlow( int leafnum ){
+	int i, j, k, y, numSources, numTargets, rays, numRays, numHidden, numKept, sample, tries;
+	unsigned int seed;
+	vportal_t           *p, *q, **sources;
+	sampleTarget_t      *targets;
+	int                 *raysLeft, *blocked;
+	byte                *flood, *decided, *visible;
+	vec3_t center, start, end, delta;
+	byte leafSeen[ MAX_MAP_LEAFS / 8 ];
+
+
+	/* the portals out of the leaf */
+	sources = safe_malloc( ( leafs[ leafnum ].numportals + 1 ) * sizeof( *sources ) );
+	numSources = LeafSources( leafnum, sources );
+	if ( numSources == 0 ) {
+		free( sources );
+		return;
+	}
+	VectorClear( center );
+	for ( i = 0; i < numSources; i++ )
+		VectorAdd( center, sources[ i ]->origin, center );
+	VectorScale( center, 1.0f / numSources, center );
+
+	/* out of time, keep the flood */
+	if ( visSampleBudget > 0.0f && I_FloatTime() - sampleStart > visSampleBudget ) {
+		for ( i = 0; i < numSources; i++ )
+			memcpy( sources[ i ]->portalvis, sources[ i ]->portalflood, portalbytes );
+		free( sources );
+		leafFellBack[ leafnum ] = qtrue;
+		ThreadLock();
+		c_samplefallback++;
+		ThreadUnlock();
+		return;
+	}
+
+	/* the portals of the leaves next to it are only hidden by being coplanar, like in the flow */
+	memset( leafSeen, 0, leafbytes );
+	for ( i = 0; i < numSources; i++ )
+	{
+		p = sources[ i ];
+		leafSeen[ p->leaf >> 3 ] |= ( 1 << ( p->leaf & 7 ) );
+		for ( j = 0; j < leafs[ p->leaf ].numportals; j++ )
+		{
+			k = leafs[ p->leaf ].portals[ j ] - portals;
+			if ( p->portalflood[ k >> 3 ] & ( 1 << ( k & 7 ) ) ) {
+				p->portalvis[ k >> 3 ] |= ( 1 << ( k & 7 ) );
+				leafSeen[ portals[ k ].leaf >> 3 ] |= ( 1 << ( portals[ k ].leaf & 7 ) );
+			}
+		}
+	}
+
+	/* every portal any source might see, farthest first, and the ray budget of its leaf */
+	flood = safe_malloc( portalbytes );
+	memcpy( flood, sources[ 0 ]->portalflood, portalbytes );
+	for ( i = 1; i < numSources; i++ )
+		VisBitsOr( flood, sources[ i ]->portalflood, portalbytes );
+	targets = safe_malloc( numportals * 2 * sizeof( *targets ) );
+	raysLeft = safe_malloc( portalclusters * sizeof( *raysLeft ) );
+	memset( raysLeft, 0, portalclusters * sizeof( *raysLeft ) );
+	blocked = safe_malloc( portalclusters * sizeof( *blocked ) );
+	memset( blocked, 0, portalclusters * sizeof( *blocked ) );
+	numTargets = 0;
+	for ( j = 0; j < numportals * 2; j++ )
+	{
+		if ( !( flood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) || portals[ j ].removed ) {
+			continue;
+		}
+		VectorSubtract( portals[ j ].origin, center, delta );
+		targets[ numTargets ].dist = VectorLength( delta );
+		targets[ numTargets ].num = j;
+		numTargets++;
+		raysLeft[ portals[ j ].leaf ] = visSamples;
+	}
+	qsort( targets, numTargets, sizeof( *targets ), CompareSampleTargets );
+
+	/* a lower leaf that might see this one samples the pair, SampledLeafMirror() copies its answer */
+	for ( i = 0; i < numTargets; i++ )
+	{
+		y = portals[ targets[ i ].num ].leaf;
+		decided = pairDecided + y * leafbytes;
+		if ( y < leafnum && ( decided[ leafnum >> 3 ] & ( 1 << ( leafnum & 7 ) ) ) ) {
+			raysLeft[ y ] = -1;
+		}
+	}
+
+	/* spread the rays of a leaf over its portals and their sources */
+	numRays = 0;
+	for ( i = 0; i < numTargets; i++ )
+	{
+		j = targets[ i ].num;
+		q = &portals[ j ];
+		rays = 0;
+		for ( sample = 0; sample < visSamples && raysLeft[ q->leaf ] > 0; sample++ )
+		{
+			if ( leafSeen[ q->leaf >> 3 ] & ( 1 << ( q->leaf & 7 ) ) ) {
+				break;
+			}
+
+			/* a source that might see it, and points that go out through the source and in through the target */
+			seed = (unsigned int) ( leafnum * 2654435761u ) ^ (unsigned int) ( j * 40503u + sample );
+			for ( tries = 0; tries < 4; tries++ )
+			{
+				p = sources[ ( sample + tries ) % numSources ];
+				if ( !( p->portalflood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) ) {
+					continue;
+				}
+				SamplePortals( p, q, sample + tries, &seed, start, end );
+				if ( DotProduct( end, p->plane.normal ) - p->plane.dist > ON_EPSILON &&
+					 DotProduct( start, q->plane.normal ) - q->plane.dist < -ON_EPSILON ) {
+					break;
+				}
+			}
+			if ( tries == 4 ) {
+				continue;
+			}
+
+			rays++;
+			raysLeft[ q->leaf ]--;
+			if ( TraceSample( p, q, start, end, p->portalvis, leafSeen ) == SAMPLE_BLOCKED ) {
+				blocked[ q->leaf ]++;
+			}
+		}
+		numRays += rays;
+	}
+
+	/* the pairs this leaf sampled are visible unless decided hidden, the
+	   portals of the leaves no ray got into keep their flood bits */
+	for ( i = 0; i < numTargets; i++ )
+	{
+		j = targets[ i ].num;
+		y = portals[ j ].leaf;
+		if ( raysLeft[ y ] < 0 || ( leafSeen[ y >> 3 ] & ( 1 << ( y & 7 ) ) ) || blocked[ y ] >= visSampleHidden ) {
+			continue;
+		}
+		for ( k = 0; k < numSources; k++ )
+		{
+			if ( sources[ k ]->portalflood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) {
+				sources[ k ]->portalvis[ j >> 3 ] |= ( 1 << ( j & 7 ) );
+			}
+		}
+	}
+
+	/* the answers for the higher leaves, once per leaf */
+	numHidden = 0;
+	numKept = 0;
+	visible = pairVisible + leafnum * leafbytes;
+	for ( i = 0; i < numTargets; i++ )
+	{
+		y = portals[ targets[ i ].num ].leaf;
+		if ( raysLeft[ y ] < 0 ) {
+			continue;
+		}
+		raysLeft[ y ] = -1;
+		if ( leafSeen[ y >> 3 ] & ( 1 << ( y & 7 ) ) ) {
+			visible[ y >> 3 ] |= ( 1 << ( y & 7 ) );
+		}
+		else if ( blocked[ y ] >= visSampleHidden ) {
+			numHidden++;
+		}
+		else
+		{
+			visible[ y >> 3 ] |= ( 1 << ( y & 7 ) );
+			numKept++;
+		}
+	}
+
+	free( sources );
+	free( flood );
+	free( targets );
+	free( raysLeft );
+	free( blocked );
+
+	ThreadLock();
+	c_samplerays += numRays;
+	c_samplehidden += numHidden;
+	c_samplekept += numKept;
+	ThreadUnlock();
+}
+
+
+
+/*
+   SampledLeafMirror()
+   RunThreadsOnIndividual() callback, takes the answers of the lower leaves that sampled a pair with this one,
+   a leaf that ran out of time counts as visible
+ */
+
+static void SampledLeafMirror( int leafnum ){
+	int i, j, y, numSources;
+	vportal_t           *p, **sources;
+	byte                *decided, *visible;
+
+
+	if ( leafFellBack[ leafnum ] ) {
+		return;
+	}
+	sources = safe_malloc( ( leafs[ leafnum ].numportals + 1 ) * sizeof( *sources ) );
+	numSources = LeafSources( leafnum, sources );
+	for ( i = 0; i < numSources; i++ )
+	{
+		p = sources[ i ];
+		for ( j = 0; j < numportals * 2; j++ )
+		{
+			if ( !( p->portalflood[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) || ( p->portalvis[ j >> 3 ] & ( 1 << ( j & 7 ) ) ) || portals[ j ].removed ) {
+				continue;
+			}
+			y = portals[ j ].leaf;
+			if ( y >= leafnum ) {
+				continue;
+			}
+			decided = pairDecided + y * leafbytes;
+			visible = pairVisible + y * leafbytes;
+			if ( ( decided[ leafnum >> 3 ] & ( 1 << ( leafnum & 7 ) ) ) &&
+				 ( leafFellBack[ y ] || ( visible[ leafnum >> 3 ] & ( 1 << ( leafnum & 7 ) ) ) ) ) {
+				p->portalvis[ j >> 3 ] |= ( 1 << ( j & 7 ) );
+			}
+		}
+	}
+	free( sources );
+}
+
+
+
+/*
+   CalcSampledVis()
+   the -sampled vis mode
+ */
+
+void CalcSampledVis( void ){
+	int i;
+
+
+	c_samplerays = c_samplefallback = c_samplehidden = c_samplekept = 0;
+	SetupEdgePlanes();
+	pairDecided = safe_malloc( portalclusters * leafbytes );
+	memset( pairDecided, 0, portalclusters * leafbytes );
+	pairVisible = safe_malloc( portalclusters * leafbytes );
+	memset( pairVisible, 0, portalclusters * leafbytes );
+	leafFellBack = safe_malloc( portalclusters );
+	memset( leafFellBack, 0, portalclusters );
+
+	RunThreadsOnIndividual( portalclusters, qfalse, SampledLeafTargets );
+	sampleStart = I_FloatTime();
+	Sys_Printf( "\n--- SampledLeafFlow (%d) ---\n", portalclusters );
+	RunThreadsOnIndividual( portalclusters, qtrue, SampledLeafFlow );
+	RunThreadsOnIndividual( portalclusters, qfalse, SampledLeafMirror );
+
+	/* portals of leaves merged away are not merged into any cluster */
+	for ( i = 0; i < numportals * 2; i++ )
+		portals[ i ].status = stat_done;
+
+	Sys_Printf( "%9d rays\n", c_samplerays );
+	Sys_Printf( "%9d leaf pairs hidden, %d kept from the flood\n", c_samplehidden, c_samplekept );
+	if ( c_samplefallback > 0 ) {
+		Sys_Printf( "%9d leaves over the time budget kept their flood\n", c_samplefallback );
+	}
+	free( edgePlanes );
+	free( firstEdgePlane );
+	free( pairDecided );
+	free( pairVisible );
+	free( leafFellBack );
+}
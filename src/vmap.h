@@ -217,11 +217,11 @@
 #define SEPERATORCACHE          /* seperator caching helps a bit */
 
 #define PORTALFILE              "PRT1"
+#define PORTALFILE_BINARY       "PRTB"
+#define PORTALFILE_BINARY_VERSION   1
 
-#define MAX_PORTALS             0x20000 /* same as MAX_MAP_PORTALS */
 #define MAX_SEPERATORS          MAX_POINTS_ON_WINDING
 #define MAX_POINTS_ON_FIXED_WINDING 24  /* ydnar: increased this from 12 at the expense of more memory */
-#define MAX_PORTALS_ON_LEAF     1024
 
 
 /* light */
@@ -279,6 +279,26 @@
 #define BSP_DELUXEL_SIZE        3
 #define SUPER_FLOODLIGHT_SIZE   4
 
+/* ThreadScratch() slots used by the light stage */
+#define SCRATCH_LIGHT_LUXELS    0
+#define SCRATCH_LIGHT_DELUXELS  1
+#define SCRATCH_TRACE_LIGHTS    2
+#define SCRATCH_LIGHT_TRACES    3
+#define SCRATCH_LIGHT_PACKET    4
+#define SCRATCH_LIGHT_INDEX     5
+
+/* ThreadScratch() slots used by the vis stage */
+#define SCRATCH_VIS_MIGHTSEE    6
+#define SCRATCH_VIS_FLOOD       7
+#define SCRATCH_VIS_PASSAGE     8
+
+/* ThreadCacheAlloc() caches used by the bsp stage (CACHE_WINDING is 0),
+   nodes, portals and bsp faces die with their tree and use ThreadArenaAlloc() */
+#define CACHE_BRUSH             1
+#define CACHE_PORTAL            2
+#define CACHE_BSPFACE           3
+#define CACHE_NODE              4
+
 #define VERTEX_LUXEL( s, v )    ( vertexLuxels[ s ] + ( ( v ) * VERTEX_LUXEL_SIZE ) )
 #define RAD_VERTEX_LUXEL( s, v )( radVertexLuxels[ s ] + ( ( v ) * VERTEX_LUXEL_SIZE ) )
 #define BSP_LUXEL( s, x, y )    ( lm->bspLuxels[ s ] + ( ( ( ( y ) * lm->w ) + ( x ) ) * BSP_LUXEL_SIZE ) )
@@ -1212,10 +1232,42 @@ typedef struct
 fixedWinding_t;
 
 
+/* binary portal file (-bsp -binaryprt), little endian: the header, numPortals
+   portal records, numFaces face records, then numPoints float xyz triplets */
+typedef struct
+{
+	char magic[ 4 ];                    /* PORTALFILE_BINARY */
+	int version;
+	int numClusters, numPortals, numFaces;
+	int numPoints;
+}
+prtbHeader_t;
+
+
+typedef struct
+{
+	int numPoints, firstPoint;
+	int leafs[ 2 ];                     /* faces only use the first */
+	int flags;                          /* 1 = hint, 2 = sky */
+}
+prtbPortal_t;
+
+
+/* a run of non-empty 64 bit blocks in a passage's cansee */
+typedef struct passageRun_s
+{
+	unsigned short start, count;
+}
+passageRun_t;
+
+
 typedef struct passage_s
 {
 	struct passage_s    *next;
-	byte cansee[ 1 ];                   /* all portals that can be seen through this passage */
+	int numruns;
+	passageRun_t        *runs;          /* the non-empty blocks of cansee */
+	byte                *cansee;        /* all portals that can be seen through this passage, only the */
+	                                    /* blocks of the runs, packed. NULL if over -passagememory */
 } passage_t;
 
 
@@ -1255,16 +1307,16 @@ vportal_t;
 
 typedef struct leaf_s
 {
-	int numportals;
+	int numportals, maxportals;
 	int merged;
-	vportal_t           *portals[MAX_PORTALS_ON_LEAF];
+	vportal_t           **portals;      /* grown by AddLeafPortal() */
 }
 leaf_t;
 
 
 typedef struct pstack_s
 {
-	byte mightsee[ MAX_PORTALS / 8 ];
+	byte                *mightsee;      /* portalbytes, see FlowMightsee() */
 	struct pstack_s     *next;
 	leaf_t              *leaf;
 	vportal_t           *portal;        /* portal exiting */
@@ -1288,6 +1340,8 @@ typedef struct
 {
 	vportal_t           *base;
 	int c_chains;
+	int c_portalskip;                   /* portals not in the mightsee */
+	int c_leafskip;                     /* portals that could not add anything new */
 	pstack_t pstack_head;
 }
 threaddata_t;
@@ -1375,6 +1429,11 @@ typedef struct
 	qboolean opaque;
 	vec_t forceSubsampling;           /* needs subsampling (alphashadow), value = max color contribution possible from it */
 
+	/* deferred occlusion, for tracing packets of samples */
+	qboolean deferOcclusion;            /* input: leave the TraceLine() to the caller */
+	qboolean occlusionPending;          /* output: call TraceLine(), then FinishLightContribution() */
+	vec_t occlusionScale;
+
 	/* working data */
 	int numTestNodes;
 	int testNodes[ MAX_TRACE_TEST_NODES ];
@@ -1778,11 +1837,36 @@ void                        ComputeAxisBase( vec3_t normal, vec3_t texX, vec3_t
 fixedWinding_t              *NewFixedWinding( int points );
 int                         VisMain( int argc, char **argv );
 
-/* visflow.c */
+/* visbits.c */
+qboolean                    VisBitsAndMore( void *out, const void *a, const void *b, const void *vis, int numBytes );
+qboolean                    VisBitsAnd3More( void *out, const void *a, const void *b, const void *c, const void *vis, int numBytes );
+void                        VisBitsOr( void *out, const void *a, int numBytes );
+qboolean                    VisBitsAny( const void *a, const void *b, int numBytes );
 int                         CountBits( byte *bits, int numbits );
+
+/* viscache.c */
+void                        SetupVisCache( const char *BSPFilePath );
+void                        VisCacheCheckpoint( void );
+void                        FinishVisCache( void );
+
+/* visbench.c */
+void                        BenchVisPhase( const char *name );
+void                        WriteVisBench( double totalvis, int minvis, int maxvis );
+
+/* vissample.c */
+void                        SampledLeafFlow( int leafnum );
+void                        CalcSampledVis( void );
+
+/* visnet.c */
+void                        CalcDistributedVis( void );
+void                        RunVisWorker( void );
+
+/* visflow.c */
 void                        PassageFlow( int portalnum );
 void                        CreatePassages( int portalnum );
 void                        PassageMemory( void );
+void                        PassageMemoryUsed( void );
+void                        SetupBasePortalVis( void );
 void                        BasePortalVis( int portalnum );
 void                        BetterPortalVis( int portalnum );
 void                        PortalFlow( int portalnum );
@@ -1793,6 +1877,7 @@ void                        PassagePortalFlow( int portalnum );
 /* light.c  */
 float                       PointToPolygonFormFactor( const vec3_t point, const vec3_t normal, const winding_t *w );
 int                         LightContributionToSample( trace_t *trace );
+int                         FinishLightContribution( trace_t *trace );
 void LightingAtSample( trace_t * trace, byte styles[ MAX_LIGHTMAPS ], vec3_t colors[ MAX_LIGHTMAPS ] );
 int                         LightContributionToPoint( trace_t *trace );
 int                         LightMain( int argc, char **argv );
@@ -1801,7 +1886,9 @@ int                         LightMain( int argc, char **argv );
 /* light_trace.c */
 void                        SetupTraceNodes( void );
 void                        TraceLine( trace_t *trace );
+void                        TraceLinePacket( trace_t **traces, int numTraces );
 float                       SetupTrace( trace_t *trace );
+void                        HashTraceGeometry( unsigned int hash[ 2 ] );
 
 
 /* light_bounce.c */
@@ -1812,6 +1899,15 @@ void                        RadCreateDiffuseLights( void );
 void                        RadFreeLights();
 
 
+/* light_cache.c */
+void                        SetupLightCache( const char *BSPFilePath, int argc, char **argv );
+void                        BeginLightCachePass( int pass );
+qboolean                    LightCacheRestore( int rawLightmapNum, const trace_t *trace );
+void                        LightCacheStore( int rawLightmapNum );
+void                        EndLightCachePass( void );
+void                        FinishLightCache( qboolean complete );
+
+
 /* light_ydnar.c */
 void                        ColorToBytes( const float *color, byte *colorBytes, float scale );
 void                        ColorToHDR( const float *color, float *colorBytes );
@@ -1830,6 +1926,8 @@ float                       FloodLightForSample( trace_t *trace, float floodLigh
 void                        FloodLightRawLightmap( int num );
 
 void                        IlluminateRawLightmap( int num );
+void                        SortRawLightmapsByCost( void );
+void                        IlluminateRawLightmapSorted( int num );
 void                        IlluminateVertexes( int num );
 
 void                        SetupBrushesFlags( unsigned int mask_any, unsigned int test_any, unsigned int mask_all, unsigned int test_all );
@@ -2007,6 +2105,7 @@ Q_EXTERN qboolean renameModelShaders Q_ASSIGN( qfalse );            /* ydnar */
 Q_EXTERN qboolean skyFixHack Q_ASSIGN( qfalse );                    /* ydnar */
 Q_EXTERN qboolean bspAlternateSplitWeights Q_ASSIGN( qfalse );      /* 27 */
 Q_EXTERN qboolean deepBSP Q_ASSIGN( qfalse );                       /* div0 */
+Q_EXTERN int bspSplitSample Q_ASSIGN( 0 );                          /* max split planes scored per node, 0 = all */
 Q_EXTERN qboolean maxAreaFaceSurface Q_ASSIGN( qfalse );                    /* divVerent */
 
 Q_EXTERN int patchSubdivisions Q_ASSIGN( 8 );                       /* ydnar: -patchmeta subdivisions */
@@ -2023,6 +2122,7 @@ Q_EXTERN qboolean patchMeta Q_ASSIGN( qfalse );
 Q_EXTERN qboolean debugSurfaces Q_ASSIGN( qfalse );
 Q_EXTERN qboolean debugInset Q_ASSIGN( qfalse );
 Q_EXTERN qboolean debugPortals Q_ASSIGN( qfalse );
+Q_EXTERN qboolean binaryPortals Q_ASSIGN( qfalse );
 Q_EXTERN qboolean lightmapTriangleCheck Q_ASSIGN( qfalse );
 Q_EXTERN qboolean lightmapExtraVisClusterNudge Q_ASSIGN( qfalse );
 Q_EXTERN qboolean lightmapFill Q_ASSIGN( qfalse );
@@ -2090,7 +2190,6 @@ Q_EXTERN fog_t mapFogs[ MAX_MAP_FOGS ];
 
 Q_EXTERN entity_t           *mapEnt;
 Q_EXTERN brush_t            *buildBrush;
-Q_EXTERN int numActiveBrushes;
 Q_EXTERN int g_bBrushPrimit;
 
 Q_EXTERN int numStrippedLights Q_ASSIGN( 0 );
@@ -2154,6 +2253,20 @@ Q_EXTERN qboolean mergevisportals;
 Q_EXTERN qboolean nosort;
 Q_EXTERN qboolean saveprt;
 Q_EXTERN qboolean hint;             /* ydnar */
+Q_EXTERN qboolean visCache Q_ASSIGN( qfalse );
+Q_EXTERN float visCheckpoint Q_ASSIGN( 300.0f );
+Q_EXTERN qboolean sampledVis Q_ASSIGN( qfalse );
+Q_EXTERN int visSamples Q_ASSIGN( 8 );
+Q_EXTERN float visSampleEpsilon Q_ASSIGN( 12.0f );
+Q_EXTERN int visSampleHidden Q_ASSIGN( 8 );
+Q_EXTERN float visSampleMargin Q_ASSIGN( 16.0f );
+Q_EXTERN qboolean visSampleCheck Q_ASSIGN( qfalse );
+Q_EXTERN float visSampleBudget Q_ASSIGN( 0.0f );
+Q_EXTERN qboolean visBench Q_ASSIGN( qfalse );
+Q_EXTERN float visPassageMemory Q_ASSIGN( 0.0f );
+Q_EXTERN int visNetPort Q_ASSIGN( 0 );
+Q_EXTERN float visWorkerTimeout Q_ASSIGN( 600.0f );
+Q_EXTERN char visWorkerAddress[ 64 ];
 Q_EXTERN char inbase[ MAX_QPATH ];
 Q_EXTERN char globalCelShader[ MAX_QPATH ];
 
@@ -2174,6 +2287,9 @@ Q_EXTERN int c_portaltest, c_portalpass, c_portalcheck;
 Q_EXTERN int c_portalskip, c_leafskip;
 Q_EXTERN int c_vistest, c_mighttest;
 Q_EXTERN int c_chains;
+Q_EXTERN int c_mightseepruned;
+Q_EXTERN size_t c_passagebytes;
+Q_EXTERN int c_passagesdropped;
 
 Q_EXTERN byte               *vismap, *vismap_p, *vismap_end;
 
@@ -2184,7 +2300,7 @@ Q_EXTERN byte               *uncompressed;
 Q_EXTERN int leafbytes, leaflongs;
 Q_EXTERN int portalbytes, portallongs;
 
-Q_EXTERN vportal_t          *sorted_portals[ MAX_MAP_PORTALS * 2 ];
+Q_EXTERN vportal_t          **sorted_portals;
 
 
 
@@ -2207,6 +2323,7 @@ Q_EXTERN qboolean noGridLighting Q_ASSIGN( qfalse );
 
 Q_EXTERN qboolean noTrace Q_ASSIGN( qfalse );
 Q_EXTERN qboolean noSurfaces Q_ASSIGN( qfalse );
+Q_EXTERN qboolean traceBVH Q_ASSIGN( qfalse );
 Q_EXTERN qboolean patchShadows Q_ASSIGN( qfalse );
 
 Q_EXTERN qboolean deluxemap Q_ASSIGN( qfalse );
@@ -2222,6 +2339,7 @@ Q_EXTERN qboolean cheap Q_ASSIGN( qfalse );
 Q_EXTERN qboolean cheapgrid Q_ASSIGN( qfalse );
 Q_EXTERN int bounce Q_ASSIGN( 0 );
 Q_EXTERN qboolean bounceOnly Q_ASSIGN( qfalse );
+Q_EXTERN int bounceCheckpoint Q_ASSIGN( 0 );
 Q_EXTERN qboolean bouncing Q_ASSIGN( qfalse );
 Q_EXTERN qboolean bouncegrid Q_ASSIGN( qfalse );
 Q_EXTERN qboolean normalmap Q_ASSIGN( qfalse );
@@ -2237,6 +2355,9 @@ Q_EXTERN qboolean dark Q_ASSIGN( qfalse );
 Q_EXTERN qboolean sunOnly Q_ASSIGN( qfalse );
 Q_EXTERN int approximateTolerance Q_ASSIGN( 0 );
 Q_EXTERN qboolean noCollapse Q_ASSIGN( qfalse );
+Q_EXTERN qboolean noLightmapSort Q_ASSIGN( qfalse );
+Q_EXTERN qboolean lightCache Q_ASSIGN( qfalse );
+Q_EXTERN float previewTime Q_ASSIGN( 0.0f );
 Q_EXTERN int lightmapSearchBlockSize Q_ASSIGN( 0 );
 Q_EXTERN qboolean exportLightmaps Q_ASSIGN( qfalse );
 Q_EXTERN qboolean externalLightmaps Q_ASSIGN( qfalse );
@@ -2390,6 +2511,7 @@ Q_EXTERN int numRawSuperLuxels Q_ASSIGN( 0 );
 Q_EXTERN int numRawLightmaps Q_ASSIGN( 0 );
 Q_EXTERN rawLightmap_t      *rawLightmaps Q_ASSIGN( NULL );
 Q_EXTERN int                *sortLightmaps Q_ASSIGN( NULL );
+Q_EXTERN int                *illuminateOrder Q_ASSIGN( NULL );
 
 /* vertex luxels */
 Q_EXTERN float              *vertexLuxels[ MAX_LIGHTMAPS ];